@@ -0,0 +1,321 @@
+#include <linux/completion.h>
+#include <linux/random.h>
+
+#include "ndckpt_internal.h"
+
+// Microbenchmarks on the pmem mapping.
+// Write "<op> [flush] [fence] [threads] [node]" to /sys/kernel/ndckpt/bench
+// to run one and read it to get the results, e.g.
+//   echo "seq_write clwb sfence 4 0" > /sys/kernel/ndckpt/bench
+// Each op accesses one cache line. Writes are followed by the flush of the
+// line and the fence. rand_read chases pointers, so its ns_per_op is the
+// latency. Threads are bound to cpus of the node (any node if -1) and each
+// of them accesses its own slice of the buffer. Delays set in
+// /sys/kernel/ndckpt/emul are applied to the flushes and fences.
+//
+// The buffer is kept in pman by pman_get_bench_buf() and reused by runs on
+// later boots, so repeated runs do not leak pmem. Its contents are garbage.
+
+#define BENCH_BUF_SIZE (64ULL << 20)
+#define BENCH_DURATION_NS (1000ULL * 1000 * 1000)
+#define BENCH_MAX_THREADS 64
+#define BENCH_NUM_OF_RESULTS 32
+// ktime is checked once per this number of ops
+#define BENCH_OPS_PER_CHECK 1024
+
+enum BenchOp {
+	BENCH_OP_SEQ_READ,
+	BENCH_OP_SEQ_WRITE,
+	BENCH_OP_RAND_READ,
+	BENCH_OP_RAND_WRITE,
+};
+static const char *const bench_op_names[] = { "seq_read", "seq_write",
+					      "rand_read", "rand_write" };
+
+enum BenchFlush {
+	BENCH_FLUSH_NONE,
+	BENCH_FLUSH_CLWB,
+	BENCH_FLUSH_CLFLUSHOPT,
+	BENCH_FLUSH_CLFLUSH,
+	// Non-temporal stores. No flush is needed.
+	BENCH_FLUSH_NT,
+};
+static const char *const bench_flush_names[] = { "none", "clwb", "clflushopt",
+						 "clflush", "nt" };
+
+enum BenchFence {
+	BENCH_FENCE_NONE,
+	BENCH_FENCE_SFENCE,
+	BENCH_FENCE_MFENCE,
+};
+static const char *const bench_fence_names[] = { "none", "sfence", "mfence" };
+
+struct BenchResult {
+	int op;
+	int flush;
+	int fence;
+	int num_of_threads;
+	int node;
+	uint64_t num_of_ops;
+	// Sum of ns of all threads
+	uint64_t ns_sum;
+	// ns of the slowest thread
+	uint64_t ns_max;
+};
+
+struct BenchThread {
+	const struct BenchResult *params;
+	uint8_t *base;
+	uint64_t size;
+	struct completion *start;
+	struct completion done;
+	uint64_t num_of_ops;
+	uint64_t ns;
+	uint64_t sink;
+};
+
+static DEFINE_MUTEX(bench_lock);
+static uint8_t *bench_buf;
+static struct BenchResult bench_results[BENCH_NUM_OF_RESULTS];
+static int bench_num_of_results;
+
+static inline void bench_write_line(uint64_t *p, uint64_t v, int flush)
+{
+	int i;
+	if (flush == BENCH_FLUSH_NT) {
+		for (i = 0; i < L1_CACHE_BYTES / sizeof(uint64_t); i++)
+			asm volatile("movnti %1, %0" : "=m"(p[i]) : "r"(v));
+		if (static_branch_unlikely(&ndckpt_emul))
+			ndckpt_emul_write_back(1);
+		return;
+	}
+	for (i = 0; i < L1_CACHE_BYTES / sizeof(uint64_t); i++)
+		WRITE_ONCE(p[i], v);
+	switch (flush) {
+	case BENCH_FLUSH_CLWB:
+		ndckpt_flush_line(p, NDCKPT_FLUSH_CLWB);
+		break;
+	case BENCH_FLUSH_CLFLUSHOPT:
+		ndckpt_flush_line(p, NDCKPT_FLUSH_CLFLUSHOPT);
+		break;
+	case BENCH_FLUSH_CLFLUSH:
+		ndckpt_flush_line(p, NDCKPT_FLUSH_CLFLUSH);
+		break;
+	}
+	if (flush != BENCH_FLUSH_NONE && static_branch_unlikely(&ndckpt_emul))
+		ndckpt_emul_write_back(1);
+}
+
+static inline uint64_t bench_read_line(uint64_t *p)
+{
+	uint64_t sum = 0;
+	int i;
+	for (i = 0; i < L1_CACHE_BYTES / sizeof(uint64_t); i++)
+		sum += READ_ONCE(p[i]);
+	return sum;
+}
+
+static inline void bench_fence(int fence)
+{
+	if (fence == BENCH_FENCE_SFENCE)
+		ndckpt_sfence();
+	else if (fence == BENCH_FENCE_MFENCE)
+		ndckpt_mfence();
+}
+
+static inline uint64_t bench_next_line(uint64_t idx, uint64_t num_of_lines)
+{
+	// Full period LCG since num_of_lines is a power of 2.
+	// See Knuth, TAOCP Vol. 2, 3.2.1.2
+	return (idx * 6364136223846793005ULL + 1442695040888963407ULL) &
+	       (num_of_lines - 1);
+}
+
+static void bench_prepare_chain(struct BenchThread *t, uint64_t num_of_lines)
+{
+	// Each line holds the offset of the next line to read.
+	uint64_t idx;
+	for (idx = 0; idx < num_of_lines; idx++) {
+		*(uint64_t *)(t->base + idx * L1_CACHE_BYTES) =
+			bench_next_line(idx, num_of_lines) * L1_CACHE_BYTES;
+	}
+	ndckpt_clwb_range(t->base, num_of_lines * L1_CACHE_BYTES);
+	ndckpt_sfence();
+}
+
+static int bench_worker(void *arg)
+{
+	struct BenchThread *t = arg;
+	const struct BenchResult *p = t->params;
+	const uint64_t num_of_lines =
+		rounddown_pow_of_two(t->size / L1_CACHE_BYTES);
+	uint64_t idx = 0;
+	uint64_t ofs = 0;
+	uint64_t sum = 0;
+	uint64_t i, t0, t1;
+
+	if (p->op == BENCH_OP_RAND_READ)
+		bench_prepare_chain(t, num_of_lines);
+	wait_for_completion(t->start);
+	t0 = ktime_get_ns();
+	do {
+		for (i = 0; i < BENCH_OPS_PER_CHECK; i++) {
+			switch (p->op) {
+			case BENCH_OP_SEQ_READ:
+				sum += bench_read_line(
+					(uint64_t *)(t->base +
+						     idx * L1_CACHE_BYTES));
+				idx = (idx + 1) & (num_of_lines - 1);
+				break;
+			case BENCH_OP_SEQ_WRITE:
+				bench_write_line((uint64_t *)(t->base +
+							      idx * L1_CACHE_BYTES),
+						 idx, p->flush);
+				bench_fence(p->fence);
+				idx = (idx + 1) & (num_of_lines - 1);
+				break;
+			case BENCH_OP_RAND_READ:
+				ofs = READ_ONCE(*(uint64_t *)(t->base + ofs));
+				break;
+			case BENCH_OP_RAND_WRITE:
+				idx = bench_next_line(idx, num_of_lines);
+				bench_write_line((uint64_t *)(t->base +
+							      idx * L1_CACHE_BYTES),
+						 idx, p->flush);
+				bench_fence(p->fence);
+				break;
+			}
+		}
+		t->num_of_ops += BENCH_OPS_PER_CHECK;
+		t1 = ktime_get_ns();
+	} while (t1 - t0 < BENCH_DURATION_NS);
+	t->ns = t1 - t0;
+	// Keep reads from being optimized out
+	t->sink = sum + ofs;
+	complete(&t->done);
+	return 0;
+}
+
+static int bench_pick_cpu(int node, int prev)
+{
+	const struct cpumask *mask =
+		node < 0 ? cpu_online_mask : cpumask_of_node(node);
+	int cpu = cpumask_next_and(prev, mask, cpu_online_mask);
+	if (cpu >= nr_cpu_ids)
+		cpu = cpumask_first_and(mask, cpu_online_mask);
+	return cpu;
+}
+
+static int bench_run_threads(struct BenchResult *r)
+{
+	DECLARE_COMPLETION_ONSTACK(start);
+	const uint64_t slice_size =
+		rounddown(BENCH_BUF_SIZE / r->num_of_threads, PAGE_SIZE);
+	struct BenchThread *threads;
+	struct task_struct *task;
+	int cpu = -1;
+	int i, num_of_started = 0;
+
+	threads = kcalloc(r->num_of_threads, sizeof(*threads), GFP_KERNEL);
+	if (!threads)
+		return -ENOMEM;
+	for (i = 0; i < r->num_of_threads; i++) {
+		struct BenchThread *t = &threads[i];
+		cpu = bench_pick_cpu(r->node, cpu);
+		if (cpu >= nr_cpu_ids)
+			break;
+		t->params = r;
+		t->base = bench_buf + slice_size * i;
+		t->size = slice_size;
+		t->start = &start;
+		init_completion(&t->done);
+		task = kthread_create_on_node(bench_worker, t, cpu_to_node(cpu),
+					      "ndckpt_bench/%d", i);
+		if (IS_ERR(task))
+			break;
+		kthread_bind(task, cpu);
+		wake_up_process(task);
+		num_of_started++;
+	}
+	complete_all(&start);
+	for (i = 0; i < num_of_started; i++) {
+		wait_for_completion(&threads[i].done);
+		r->num_of_ops += threads[i].num_of_ops;
+		r->ns_sum += threads[i].ns;
+		r->ns_max = max(r->ns_max, threads[i].ns);
+	}
+	kfree(threads);
+	if (num_of_started < r->num_of_threads) {
+		pr_info("ndckpt: bench: only %d threads started\n",
+			num_of_started);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+int bench_run(const char *args)
+{
+	struct PersistentMemoryManager *pman = first_pmem_device->virt_addr;
+	char op[16], flush[16] = "none", fence[16] = "none";
+	struct BenchResult r = { .num_of_threads = 1, .node = NUMA_NO_NODE };
+	int error;
+
+	if (sscanf(args, "%15s %15s %15s %d %d", op, flush, fence,
+		   &r.num_of_threads, &r.node) < 1)
+		return -EINVAL;
+	r.op = match_string(bench_op_names, ARRAY_SIZE(bench_op_names), op);
+	r.flush = match_string(bench_flush_names,
+			       ARRAY_SIZE(bench_flush_names), flush);
+	r.fence = match_string(bench_fence_names,
+			       ARRAY_SIZE(bench_fence_names), fence);
+	if (r.op < 0 || r.flush < 0 || r.fence < 0 || r.num_of_threads < 1 ||
+	    r.num_of_threads > BENCH_MAX_THREADS ||
+	    (r.node != NUMA_NO_NODE && !node_online(r.node)))
+		return -EINVAL;
+	if ((r.flush == BENCH_FLUSH_CLWB &&
+	     !static_cpu_has(X86_FEATURE_CLWB)) ||
+	    (r.flush == BENCH_FLUSH_CLFLUSHOPT &&
+	     !static_cpu_has(X86_FEATURE_CLFLUSHOPT)))
+		return -EOPNOTSUPP;
+	if (!pman_is_valid(pman))
+		return -EINVAL;
+
+	mutex_lock(&bench_lock);
+	// pman may have been initialized again since the last run.
+	bench_buf = pman_get_bench_buf(pman,
+				       BENCH_BUF_SIZE >> kPageSizeExponent);
+	pr_info("ndckpt: bench: %s %s %s threads=%d node=%d\n",
+		bench_op_names[r.op], bench_flush_names[r.flush],
+		bench_fence_names[r.fence], r.num_of_threads, r.node);
+	error = bench_run_threads(&r);
+	if (!error) {
+		bench_results[bench_num_of_results % BENCH_NUM_OF_RESULTS] = r;
+		bench_num_of_results++;
+	}
+	mutex_unlock(&bench_lock);
+	return error;
+}
+
+ssize_t bench_show(char *buf)
+{
+	// Results of the last BENCH_NUM_OF_RESULTS runs, oldest first.
+	// MB/s is calculated with the slowest thread.
+	ssize_t count = 0;
+	int i;
+	mutex_lock(&bench_lock);
+	i = max(0, bench_num_of_results - BENCH_NUM_OF_RESULTS);
+	for (; i < bench_num_of_results; i++) {
+		const struct BenchResult *r =
+			&bench_results[i % BENCH_NUM_OF_RESULTS];
+		count += scnprintf(
+			buf + count, PAGE_SIZE - count,
+			"op=%s flush=%s fence=%s threads=%d node=%d ops=%llu ns=%llu MBps=%llu ns_per_op=%llu\n",
+			bench_op_names[r->op], bench_flush_names[r->flush],
+			bench_fence_names[r->fence], r->num_of_threads, r->node,
+			r->num_of_ops, r->ns_max,
+			r->num_of_ops * L1_CACHE_BYTES * 1000 / r->ns_max,
+			r->ns_sum / r->num_of_ops);
+	}
+	mutex_unlock(&bench_lock);
+	return count;
+}
@@ -0,0 +1,73 @@
+#include <linux/binfmts.h>
+#include <asm/elf.h>
+
+#include "ndckpt_internal.h"
+
+// Restore a checkpointed process without loading ELF.
+// The loader enables ndckpt with prctl(PR_ENABLE_NDCKPT, id) and executes
+// the checkpointed binary with empty argv and envp. If the checkpoint can
+// be rebuilt from the persisted vmas and the given file, mm is built here
+// and ndckpt_handle_execve() restores registers and page tables as usual.
+// Otherwise this falls back to the ELF loader.
+
+static struct linux_binfmt ndckpt_format;
+
+static int load_ndckpt_binary(struct linux_binprm *bprm)
+{
+	struct PersistentMemoryManager *pman;
+	struct PersistentProcessInfo *pproc;
+	struct vm_area_struct *tmp_stack;
+	int retval;
+
+	if (!(current->flags & PF_NDCKPT_ENABLED) || !current->ndckpt_id ||
+	    !first_pmem_device)
+		return -ENOEXEC;
+	pman = first_pmem_device->virt_addr;
+	pproc = pman_find_proc_info(pman, current->ndckpt_id);
+	if (!pproc || !pproc_is_restorable_from_file(pproc, bprm->file))
+		return -ENOEXEC;
+	pr_ndckpt_restore("restore without exec. pid = %d\n", current->pid);
+
+	retval = flush_old_exec(bprm);
+	if (retval)
+		return retval;
+	setup_new_exec(bprm);
+	// Drop the stack for argv made by bprm_mm_init().
+	// The original one is mapped by pproc_build_mm().
+	tmp_stack = bprm->vma;
+	retval = vm_munmap(tmp_stack->vm_start,
+			   tmp_stack->vm_end - tmp_stack->vm_start);
+	if (retval)
+		return retval;
+	retval = pproc_build_mm(pproc, current->mm, bprm->file);
+	if (retval)
+		return retval;
+	install_exec_creds(bprm);
+	set_binfmt(&ndckpt_format);
+#ifdef ARCH_HAS_SETUP_ADDITIONAL_PAGES
+	retval = arch_setup_additional_pages(bprm, 0);
+	if (retval < 0)
+		return retval;
+#endif
+	finalize_exec(bprm);
+	// Registers are overwritten by pproc_restore().
+	start_thread(current_pt_regs(), current->mm->start_code,
+		     current->mm->start_stack);
+	return 0;
+}
+
+static struct linux_binfmt ndckpt_format = {
+	.module = THIS_MODULE,
+	.load_binary = load_ndckpt_binary,
+};
+
+void ndckpt_register_binfmt(void)
+{
+	// Inserted before ELF to be tried first.
+	insert_binfmt(&ndckpt_format);
+}
+
+void ndckpt_unregister_binfmt(void)
+{
+	unregister_binfmt(&ndckpt_format);
+}
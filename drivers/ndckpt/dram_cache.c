@@ -0,0 +1,244 @@
+#include "ndckpt_internal.h"
+
+// DRAM write-back cache for hot pages in target vmas.
+// Dirty pages in hot chunks are promoted on commit: the pte of the next
+// running ctx is pointed to a DRAM copy of its NVDIMM page (the home), so
+// stores between commits do not hit NVDIMM. On the next commit, the DRAM
+// page is written back to its home and the home is mapped again before the
+// running ctx becomes valid. Thus a valid ctx never maps DRAM pages.
+// Pages still written since the last commit are installed again to the next
+// ctx after sync, and others are demoted.
+//
+// page->private of a cached page holds the paddr of the home page and
+// page->index holds the vaddr where it was mapped on the last commit.
+
+#define DRAM_CACHE_NUM_OF_CANDIDATES PTRS_PER_PTE
+
+struct DramCacheState {
+	// Pages mapped in the running ctx
+	struct list_head pages;
+	// Pages seen and written back on this commit
+	struct list_head kept;
+	uint64_t num_of_kept;
+	// Pages freed after the cr3 switch
+	struct list_head demoted;
+	// Pages to be promoted on this commit
+	int num_of_candidates;
+	uint64_t candidates[DRAM_CACHE_NUM_OF_CANDIDATES];
+};
+
+struct DramCacheState *dram_cache_alloc(void)
+{
+	struct DramCacheState *cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (!cache)
+		return NULL;
+	INIT_LIST_HEAD(&cache->pages);
+	INIT_LIST_HEAD(&cache->kept);
+	INIT_LIST_HEAD(&cache->demoted);
+	return cache;
+}
+
+static void free_page_list(struct list_head *list)
+{
+	struct page *page, *tmp;
+	list_for_each_entry_safe(page, tmp, list, lru) {
+		list_del(&page->lru);
+		set_page_private(page, 0);
+		__free_page(page);
+	}
+}
+
+void dram_cache_free(struct DramCacheState *cache)
+{
+	// Ptes of the running ctx may still point the pages.
+	// They should never be used again.
+	free_page_list(&cache->pages);
+	free_page_list(&cache->kept);
+	free_page_list(&cache->demoted);
+	kfree(cache);
+}
+
+static inline void map_home_page(pte_t *e, uint64_t home)
+{
+	e->pte = (e->pte & ~PTE_PFN_MASK & ~_PAGE_SPECIAL &
+		  ~_PAGE_NDCKPT_CACHED) |
+		 home;
+	ndckpt_clwb(e);
+}
+
+void dram_cache_writeback_page(struct DramCacheState *cache, pte_t *e,
+			       uint64_t addr)
+{
+	// e is in PAGE_STATE_Pvc of the running ctx being committed.
+	struct page *page = pte_page(*e);
+	uint64_t home = page_private(page);
+	bool dirty = (e->pte & _PAGE_DIRTY) != 0;
+	BUG_ON(!ndckpt_is_phys_addr_in_nvdimm(home));
+	if (dirty)
+		memcpy_and_clwb(ndckpt_phys_to_virt(home), page_address(page),
+				PAGE_SIZE);
+	// Home has been flushed here
+	e->pte &= ~(uint64_t)_PAGE_DIRTY;
+	map_home_page(e, home);
+	list_del(&page->lru);
+	if (dirty && cache->num_of_kept < ndckpt_dram_cache_pages) {
+		page->index = addr;
+		list_add_tail(&page->lru, &cache->kept);
+		cache->num_of_kept++;
+		return;
+	}
+	// Not written since the last commit
+	list_add_tail(&page->lru, &cache->demoted);
+}
+
+void dram_cache_add_candidate(struct DramCacheState *cache, uint64_t addr)
+{
+	if (cache->num_of_candidates >= DRAM_CACHE_NUM_OF_CANDIDATES ||
+	    cache->num_of_kept + cache->num_of_candidates >=
+		    ndckpt_dram_cache_pages)
+		return;
+	cache->candidates[cache->num_of_candidates++] = addr;
+}
+
+static pte_t *lookup_pte(pgd_t *t4, uint64_t addr)
+{
+	pgd_t *e4;
+	pud_t *t3;
+	pud_t *e3;
+	pmd_t *t2;
+	pmd_t *e2;
+	pte_t *t1;
+	traverse_pml4e(addr, t4, &e4, &t3);
+	if (!t3)
+		return NULL;
+	traverse_pdpte(addr, t3, &e3, &t2);
+	if (!t2)
+		return NULL;
+	traverse_pde(addr, t2, &e2, &t1);
+	if (!t1 || ndckpt_is_pmd_huge(*e2))
+		return NULL;
+	return &t1[PADDR_TO_IDX_IN_PT(addr)];
+}
+
+static bool install_page(struct DramCacheState *cache, pgd_t *t4,
+			 struct page *page, uint64_t addr, bool copy)
+{
+	// Map page in place of the NVDIMM page at addr of t4.
+	// If copy is false, the content of page should be the same as it.
+	pte_t *e = lookup_pte(t4, addr);
+	uint64_t home;
+	if (!e || !IS_PAGE_STATE_ON_NVDIMM(page_state_pte(e)) ||
+	    ndckpt_is_pte_cow(*e) || !(e->pte & _PAGE_RW))
+		return false;
+	home = e->pte & PTE_PFN_MASK;
+	if (copy)
+		memcpy(page_address(page), ndckpt_phys_to_virt(home),
+		       PAGE_SIZE);
+	set_page_private(page, home);
+	page->index = addr;
+	// t4 is not used until the cr3 switch, so no need to invalidate
+	e->pte = (e->pte & ~PTE_PFN_MASK & ~_PAGE_DIRTY) | page_to_phys(page) |
+		 _PAGE_SPECIAL | _PAGE_NDCKPT_CACHED;
+	ndckpt_clwb(e);
+	list_add_tail(&page->lru, &cache->pages);
+	return true;
+}
+
+void dram_cache_install(struct DramCacheState *cache, pgd_t *t4)
+{
+	// Called after sync of contexts. t4 is the next running ctx.
+	struct page *page, *tmp;
+	uint64_t num_of_pages = 0;
+	int i;
+	// Pages not seen on this commit have been unmapped.
+	list_splice_init(&cache->pages, &cache->demoted);
+	list_for_each_entry_safe(page, tmp, &cache->kept, lru) {
+		list_del(&page->lru);
+		if (install_page(cache, t4, page, page->index, false)) {
+			num_of_pages++;
+			continue;
+		}
+		list_add_tail(&page->lru, &cache->demoted);
+	}
+	for (i = 0; i < cache->num_of_candidates &&
+		    num_of_pages < ndckpt_dram_cache_pages;
+	     i++) {
+		// Commit can not sleep
+		page = alloc_page(GFP_NOWAIT | __GFP_NOWARN);
+		if (!page)
+			break;
+		if (!install_page(cache, t4, page, cache->candidates[i],
+				  true)) {
+			__free_page(page);
+			continue;
+		}
+		num_of_pages++;
+	}
+	ndckpt_sfence();
+	cache->num_of_kept = 0;
+	cache->num_of_candidates = 0;
+	pr_ndckpt_ckpt("%lld pages are cached on DRAM\n", num_of_pages);
+}
+
+void dram_cache_free_demoted(struct DramCacheState *cache)
+{
+	// Called after the cr3 switch, so no TLB entry points them.
+	free_page_list(&cache->demoted);
+}
+
+static void evict_pages(pgd_t *t4, uint64_t start, uint64_t end)
+{
+	uint64_t addr;
+	pgd_t *e4;
+	pud_t *t3 = NULL;
+	pud_t *e3;
+	pmd_t *t2 = NULL;
+	pmd_t *e2;
+	pte_t *t1 = NULL;
+	pte_t *e1;
+	void *page_vaddr;
+	struct page *page;
+	for (addr = start; addr < end;) {
+		traverse_pml4e(addr, t4, &e4, &t3);
+		if (!t3) {
+			addr = next_pml4e_addr(addr);
+			continue;
+		}
+		traverse_pdpte(addr, t3, &e3, &t2);
+		if (!t2) {
+			addr = next_pdpte_addr(addr);
+			continue;
+		}
+		traverse_pde(addr, t2, &e2, &t1);
+		if (!t1 || ndckpt_is_pmd_huge(*e2)) {
+			addr = next_pde_addr(addr);
+			continue;
+		}
+		traverse_pte(addr, t1, &e1, &page_vaddr);
+		if (page_state_pte(e1) == PAGE_STATE_Pvc) {
+			page = pte_page(*e1);
+			if (e1->pte & _PAGE_DIRTY)
+				memcpy_and_clwb(ndckpt_phys_to_virt(
+							page_private(page)),
+						page_vaddr, PAGE_SIZE);
+			map_home_page(e1, page_private(page));
+		}
+		addr = next_pte_addr(addr);
+	}
+}
+
+void dram_cache_evict(struct DramCacheState *cache, struct mm_struct *mm)
+{
+	// Write back all cached pages and map their homes in the running ctx.
+	// Used before pages of the running ctx are shared with others.
+	struct vm_area_struct *vma;
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (!ndckpt_is_target_vma(vma)) {
+			continue;
+		}
+		evict_pages(mm->pgd, vma->vm_start, vma->vm_end);
+	}
+	ndckpt_sfence();
+	flush_tlb_mm(mm);
+	free_page_list(&cache->pages);
+}
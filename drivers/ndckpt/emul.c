@@ -0,0 +1,89 @@
+#include "ndckpt_internal.h"
+
+// Emulation of slow NVDIMM on pmem backed by DRAM (memmap= or nfit_test).
+// Write "<wb_ns> <fence_ns> <bandwidth_mbps>" to /sys/kernel/ndckpt/emul
+// to enable it, or "0 0 0" to disable it.
+//
+// Lines written back by ndckpt_clwb() and ndckpt_clwb_range() are queued
+// per cpu and drained one after another, wb_ns per line. They also share
+// bandwidth_mbps of the device with all other cpus if it is not 0.
+// ndckpt_sfence() and ndckpt_mfence() spin until all lines queued on the cpu
+// are drained, plus fence_ns. Write-backs are asynchronous until a fence as
+// on real hardware, so batching them before one fence is still cheaper.
+//
+// Nothing is queued with NDCKPT_FLUSH_NONE. Reads are not slowed down.
+
+DEFINE_STATIC_KEY_FALSE(ndckpt_emul);
+EXPORT_SYMBOL(ndckpt_emul);
+
+static DEFINE_MUTEX(emul_lock);
+static uint64_t emul_wb_ns;
+static uint64_t emul_fence_ns;
+static uint64_t emul_bandwidth_mbps;
+// ktime when all lines queued on the cpu are drained
+static DEFINE_PER_CPU(uint64_t, emul_drained_ns);
+// ktime when the device becomes idle, shared by all cpus
+static atomic64_t emul_device_idle_ns = ATOMIC64_INIT(0);
+
+static uint64_t emul_reserve_bandwidth(uint64_t now, uint64_t bytes)
+{
+	// Returns when the transfer of bytes queued at now completes.
+	// 1 MB/s is 1 byte per 1000 ns.
+	const uint64_t mbps = READ_ONCE(emul_bandwidth_mbps);
+	const uint64_t cost = mbps ? bytes * 1000 / mbps : 0;
+	s64 idle, start;
+	do {
+		idle = atomic64_read(&emul_device_idle_ns);
+		start = max_t(s64, idle, now);
+	} while (atomic64_cmpxchg(&emul_device_idle_ns, idle, start + cost) !=
+		 idle);
+	return start + cost;
+}
+
+void ndckpt_emul_write_back(size_t num_of_lines)
+{
+	const uint64_t now = ktime_get_ns();
+	uint64_t drained =
+		max(this_cpu_read(emul_drained_ns), now) +
+		num_of_lines * READ_ONCE(emul_wb_ns);
+	if (READ_ONCE(emul_bandwidth_mbps))
+		drained = max(drained, emul_reserve_bandwidth(
+					       now, num_of_lines * kCacheLineSize));
+	this_cpu_write(emul_drained_ns, drained);
+}
+EXPORT_SYMBOL(ndckpt_emul_write_back);
+
+void ndckpt_emul_fence(void)
+{
+	// The task may migrate after the write-backs. Lines queued on the
+	// previous cpu are not waited for then, which is fine for emulation.
+	const uint64_t until = max(this_cpu_read(emul_drained_ns),
+				   ktime_get_ns()) +
+			       READ_ONCE(emul_fence_ns);
+	while (ktime_get_ns() < until)
+		cpu_relax();
+}
+EXPORT_SYMBOL(ndckpt_emul_fence);
+
+int ndckpt_set_emul(uint64_t wb_ns, uint64_t fence_ns, uint64_t bandwidth_mbps)
+{
+	if (!first_pmem_device)
+		return -ENODEV;
+	mutex_lock(&emul_lock);
+	WRITE_ONCE(emul_wb_ns, wb_ns);
+	WRITE_ONCE(emul_fence_ns, fence_ns);
+	WRITE_ONCE(emul_bandwidth_mbps, bandwidth_mbps);
+	if (wb_ns || fence_ns || bandwidth_mbps)
+		static_branch_enable(&ndckpt_emul);
+	else
+		static_branch_disable(&ndckpt_emul);
+	mutex_unlock(&emul_lock);
+	return 0;
+}
+
+ssize_t ndckpt_emul_show(char *buf)
+{
+	return sprintf(buf, "wb_ns=%llu fence_ns=%llu bandwidth_mbps=%llu\n",
+		       READ_ONCE(emul_wb_ns), READ_ONCE(emul_fence_ns),
+		       READ_ONCE(emul_bandwidth_mbps));
+}
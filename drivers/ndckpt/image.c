@@ -0,0 +1,796 @@
+#include <linux/file.h>
+#include <linux/vmalloc.h>
+#include <linux/lz4.h>
+#include <linux/crc32.h>
+#include <uapi/linux/prctl.h>
+
+#include "ndckpt_internal.h"
+
+// Export of checkpoints to a file or a block device.
+// prctl(PR_EXPORT_NDCKPT, obj_id, fd, flags) writes the valid ctx of the
+// pproc at obj_id, or the one started or restored last if obj_id is 0,
+// to fd at its current offset:
+//
+//   struct ImageHeader
+//   ctx state: registers, vmas and mm layout. See pproc_get_ctx_state().
+//   struct ImageChunk, attrs and data, for each 2MiB range with pages
+//   struct ImageChunk of IMAGE_CHUNK_END
+//
+// Only pages on NVDIMM are exported, so untouched pages are skipped.
+// Pages filled with zero are marked in a bitmap without data. With
+// PR_NDCKPT_EXPORT_LZ4, data of each chunk is compressed with LZ4 if it
+// gets smaller. Chunks are packed and compressed on all cpus and written
+// in order by the caller.
+//
+// A commit or restore of the process overwrites the exported ctx, so the
+// export fails with -EAGAIN if one happens meanwhile. Stop the process
+// (or let it exit) while exporting it.
+//
+// Images are imported by ndckpt_import_image() below.
+
+#define IMAGE_MAGIC 0x31474D4954504B43ULL // "CKPTIMG1"
+#define IMAGE_VERSION 3
+
+struct ImageHeader {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t flags; // PR_NDCKPT_EXPORT_*
+	uint64_t obj_id; // of the exported pproc
+	uint64_t ctx_state_size;
+	// Present pages in 4KiB pages, and chunks of them. An import checks
+	// free pmem with these before allocating anything.
+	uint64_t num_of_pages;
+	uint64_t num_of_chunks;
+};
+
+#define IMAGE_CHUNK_PT 1 // Pages mapped by a page table
+#define IMAGE_CHUNK_HUGE 2 // A 2MiB page
+#define IMAGE_CHUNK_END 3
+
+#define IMAGE_CHUNK_FLAG_LZ4 1
+
+struct ImageChunk {
+	uint32_t type;
+	uint32_t flags;
+	uint64_t addr; // aligned to PMD_SIZE
+	// Bit i is for the page at addr + i * PAGE_SIZE, or the 2MiB page.
+	uint64_t present[PTRS_PER_PTE / 64];
+	uint64_t zero[PTRS_PER_PTE / 64];
+	uint32_t num_of_pages; // bits set in present
+	uint32_t raw_size; // bytes of data before compression
+	uint32_t data_size; // bytes of data in the image
+	uint32_t crc; // crc32_le of attrs and data
+	// Followed by uint64_t attrs[num_of_pages] of present pages, which are
+	// page_fixed_attr_pte() or huge_page_fixed_attr_pde(), and data of
+	// present pages which are not zero.
+};
+
+#define IMAGE_MAX_WORKS 16
+// Max data_size of a chunk
+#define IMAGE_DATA_MAX LZ4_COMPRESSBOUND(PMD_SIZE)
+
+struct ImageWork {
+	struct work_struct work;
+	struct completion done;
+	struct ImageChunk chunk;
+	uint64_t attrs[PTRS_PER_PTE];
+	// Pages on NVDIMM. All present ones on export, and ones with data on
+	// import.
+	uint64_t paddrs[PTRS_PER_PTE];
+	uint8_t *raw; // PMD_SIZE
+	uint8_t *buf; // IMAGE_DATA_MAX
+	void *lz4_wrkmem;
+	const uint8_t *data;
+	bool queued;
+	int error;
+};
+
+struct ImageFile {
+	struct file *file;
+	loff_t pos;
+	int error;
+	uint64_t num_of_pages;
+	uint64_t num_of_zero_pages;
+	uint64_t bytes;
+};
+
+// Same as file_pos_read() / file_pos_write() of fs/read_write.c.
+// Callers hold the file by fdget_pos() like read(2) and write(2).
+static inline loff_t image_file_pos_read(struct file *file)
+{
+	return file->f_mode & FMODE_STREAM ? 0 : file->f_pos;
+}
+
+static inline void image_file_pos_write(struct file *file, loff_t pos)
+{
+	if ((file->f_mode & FMODE_STREAM) == 0)
+		file->f_pos = pos;
+}
+
+static void image_write(struct ImageFile *f, const void *buf, size_t size)
+{
+	ssize_t written;
+	while (!f->error && size) {
+		written = kernel_write(f->file, buf, size, &f->pos);
+		if (written <= 0) {
+			f->error = written ? written : -EIO;
+			return;
+		}
+		buf += written;
+		size -= written;
+		f->bytes += written;
+	}
+}
+
+static void image_read(struct ImageFile *f, void *buf, size_t size)
+{
+	ssize_t read;
+	while (!f->error && size) {
+		read = kernel_read(f->file, buf, size, &f->pos);
+		if (read <= 0) {
+			// Truncated
+			f->error = read ? read : -EIO;
+			return;
+		}
+		buf += read;
+		size -= read;
+		f->bytes += read;
+	}
+}
+
+static void image_works_free(struct ImageWork *works, int num_of_works)
+{
+	int i;
+	for (i = 0; i < num_of_works; i++) {
+		vfree(works[i].raw);
+		vfree(works[i].buf);
+		kfree(works[i].lz4_wrkmem);
+	}
+	kvfree(works);
+}
+
+static struct ImageWork *image_works_alloc(int num_of_works, bool buf,
+					   bool lz4_wrkmem)
+{
+	struct ImageWork *works =
+		kvcalloc(num_of_works, sizeof(*works), GFP_KERNEL);
+	int i;
+	if (!works)
+		return NULL;
+	for (i = 0; i < num_of_works; i++) {
+		struct ImageWork *w = &works[i];
+		w->raw = vmalloc(PMD_SIZE);
+		if (!w->raw)
+			goto fail;
+		if (buf && !(w->buf = vmalloc(IMAGE_DATA_MAX)))
+			goto fail;
+		if (lz4_wrkmem &&
+		    !(w->lz4_wrkmem = kmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL)))
+			goto fail;
+	}
+	return works;
+fail:
+	image_works_free(works, num_of_works);
+	return NULL;
+}
+
+static uint32_t image_chunk_crc(struct ImageWork *w)
+{
+	uint32_t crc = crc32_le(~0, (const uint8_t *)w->attrs,
+				w->chunk.num_of_pages * sizeof(uint64_t));
+	return crc32_le(crc, w->data, w->chunk.data_size);
+}
+
+static void image_queue_work(struct ImageWork *w, work_func_t fn)
+{
+	INIT_WORK(&w->work, fn);
+	init_completion(&w->done);
+	w->queued = true;
+	queue_work(system_unbound_wq, &w->work);
+}
+
+static void image_wait_work(struct ImageWork *w)
+{
+	if (!w->queued)
+		return;
+	wait_for_completion(&w->done);
+	w->queued = false;
+}
+
+static void export_work_fn(struct work_struct *work)
+{
+	// Gathers pages of the chunk into raw, then compresses it.
+	struct ImageWork *w = container_of(work, struct ImageWork, work);
+	struct ImageChunk *c = &w->chunk;
+	const size_t page_size =
+		c->type == IMAGE_CHUNK_HUGE ? PMD_SIZE : PAGE_SIZE;
+	size_t raw_size = 0;
+	int i, n = 0, compressed;
+
+	for (i = 0; i < PTRS_PER_PTE; i++) {
+		if (!test_bit(i, (unsigned long *)c->present))
+			continue;
+		memcpy(w->raw + raw_size, ndckpt_p2v(w->paddrs[n++]),
+		       page_size);
+		if (!memchr_inv(w->raw + raw_size, 0, page_size))
+			__set_bit(i, (unsigned long *)c->zero);
+		else
+			raw_size += page_size;
+	}
+	c->raw_size = raw_size;
+	c->data_size = raw_size;
+	w->data = w->raw;
+	if (w->lz4_wrkmem && raw_size) {
+		compressed = LZ4_compress_default(
+			(const char *)w->raw, (char *)w->buf, raw_size,
+			IMAGE_DATA_MAX, w->lz4_wrkmem);
+		if (compressed > 0 && compressed < raw_size) {
+			c->flags |= IMAGE_CHUNK_FLAG_LZ4;
+			c->data_size = compressed;
+			w->data = w->buf;
+		}
+	}
+	c->crc = image_chunk_crc(w);
+	complete(&w->done);
+}
+
+struct ExportState {
+	struct ImageFile *img;
+	struct ImageWork *works;
+	int num_of_works;
+	uint64_t num_of_queued;
+	// Only num_of_pages and num_of_chunks are counted if set.
+	bool count_only;
+	uint64_t num_of_pages;
+	uint64_t num_of_chunks;
+};
+
+static void export_write_work(struct ImageFile *img, struct ImageWork *w)
+{
+	struct ImageChunk *c = &w->chunk;
+	image_wait_work(w);
+	image_write(img, c, sizeof(*c));
+	image_write(img, w->attrs, c->num_of_pages * sizeof(uint64_t));
+	image_write(img, w->data, c->data_size);
+	img->num_of_pages += c->num_of_pages;
+	img->num_of_zero_pages +=
+		bitmap_weight((unsigned long *)c->zero, PTRS_PER_PTE);
+}
+
+static struct ImageWork *export_next_work(struct ExportState *st, int type,
+					  uint64_t addr)
+{
+	// Returns a free work, writing the chunk queued on it before.
+	struct ImageWork *w = &st->works[st->num_of_queued % st->num_of_works];
+	if (st->num_of_queued >= st->num_of_works)
+		export_write_work(st->img, w);
+	memset(&w->chunk, 0, sizeof(w->chunk));
+	w->chunk.type = type;
+	w->chunk.addr = addr;
+	return w;
+}
+
+static void export_queue_work(struct ExportState *st, struct ImageWork *w)
+{
+	image_queue_work(w, export_work_fn);
+	st->num_of_queued++;
+}
+
+static void export_pt(struct ExportState *st, uint64_t addr, pte_t *t1)
+{
+	struct ImageWork *w = NULL;
+	uint64_t num_of_pages = 0;
+	int i;
+	for (i = 0; i < PTRS_PER_PTE; i++) {
+		if (!IS_PAGE_STATE_ON_NVDIMM(page_state_pte(&t1[i])))
+			continue;
+		if (st->count_only) {
+			num_of_pages++;
+			continue;
+		}
+		if (!w)
+			w = export_next_work(st, IMAGE_CHUNK_PT, addr);
+		__set_bit(i, (unsigned long *)w->chunk.present);
+		w->attrs[w->chunk.num_of_pages] = page_fixed_attr_pte(&t1[i]);
+		w->paddrs[w->chunk.num_of_pages] = t1[i].pte & PTE_PFN_MASK;
+		w->chunk.num_of_pages++;
+	}
+	if (w)
+		export_queue_work(st, w);
+	if (num_of_pages) {
+		st->num_of_pages += num_of_pages;
+		st->num_of_chunks++;
+	}
+}
+
+static void export_huge_page(struct ExportState *st, uint64_t addr, pmd_t *e2)
+{
+	struct ImageWork *w;
+	if (st->count_only) {
+		st->num_of_pages += PTRS_PER_PTE;
+		st->num_of_chunks++;
+		return;
+	}
+	w = export_next_work(st, IMAGE_CHUNK_HUGE, addr);
+	__set_bit(0, (unsigned long *)w->chunk.present);
+	w->attrs[0] = huge_page_fixed_attr_pde(e2);
+	w->paddrs[0] = ndckpt_huge_page_paddr(*e2);
+	w->chunk.num_of_pages = 1;
+	export_queue_work(st, w);
+}
+
+static void export_ctx_pages(struct ExportState *st, pgd_t *t4)
+{
+	// Same walk as count_nvdimm_pages(). Only tables on NVDIMM are walked.
+	int i4, i3, i2;
+	for (i4 = 0; i4 < PTRS_PER_PGD / 2; i4++) {
+		pud_t *t3;
+		if (table_state_pml4e(&t4[i4]) != TABLE_STATE_Tn)
+			continue;
+		t3 = ndckpt_p2v(t4[i4].pgd & PTE_PFN_MASK);
+		for (i3 = 0; i3 < PTRS_PER_PUD; i3++) {
+			pmd_t *t2;
+			if (table_state_pdpte(&t3[i3]) != TABLE_STATE_Tn)
+				continue;
+			t2 = ndckpt_p2v(t3[i3].pud & PTE_PFN_MASK);
+			for (i2 = 0; i2 < PTRS_PER_PMD; i2++) {
+				const uint64_t addr =
+					((uint64_t)i4 << PGDIR_SHIFT) |
+					((uint64_t)i3 << PUD_SHIFT) |
+					((uint64_t)i2 << PMD_SHIFT);
+				if (ndckpt_is_pmd_huge(t2[i2])) {
+					if (ndckpt_is_phys_addr_in_nvdimm(
+						    ndckpt_huge_page_paddr(
+							    t2[i2])))
+						export_huge_page(st, addr,
+								 &t2[i2]);
+					continue;
+				}
+				if (table_state_pde(&t2[i2]) != TABLE_STATE_Tn)
+					continue;
+				export_pt(st, addr,
+					  ndckpt_p2v(t2[i2].pmd & PTE_PFN_MASK));
+				cond_resched();
+			}
+		}
+	}
+}
+
+static int export_pproc(struct ImageFile *img,
+			struct PersistentProcessInfo *pproc, unsigned long flags)
+{
+	const uint64_t seq = pproc_get_commit_seq(pproc);
+	const int ctx_idx = pproc_get_valid_ctx(pproc);
+	const bool lz4 = flags & PR_NDCKPT_EXPORT_LZ4;
+	struct ImageHeader header = {
+		.magic = IMAGE_MAGIC,
+		.version = IMAGE_VERSION,
+		.flags = flags,
+		.obj_id = pobj_get_header(pproc)->id,
+		.ctx_state_size = pproc_get_ctx_state_size(),
+	};
+	struct ImageChunk end = { .type = IMAGE_CHUNK_END };
+	struct ExportState st = {
+		.img = img,
+		.num_of_works =
+			min_t(int, num_online_cpus() + 1, IMAGE_MAX_WORKS),
+	};
+	void *ctx_state;
+	uint64_t i;
+
+	if (ctx_idx < 0 || 2 <= ctx_idx)
+		return -EINVAL;
+	ctx_state = kmalloc(header.ctx_state_size, GFP_KERNEL);
+	st.works = image_works_alloc(st.num_of_works, lz4, lz4);
+	if (!ctx_state || !st.works) {
+		kfree(ctx_state);
+		if (st.works)
+			image_works_free(st.works, st.num_of_works);
+		return -ENOMEM;
+	}
+	pproc_get_ctx_state(pproc, ctx_idx, ctx_state);
+	st.count_only = true;
+	export_ctx_pages(&st, pproc_get_pgd(pproc, ctx_idx));
+	st.count_only = false;
+	header.num_of_pages = st.num_of_pages;
+	header.num_of_chunks = st.num_of_chunks;
+	image_write(img, &header, sizeof(header));
+	image_write(img, ctx_state, header.ctx_state_size);
+	kfree(ctx_state);
+
+	export_ctx_pages(&st, pproc_get_pgd(pproc, ctx_idx));
+	i = st.num_of_queued > st.num_of_works ?
+		    st.num_of_queued - st.num_of_works :
+		    0;
+	for (; i < st.num_of_queued; i++)
+		export_write_work(img, &st.works[i % st.num_of_works]);
+	image_works_free(st.works, st.num_of_works);
+	image_write(img, &end, sizeof(end));
+
+	if (pproc_get_commit_seq(pproc) != seq)
+		return -EAGAIN;
+	return img->error;
+}
+
+int ndckpt_export_image(uint64_t obj_id, int fd, unsigned long flags)
+{
+	struct PersistentMemoryManager *pman;
+	struct PersistentProcessInfo *pproc;
+	struct ImageFile img = {};
+	struct fd f;
+	int error;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (flags & ~PR_NDCKPT_EXPORT_LZ4)
+		return -EINVAL;
+	if (!first_pmem_device)
+		return -ENODEV;
+	pman = first_pmem_device->virt_addr;
+	if (!pman_is_valid(pman))
+		return -ENODEV;
+	pproc = obj_id ? pman_find_proc_info(pman, obj_id) :
+			 pman->last_proc_info;
+	if (!pproc_is_valid(pproc))
+		return -ENOENT;
+	f = fdget_pos(fd);
+	if (!f.file)
+		return -EBADF;
+	img.file = f.file;
+	img.pos = image_file_pos_read(f.file);
+	error = export_pproc(&img, pproc, flags);
+	image_file_pos_write(f.file, img.pos);
+	fdput_pos(f);
+	pr_ndckpt("export obj %llu: pages=%llu zero_pages=%llu bytes=%llu error=%d\n",
+		  pobj_get_header(pproc)->id, img.num_of_pages,
+		  img.num_of_zero_pages, img.bytes, error);
+	return error;
+}
+EXPORT_SYMBOL(ndckpt_export_image);
+
+// Import of exported images.
+// prctl(PR_IMPORT_NDCKPT, fd, exe_fd) reads an image from fd at its current
+// offset into a new pproc and returns its obj id. Restore it with
+// prctl(PR_ENABLE_NDCKPT, id) and exec of the checkpointed executable.
+// If exe_fd is not -1, the pproc is bound to that executable so that it can
+// be restored without loading ELF. See binfmt.c.
+//
+// Data pages are carved from large allocations and written with
+// non-temporal stores by workers, after the crc check and decompression.
+// Page tables are built by the caller while reading chunks in order.
+// The pproc gets a valid ctx only after all of them are written, so an
+// import interrupted by a power loss is never restored. One failed with an
+// error is discarded. Free pmem is checked against the header up front.
+// Zero 4KiB pages map the zero page if ndckpt_zero_page is set.
+
+// Unused pages of an arena are wasted after the import.
+#define IMPORT_ARENA_PAGES PTRS_PER_PTE
+// Pages taken by an import besides pages and tables of chunks: the pproc
+// and its pgds, partly used arenas and a pool of 2MiB pages with its
+// alignment. See pman_alloc_zeroed_huge_page().
+#define IMPORT_EXTRA_PAGES (64 + 2 * IMPORT_ARENA_PAGES + 17 * PTRS_PER_PMD)
+
+struct ImportArena {
+	uint8_t *next;
+	uint8_t *end;
+	bool zeroed;
+};
+
+struct ImportState {
+	struct ImageFile *img;
+	struct PersistentMemoryManager *pman;
+	pgd_t *pgd;
+	// Tables and zero pages
+	struct ImportArena zeroed;
+	// Pages with data
+	struct ImportArena pages;
+	// Paddr of the zero page, or 0 to allocate zero pages
+	uint64_t zero_page_paddr;
+	struct ImageWork *works;
+	int num_of_works;
+	uint64_t num_of_queued;
+	// Left of ones declared in the header
+	uint64_t num_of_pages_left;
+	uint64_t num_of_chunks_left;
+	int error;
+};
+
+static void *import_alloc_page(struct ImportState *st, struct ImportArena *a)
+{
+	void *page;
+	if (a->next >= a->end) {
+		a->next = a->zeroed ?
+				  pman_alloc_zeroed_pages(st->pman,
+							  IMPORT_ARENA_PAGES) :
+				  pman_alloc_pages(st->pman, IMPORT_ARENA_PAGES);
+		a->end = a->next + IMPORT_ARENA_PAGES * PAGE_SIZE;
+	}
+	page = a->next;
+	a->next += PAGE_SIZE;
+	return page;
+}
+
+static uint64_t import_new_table(struct ImportState *st)
+{
+	return ndckpt_virt_to_phys(import_alloc_page(st, &st->zeroed)) |
+	       _PAGE_TABLE;
+}
+
+static pmd_t *import_walk(struct ImportState *st, uint64_t addr)
+{
+	// Returns the entry of the PD for addr, allocating tables above it.
+	pgd_t *e4 = &st->pgd[PADDR_TO_IDX_IN_PML4(addr)];
+	pud_t *t3, *e3;
+	pmd_t *t2;
+	if (!(e4->pgd & _PAGE_PRESENT)) {
+		e4->pgd = import_new_table(st);
+		ndckpt_clwb(e4);
+	}
+	t3 = ndckpt_p2v(e4->pgd & PTE_PFN_MASK);
+	e3 = &t3[PADDR_TO_IDX_IN_PDPT(addr)];
+	if (!(e3->pud & _PAGE_PRESENT)) {
+		e3->pud = import_new_table(st);
+		ndckpt_clwb(e3);
+	}
+	t2 = ndckpt_p2v(e3->pud & PTE_PFN_MASK);
+	return &t2[PADDR_TO_IDX_IN_PD(addr)];
+}
+
+static uint64_t import_attr(uint64_t attr, uint64_t pfn_mask)
+{
+	// Attrs come from the image. Pages are mapped as present user pages,
+	// clean as in the valid ctx.
+	return (attr & ~pfn_mask & ~_PAGE_GLOBAL & ~_PAGE_DIRTY &
+		~_PAGE_ACCESSED & ~_PAGE_NDCKPT_CACHED &
+		~_PAGE_NDCKPT_UNSYNCED) |
+	       _PAGE_PRESENT | _PAGE_USER;
+}
+
+static bool import_chunk_is_valid(struct ImageChunk *c)
+{
+	const int num_of_zero_pages =
+		bitmap_weight((unsigned long *)c->zero, PTRS_PER_PTE);
+	const size_t page_size =
+		c->type == IMAGE_CHUNK_HUGE ? PMD_SIZE : PAGE_SIZE;
+	if (c->type != IMAGE_CHUNK_PT && c->type != IMAGE_CHUNK_HUGE)
+		return false;
+	if (c->type == IMAGE_CHUNK_HUGE && c->present[0] != 1)
+		return false;
+	return c->addr < (1ULL << 47) && IS_ALIGNED(c->addr, PMD_SIZE) &&
+	       c->num_of_pages ==
+		       bitmap_weight((unsigned long *)c->present,
+				     PTRS_PER_PTE) &&
+	       bitmap_subset((unsigned long *)c->zero,
+			     (unsigned long *)c->present, PTRS_PER_PTE) &&
+	       c->raw_size == (c->num_of_pages - num_of_zero_pages) * page_size &&
+	       c->data_size <= IMAGE_DATA_MAX &&
+	       ((c->flags & IMAGE_CHUNK_FLAG_LZ4) ||
+		c->data_size == c->raw_size);
+}
+
+static int import_map_chunk(struct ImportState *st, struct ImageWork *w)
+{
+	// Maps pages of the chunk and sets paddrs of ones with data.
+	struct ImageChunk *c = &w->chunk;
+	pmd_t *e2 = import_walk(st, c->addr);
+	pte_t *t1;
+	void *page;
+	int i, n = 0, k = 0;
+
+	if (e2->pmd & _PAGE_PRESENT)
+		return -EINVAL;
+	if (c->type == IMAGE_CHUNK_HUGE) {
+		page = ndckpt_alloc_zeroed_huge_page();
+		if (!test_bit(0, (unsigned long *)c->zero))
+			w->paddrs[k++] = ndckpt_virt_to_phys(page);
+		e2->pmd = ndckpt_virt_to_phys(page) | _PAGE_PSE |
+			  import_attr(w->attrs[0], PHYSICAL_PMD_PAGE_MASK);
+		ndckpt_clwb(e2);
+		return 0;
+	}
+	t1 = import_alloc_page(st, &st->zeroed);
+	for (i = 0; i < PTRS_PER_PTE; i++) {
+		if (!test_bit(i, (unsigned long *)c->present))
+			continue;
+		if (test_bit(i, (unsigned long *)c->zero) &&
+		    st->zero_page_paddr) {
+			t1[i].pte = st->zero_page_paddr |
+				    (import_attr(w->attrs[n++], PTE_PFN_MASK) &
+				     ~_PAGE_RW);
+			continue;
+		}
+		if (test_bit(i, (unsigned long *)c->zero)) {
+			page = import_alloc_page(st, &st->zeroed);
+		} else {
+			page = import_alloc_page(st, &st->pages);
+			w->paddrs[k++] = ndckpt_virt_to_phys(page);
+		}
+		t1[i].pte = ndckpt_virt_to_phys(page) |
+			    import_attr(w->attrs[n++], PTE_PFN_MASK);
+	}
+	ndckpt_clwb_range(t1, PAGE_SIZE);
+	e2->pmd = ndckpt_virt_to_phys(t1) | _PAGE_TABLE;
+	ndckpt_clwb(e2);
+	return 0;
+}
+
+static void import_work_fn(struct work_struct *work)
+{
+	// Checks and decompresses data of the chunk in buf, then writes it to
+	// the pages.
+	struct ImageWork *w = container_of(work, struct ImageWork, work);
+	struct ImageChunk *c = &w->chunk;
+	const size_t page_size =
+		c->type == IMAGE_CHUNK_HUGE ? PMD_SIZE : PAGE_SIZE;
+	int i;
+
+	w->data = w->buf;
+	w->error = 0;
+	if (image_chunk_crc(w) != c->crc) {
+		w->error = -EINVAL;
+		goto done;
+	}
+	if (c->flags & IMAGE_CHUNK_FLAG_LZ4) {
+		if (LZ4_decompress_safe((const char *)w->buf, (char *)w->raw,
+					c->data_size, PMD_SIZE) != c->raw_size) {
+			w->error = -EINVAL;
+			goto done;
+		}
+		w->data = w->raw;
+	}
+	for (i = 0; i < c->raw_size / page_size; i++) {
+		memcpy_nt(ndckpt_p2v(w->paddrs[i]), w->data + i * page_size,
+			  page_size);
+	}
+	// Non-temporal stores of this cpu are ordered before the completion.
+	ndckpt_sfence();
+done:
+	complete(&w->done);
+}
+
+static void import_wait_work(struct ImportState *st, struct ImageWork *w)
+{
+	if (!w->queued)
+		return;
+	image_wait_work(w);
+	if (w->error && !st->error)
+		st->error = w->error;
+}
+
+static void import_chunks(struct ImportState *st)
+{
+	struct ImageFile *img = st->img;
+	struct ImageWork *w;
+	struct ImageChunk *c;
+	int i;
+
+	while (!st->error) {
+		w = &st->works[st->num_of_queued % st->num_of_works];
+		import_wait_work(st, w);
+		c = &w->chunk;
+		image_read(img, c, sizeof(*c));
+		if (img->error || c->type == IMAGE_CHUNK_END)
+			break;
+		if (!import_chunk_is_valid(c) || !st->num_of_chunks_left ||
+		    st->num_of_pages_left <
+			    (c->type == IMAGE_CHUNK_HUGE ? PTRS_PER_PTE :
+							   c->num_of_pages)) {
+			st->error = -EINVAL;
+			break;
+		}
+		st->num_of_chunks_left--;
+		st->num_of_pages_left -= c->type == IMAGE_CHUNK_HUGE ?
+						 PTRS_PER_PTE :
+						 c->num_of_pages;
+		image_read(img, w->attrs, c->num_of_pages * sizeof(uint64_t));
+		image_read(img, w->buf, c->data_size);
+		if (img->error)
+			break;
+		st->error = import_map_chunk(st, w);
+		if (st->error)
+			break;
+		img->num_of_pages += c->num_of_pages;
+		img->num_of_zero_pages +=
+			bitmap_weight((unsigned long *)c->zero, PTRS_PER_PTE);
+		image_queue_work(w, import_work_fn);
+		st->num_of_queued++;
+		cond_resched();
+	}
+	for (i = 0; i < st->num_of_works; i++)
+		import_wait_work(st, &st->works[i]);
+	if (!st->error)
+		st->error = img->error;
+}
+
+static int64_t import_pproc(struct ImageFile *img, struct file *exe)
+{
+	struct ImageHeader header;
+	struct PersistentProcessInfo *pproc;
+	struct ImportState st = {
+		.img = img,
+		.pman = first_pmem_device->virt_addr,
+		.zeroed = { .zeroed = true },
+		.num_of_works =
+			min_t(int, num_online_cpus() + 1, IMAGE_MAX_WORKS),
+	};
+	void *ctx_state;
+	uint64_t num_of_free_pages;
+
+	image_read(img, &header, sizeof(header));
+	if (img->error)
+		return img->error;
+	if (header.magic != IMAGE_MAGIC || header.version != IMAGE_VERSION ||
+	    header.ctx_state_size != pproc_get_ctx_state_size() ||
+	    header.num_of_chunks > header.num_of_pages)
+		return -EINVAL;
+	// Running out of pmem in the middle would be a BUG() in pman.
+	num_of_free_pages = pman_get_num_of_free_pages(st.pman);
+	if (header.num_of_pages > num_of_free_pages ||
+	    num_of_free_pages - header.num_of_pages <
+		    3 * header.num_of_chunks + IMPORT_EXTRA_PAGES)
+		return -ENOSPC;
+	st.num_of_pages_left = header.num_of_pages;
+	st.num_of_chunks_left = header.num_of_chunks;
+	ctx_state = kmalloc(header.ctx_state_size, GFP_KERNEL);
+	st.works = image_works_alloc(st.num_of_works, true, false);
+	if (!ctx_state || !st.works) {
+		kfree(ctx_state);
+		if (st.works)
+			image_works_free(st.works, st.num_of_works);
+		return -ENOMEM;
+	}
+	image_read(img, ctx_state, header.ctx_state_size);
+	pproc = img->error ? ERR_PTR(img->error) :
+			     pproc_alloc_imported(st.pman, ctx_state, exe);
+	kfree(ctx_state);
+	if (IS_ERR(pproc)) {
+		image_works_free(st.works, st.num_of_works);
+		return PTR_ERR(pproc);
+	}
+	st.pgd = pproc_get_pgd(pproc, 0);
+	if (ndckpt_zero_page)
+		st.zero_page_paddr = ndckpt_get_zero_page();
+	import_chunks(&st);
+	image_works_free(st.works, st.num_of_works);
+	if (st.error) {
+		pproc_discard(pproc);
+		return st.error;
+	}
+	ndckpt_sfence();
+	pproc_set_valid_ctx(pproc, 0);
+	return pobj_get_header(pproc)->id;
+}
+
+int64_t ndckpt_import_image(int fd, int exe_fd)
+{
+	struct ImageFile img = {};
+	struct fd f, exe = {};
+	int64_t retv;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (!first_pmem_device ||
+	    !pman_is_valid(first_pmem_device->virt_addr))
+		return -ENODEV;
+	f = fdget_pos(fd);
+	if (!f.file)
+		return -EBADF;
+	if (exe_fd != -1) {
+		exe = fdget(exe_fd);
+		if (!exe.file) {
+			fdput_pos(f);
+			return -EBADF;
+		}
+	}
+	img.file = f.file;
+	img.pos = image_file_pos_read(f.file);
+	retv = import_pproc(&img, exe.file);
+	image_file_pos_write(f.file, img.pos);
+	if (exe.file)
+		fdput(exe);
+	fdput_pos(f);
+	pr_ndckpt("import: pages=%llu zero_pages=%llu bytes=%llu retv=%lld\n",
+		  img.num_of_pages, img.num_of_zero_pages, img.bytes, retv);
+	return retv;
+}
+EXPORT_SYMBOL(ndckpt_import_image);
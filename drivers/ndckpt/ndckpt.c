@@ -1,10 +1,182 @@
 #include "ndckpt_internal.h"
 
+#define CREATE_TRACE_POINTS
+#include "ndckpt_trace.h"
+
 struct kobject *kobj_ndckpt;
 struct pmem_device *first_pmem_device;
+// Split locks for page tables on NVDIMM, hashed by pfn. Pages on NVDIMM
+// have no struct page to hold ptlock. See ndckpt_pte_lockptr().
+// A lock per pmem page would take GiBs of DRAM on large pmem, while only
+// as many tables as cpus are locked at a time.
+#define NDCKPT_PTL_PER_CPU 8
+struct NdckptPtl {
+	spinlock_t lock;
+} ____cacheline_aligned_in_smp;
+static struct NdckptPtl *ndckpt_ptl_table;
+static unsigned int ndckpt_ptl_table_bits;
+// Restore pages of target vmas on demand. See pproc_restore_lazy().
+bool ndckpt_lazy_restore;
+// Prefetch hot pages recorded on commits after restore.
+bool ndckpt_restore_prefetch = true;
+// Max number of pages mapped on an anonymous fault in target vmas.
+unsigned int ndckpt_fault_around_pages = 16;
+EXPORT_SYMBOL(ndckpt_fault_around_pages);
+// Map 2MiB NVDIMM pages on anonymous faults in target vmas.
+bool ndckpt_huge_pages = true;
+EXPORT_SYMBOL(ndckpt_huge_pages);
+// Map the zero page on read faults in target vmas and fold dirty pages
+// filled with zero into it on commit.
+bool ndckpt_zero_page = true;
+EXPORT_SYMBOL(ndckpt_zero_page);
+// Paddr of the zero page of the pmem, or 0 if it has none yet.
+// See ndckpt_get_zero_page().
+uint64_t ndckpt_zero_page_paddr;
+EXPORT_SYMBOL(ndckpt_zero_page_paddr);
+// Max number of pages in target vmas cached on DRAM. 0 to disable.
+// See dram_cache.c.
+unsigned int ndckpt_dram_cache_pages;
+// Max number of invlpgs on the cr3 switch of commit. Beyond this, or 0,
+// all TLB entries of the process are flushed. See switch_mm_context().
+unsigned int ndckpt_tlb_flush_ceiling = 33;
+// See ndckpt_clwb().
+DEFINE_STATIC_KEY_FALSE(ndckpt_flush_clflushopt);
+EXPORT_SYMBOL(ndckpt_flush_clflushopt);
+DEFINE_STATIC_KEY_FALSE(ndckpt_flush_clflush);
+EXPORT_SYMBOL(ndckpt_flush_clflush);
+DEFINE_STATIC_KEY_FALSE(ndckpt_flush_none);
+EXPORT_SYMBOL(ndckpt_flush_none);
+static DEFINE_MUTEX(ndckpt_flush_lock);
+// CPU caches are in the persistence domain of the pmem (eADR).
+// Reported by ACPI NFIT via the write cache flag of the dax device.
+static bool ndckpt_persistent_cache;
+
+static void ndckpt_init_ptl_table(void)
+{
+	struct NdckptPtl *table;
+	unsigned int bits, i;
+	bits = ilog2(roundup_pow_of_two(num_possible_cpus() *
+					NDCKPT_PTL_PER_CPU));
+	table = kcalloc(1U << bits, sizeof(*table), GFP_KERNEL);
+	if (!table) {
+		// Fall back to mm->page_table_lock
+		printk("ndckpt: failed to alloc ptl table\n");
+		return;
+	}
+	for (i = 0; i < (1U << bits); i++) {
+		spin_lock_init(&table[i].lock);
+	}
+	ndckpt_ptl_table_bits = bits;
+	ndckpt_ptl_table = table;
+}
+
+int ndckpt_get_flush(void)
+{
+	if (static_branch_unlikely(&ndckpt_flush_none))
+		return NDCKPT_FLUSH_NONE;
+	if (static_branch_unlikely(&ndckpt_flush_clflush))
+		return NDCKPT_FLUSH_CLFLUSH;
+	if (static_branch_unlikely(&ndckpt_flush_clflushopt))
+		return NDCKPT_FLUSH_CLFLUSHOPT;
+	return NDCKPT_FLUSH_CLWB;
+}
+EXPORT_SYMBOL(ndckpt_get_flush);
+
+int ndckpt_set_flush(int insn)
+{
+	// Keys are switched so that an unsupported instruction is never
+	// selected in between. Lines written back by the previous one are
+	// ordered by the fence following them as well.
+	if ((insn == NDCKPT_FLUSH_CLWB && !boot_cpu_has(X86_FEATURE_CLWB)) ||
+	    (insn == NDCKPT_FLUSH_CLFLUSHOPT &&
+	     !boot_cpu_has(X86_FEATURE_CLFLUSHOPT)) ||
+	    (insn == NDCKPT_FLUSH_CLFLUSH && !boot_cpu_has(X86_FEATURE_CLFLUSH)))
+		return -EOPNOTSUPP;
+	mutex_lock(&ndckpt_flush_lock);
+	switch (insn) {
+	case NDCKPT_FLUSH_NONE:
+		static_branch_enable(&ndckpt_flush_none);
+		static_branch_disable(&ndckpt_flush_clflush);
+		static_branch_disable(&ndckpt_flush_clflushopt);
+		break;
+	case NDCKPT_FLUSH_CLFLUSH:
+		static_branch_enable(&ndckpt_flush_clflush);
+		static_branch_disable(&ndckpt_flush_clflushopt);
+		static_branch_disable(&ndckpt_flush_none);
+		break;
+	case NDCKPT_FLUSH_CLFLUSHOPT:
+		static_branch_enable(&ndckpt_flush_clflushopt);
+		static_branch_disable(&ndckpt_flush_clflush);
+		static_branch_disable(&ndckpt_flush_none);
+		break;
+	default:
+		static_branch_disable(&ndckpt_flush_clflush);
+		static_branch_disable(&ndckpt_flush_clflushopt);
+		static_branch_disable(&ndckpt_flush_none);
+		break;
+	}
+	mutex_unlock(&ndckpt_flush_lock);
+	return 0;
+}
+EXPORT_SYMBOL(ndckpt_set_flush);
+
+static void ndckpt_select_flush(void)
+{
+	if (ndckpt_persistent_cache) {
+		ndckpt_set_flush(NDCKPT_FLUSH_NONE);
+		return;
+	}
+	if (!ndckpt_set_flush(NDCKPT_FLUSH_CLWB))
+		return;
+	if (!ndckpt_set_flush(NDCKPT_FLUSH_CLFLUSHOPT))
+		return;
+	ndckpt_set_flush(NDCKPT_FLUSH_CLFLUSH);
+}
+
+static __always_inline void ndckpt_flush_lines(volatile uint8_t *p,
+					       size_t num_of_lines, int insn)
+{
+	// insn is a constant, so this is specialized for each instruction.
+	// Flushes are issued 4 lines at a time without checking the keys.
+	size_t i = 0;
+	for (; i + 4 <= num_of_lines; i += 4) {
+		ndckpt_flush_line(p, insn);
+		ndckpt_flush_line(p + kCacheLineSize, insn);
+		ndckpt_flush_line(p + 2 * kCacheLineSize, insn);
+		ndckpt_flush_line(p + 3 * kCacheLineSize, insn);
+		p += 4 * kCacheLineSize;
+	}
+	for (; i < num_of_lines; i++) {
+		ndckpt_flush_line(p, insn);
+		p += kCacheLineSize;
+	}
+}
+
+void ndckpt_clwb_range(volatile void *p, size_t byte_size)
+{
+	volatile uint8_t *start =
+		(volatile uint8_t *)((uint64_t)p & ~(kCacheLineSize - 1));
+	const size_t num_of_lines =
+		((uint64_t)p + byte_size - (uint64_t)start + kCacheLineSize -
+		 1) /
+		kCacheLineSize;
+	if (static_branch_unlikely(&ndckpt_flush_none))
+		return;
+	if (static_branch_unlikely(&ndckpt_flush_clflush))
+		ndckpt_flush_lines(start, num_of_lines, NDCKPT_FLUSH_CLFLUSH);
+	else if (static_branch_unlikely(&ndckpt_flush_clflushopt))
+		ndckpt_flush_lines(start, num_of_lines,
+				   NDCKPT_FLUSH_CLFLUSHOPT);
+	else
+		ndckpt_flush_lines(start, num_of_lines, NDCKPT_FLUSH_CLWB);
+	if (static_branch_unlikely(&ndckpt_emul))
+		ndckpt_emul_write_back(num_of_lines);
+}
+EXPORT_SYMBOL(ndckpt_clwb_range);
 
 void ndckpt_notify_pmem(struct pmem_device *pmem)
 {
+	void *zero_page;
 	if (!first_pmem_device) {
 		pr_ndckpt("first pmem notified\n");
 		first_pmem_device = pmem;
@@ -12,16 +184,54 @@ void ndckpt_notify_pmem(struct pmem_device *pmem)
 		pr_ndckpt("size     : 0x%08lx\n", pmem->size);
 		pr_ndckpt("virt_addr: 0x%016llx\n",
 			  (unsigned long long)pmem->virt_addr);
+		ndckpt_init_ptl_table();
+		// Ptes of checkpoints may map the zero page already.
+		zero_page = pman_load_zero_page(pmem->virt_addr);
+		if (zero_page)
+			ndckpt_zero_page_paddr = ndckpt_virt_to_phys(zero_page);
+		if (pmem->dax_dev && !dax_write_cache_enabled(pmem->dax_dev)) {
+			printk("ndckpt: cpu caches are persistent\n");
+			ndckpt_persistent_cache = true;
+			ndckpt_select_flush();
+		}
 	}
 }
 EXPORT_SYMBOL(ndckpt_notify_pmem);
 
+spinlock_t *ndckpt_table_lockptr(struct mm_struct *mm, uint64_t paddr)
+{
+	// paddr is of a page table on NVDIMM
+	if (!ndckpt_ptl_table)
+		return &mm->page_table_lock;
+	// No path locks two tables on NVDIMM at a time, so sharing a lock
+	// can not deadlock.
+	return &ndckpt_ptl_table[hash_64(paddr >> PAGE_SHIFT,
+					 ndckpt_ptl_table_bits)]
+			.lock;
+}
+EXPORT_SYMBOL(ndckpt_table_lockptr);
+
+static struct PersistentProcessInfo *find_restorable_pproc(uint64_t obj_id)
+{
+	struct PersistentProcessInfo *pproc =
+		pman_find_proc_info(first_pmem_device->virt_addr, obj_id);
+	if (pproc && pproc_get_valid_ctx(pproc) < 0) {
+		// An import of it was interrupted.
+		pr_ndckpt("obj %llu has no valid ctx\n", obj_id);
+		return NULL;
+	}
+	return pproc;
+}
+
 int ndckpt_enable_checkpointing(struct task_struct *task, int restore_obj_id)
 {
 	if ((task->flags & PF_FORKNOEXEC) == 0) {
 		// ndckpt can be enabled only before exec after fork.
 		return -EINVAL;
 	}
+	if (restore_obj_id &&
+	    (!first_pmem_device || !find_restorable_pproc(restore_obj_id)))
+		return -ENOENT;
 	task->flags |= PF_NDCKPT_ENABLED;
 	task->ndckpt_id = restore_obj_id;
 	pr_ndckpt("checkpoint enabled on pid=%d\n", task->pid);
@@ -39,12 +249,37 @@ void *ndckpt_alloc_zeroed_virt_page(void)
 }
 EXPORT_SYMBOL(ndckpt_alloc_zeroed_virt_page);
 
+void *ndckpt_alloc_zeroed_virt_pages(uint64_t num_of_pages)
+{
+	// Contiguous pages are zeroed and flushed at once.
+	return pman_alloc_zeroed_pages(first_pmem_device->virt_addr,
+				       num_of_pages);
+}
+EXPORT_SYMBOL(ndckpt_alloc_zeroed_virt_pages);
+
+void *ndckpt_alloc_zeroed_huge_page(void)
+{
+	return pman_alloc_zeroed_huge_page(first_pmem_device->virt_addr);
+}
+EXPORT_SYMBOL(ndckpt_alloc_zeroed_huge_page);
+
 uint64_t ndckpt_alloc_zeroed_phys_page(void)
 {
 	return ndckpt_virt_to_phys(ndckpt_alloc_zeroed_virt_page());
 }
 EXPORT_SYMBOL(ndckpt_alloc_zeroed_phys_page);
 
+uint64_t ndckpt_get_zero_page(void)
+{
+	// Returns the paddr of the zero page, allocating it if needed.
+	if (!READ_ONCE(ndckpt_zero_page_paddr))
+		WRITE_ONCE(ndckpt_zero_page_paddr,
+			   ndckpt_virt_to_phys(pman_get_zero_page(
+				   first_pmem_device->virt_addr)));
+	return ndckpt_zero_page_paddr;
+}
+EXPORT_SYMBOL(ndckpt_get_zero_page);
+
 uint64_t ndckpt_virt_to_phys(void *vaddr)
 {
 	return (uint64_t)vaddr - (uint64_t)first_pmem_device->virt_addr +
@@ -77,10 +312,18 @@ EXPORT_SYMBOL(ndckpt_is_virt_addr_in_nvdimm);
 static int handle_execve_resotre(struct task_struct *task,
 				 uint64_t pproc_obj_id)
 {
-	// TODO: use pproc_obj_id to select pobj being restored
 	struct PersistentMemoryManager *pman = first_pmem_device->virt_addr;
-	struct PersistentProcessInfo *pproc = pman->last_proc_info;
-	return pproc_restore(pman, task, pproc);
+	struct PersistentProcessInfo *pproc =
+		find_restorable_pproc(pproc_obj_id);
+	int64_t retv;
+	if (!pproc) {
+		// Checked on ndckpt_enable_checkpointing() but may be gone.
+		return -ENOENT;
+	}
+	trace_ndckpt_restore_begin(task, pproc, ndckpt_lazy_restore);
+	retv = pproc_restore(pman, task, pproc);
+	trace_ndckpt_restore_end(task, retv);
+	return retv;
 }
 
 int64_t ndckpt_handle_execve(struct task_struct *task)
@@ -103,11 +346,13 @@ EXPORT_SYMBOL(ndckpt_handle_execve);
 static int do_ndckpt(struct task_struct *target)
 {
 	// This can be called from any 'current' task.
-	struct PersistentMemoryManager *pman = first_pmem_device->virt_addr;
-	struct PersistentProcessInfo *pproc = pman->last_proc_info;
+	struct PersistentProcessInfo *pproc;
 	struct pt_regs *regs = task_pt_regs(target);
 	if (!(target->flags & PF_NDCKPT_ENABLED))
 		return -EINVAL;
+	pproc = target->mm->ndckpt_pproc;
+	if (!pproc)
+		return -EINVAL;
 	pproc_commit(target, pproc, target->mm, regs);
 	return 0;
 }
@@ -127,33 +372,57 @@ int ndckpt_handle_checkpoint(void)
 }
 EXPORT_SYMBOL(ndckpt_handle_checkpoint);
 
-void ndckpt_exit_mm(struct task_struct *target)
+void ndckpt_exit_mmap(struct mm_struct *mm)
 {
-	struct PersistentMemoryManager *pman;
-	struct PersistentProcessInfo *pproc;
-	if (!ndckpt_is_enabled_on_task(target))
+	// Called from __mmput() before exit_mmap(). No task runs on mm anymore,
+	// but cpus in lazy TLB mode may still have the running ctx as cr3.
+	struct PersistentProcessInfo *pproc = mm->ndckpt_pproc;
+	if (!pproc)
 		return;
-	pman = first_pmem_device->virt_addr;
-	pproc = pman->last_proc_info;
-
-	target->mm->pgd =
-		pproc_get_org_pgd(pproc); // To avoid pproc ctx destruction
+	// Faults and commits of all threads have finished.
+	pproc_stats_release(pproc);
+	if (!ndckpt_is_virt_addr_in_nvdimm(mm->pgd))
+		return;
+	// Running ctx is discarded so there is no need to finish restoring it.
+	pproc_lazy_restore_release(pproc, mm, false);
+	mm->pgd = pproc_get_org_pgd(pproc); // To avoid pproc ctx destruction
+	// Lazy TLB cpus switch to init_mm on this, so nothing can reach the
+	// DRAM cache pages via the running ctx after it.
+	flush_tlb_mm(mm);
+	pproc_dram_cache_release(pproc);
 }
-EXPORT_SYMBOL(ndckpt_exit_mm);
+EXPORT_SYMBOL(ndckpt_exit_mmap);
 
 void ndckpt_notify_mmap_region(void)
 {
-	struct PersistentMemoryManager *pman;
-	struct PersistentProcessInfo *pproc;
 	if (!ndckpt_is_enabled_on_current())
 		return;
 	pr_ndckpt("mmap notified!\n");
-	pman = first_pmem_device->virt_addr;
-	pproc = pman->last_proc_info;
 	mark_target_vmas(current->mm);
 }
 EXPORT_SYMBOL(ndckpt_notify_mmap_region);
 
+int ndckpt_dup_mmap(struct mm_struct *mm, struct mm_struct *oldmm)
+{
+	// Called from dup_mmap() with both mmap_sem held.
+	// Pages in target vmas are shared with the child instead of copied.
+	struct PersistentMemoryManager *pman = first_pmem_device->virt_addr;
+	pr_ndckpt("dup_mmap for a child of pid = %d\n", current->pid);
+	ndckpt_lazy_restore_complete(oldmm);
+	return pproc_dup_mmap(pman, mm, oldmm);
+}
+EXPORT_SYMBOL(ndckpt_dup_mmap);
+
+void ndckpt_handle_fork(struct task_struct *child)
+{
+	// Called after copy_thread, so the child's pt_regs are ready.
+	if (!child->mm || !child->mm->ndckpt_pproc)
+		return;
+	pproc_fork(child->mm->ndckpt_pproc, child);
+	pr_ndckpt("fork done. pid = %d\n", child->pid);
+}
+EXPORT_SYMBOL(ndckpt_handle_fork);
+
 int ndckpt___pud_alloc(struct mm_struct *mm, p4d_t *p4d, unsigned long address,
 		       struct vm_area_struct *vma)
 {
@@ -170,6 +439,12 @@ int ndckpt___pud_alloc(struct mm_struct *mm, p4d_t *p4d, unsigned long address,
 		return -EINVAL;
 	smp_wmb(); /* See comment in __pte_alloc */
 	spin_lock(&mm->page_table_lock);
+	if (p4d_present(*p4d)) {
+		// Populated by the lazy restore worker.
+		spin_unlock(&mm->page_table_lock);
+		pman_free_zeroed_page(first_pmem_device->virt_addr, new);
+		return 0;
+	}
 	pud_phys = ndckpt_virt_to_phys(new);
 	pr_ndckpt_pgalloc("PDPT for 0x%016llX allocated on NVDIMM\n",
 			  (uint64_t)address);
@@ -199,6 +474,12 @@ int ndckpt___pmd_alloc(struct mm_struct *mm, pud_t *pud, unsigned long address,
 		return -EINVAL;
 	smp_wmb(); /* See comment in __pte_alloc */
 	spin_lock(&mm->page_table_lock);
+	if (pud_present(*pud)) {
+		// Populated by the lazy restore worker.
+		spin_unlock(&mm->page_table_lock);
+		pman_free_zeroed_page(first_pmem_device->virt_addr, new);
+		return 0;
+	}
 	phys = ndckpt_virt_to_phys(new);
 	pr_ndckpt_pgalloc("PD for 0x%016llX allocated on NVDIMM\n",
 			  (uint64_t)address);
@@ -215,19 +496,28 @@ int ndckpt___pte_alloc(struct mm_struct *mm, pmd_t *pmd,
 		       struct vm_area_struct *vma, uint64_t address)
 {
 	// Alloc PT (4th page table structure)
+	pte_t *new;
+	spinlock_t *ptl;
 	if (!ndckpt_is_enabled_on_current()) {
 		// Alloc on DRAM
 		return __pte_alloc(mm, pmd);
 	}
+	new = ndckpt_alloc_zeroed_virt_page();
 	smp_wmb(); /* Could be smp_wmb__xxx(before|after)_spin_lock */
+	ptl = ndckpt_pmd_lock(mm, pmd);
 	if (likely(pmd_none(*pmd))) { /* Has another populated it ? */
 		//BUG_ON(!ndckpt_is_virt_addr_in_nvdimm(pmd));
-		ndckpt_pmd_populate(mm, pmd,
-				    (pte_t *)ndckpt_alloc_zeroed_virt_page());
+		ndckpt_pmd_populate(mm, pmd, new);
 		pr_ndckpt_pgalloc(
 			"PT for 0x%016llX allocated on NVDIMM. pmd=0x%016llX\n",
 			address, (uint64_t)pmd->pmd);
 		ndckpt_clwb(pmd);
+		new = NULL;
+	}
+	spin_unlock(ptl);
+	if (new) {
+		// Never mapped, so it can be reused as is.
+		pman_free_zeroed_page(first_pmem_device->virt_addr, new);
 	}
 	return 0;
 }
@@ -235,6 +525,35 @@ EXPORT_SYMBOL(ndckpt___pte_alloc);
 
 // Leaf pages are allocated in handle_pte_fault_ndckpt@mm/memory.c
 
+void ndckpt_lazy_restore_fault(struct mm_struct *mm, uint64_t address)
+{
+	// Called from handle_mm_fault() with mm->mmap_sem held.
+	if (!mm->ndckpt_pproc)
+		return;
+	pproc_lazy_restore_fault(mm->ndckpt_pproc, address);
+}
+EXPORT_SYMBOL(ndckpt_lazy_restore_fault);
+
+void ndckpt_lazy_restore_complete(struct mm_struct *mm)
+{
+	// Called with mm->mmap_sem held before page tables of mm are
+	// modified without faults (munmap, mremap, mprotect...).
+	if (!mm->ndckpt_pproc)
+		return;
+	pproc_lazy_restore_complete(mm->ndckpt_pproc);
+}
+EXPORT_SYMBOL(ndckpt_lazy_restore_complete);
+
+void ndckpt_dram_cache_evict(struct mm_struct *mm)
+{
+	// Called with mm->mmap_sem held before ptes of target vmas are
+	// modified without keeping their pfn and software bits (mprotect, fork).
+	if (!mm->ndckpt_pproc)
+		return;
+	pproc_dram_cache_evict(mm->ndckpt_pproc, mm);
+}
+EXPORT_SYMBOL(ndckpt_dram_cache_evict);
+
 int ndckpt_do_ndckpt(struct task_struct *target)
 {
 	int result;
@@ -256,6 +575,9 @@ unsigned long ndckpt_move_page_tables(struct vm_area_struct *src_vma,
 		"ndckpt_move_page_tables!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n");
 	pr_ndckpt_mm_vma(dst_vma);
 	pr_ndckpt_mm_vma(src_vma);
+	ndckpt_lazy_restore_complete(src_vma->vm_mm);
+	// Cached pages would be installed again at their old addrs.
+	ndckpt_dram_cache_evict(src_vma->vm_mm);
 	ndckpt_move_pages(dst_vma, src_vma, dst_begin, src_begin, size);
 	pr_ndckpt_mm_vma(dst_vma);
 	pr_ndckpt_mm_vma(src_vma);
@@ -270,16 +592,19 @@ static int __init ndckpt_module_init(void)
 		(sizeof(struct PersistentMemoryManager) > 2 * kCacheLineSize));
 
 	pr_ndckpt("module init\n");
+	ndckpt_select_flush();
 	kobj_ndckpt = kobject_create_and_add("ndckpt", kernel_kobj);
 	if (!kobj_ndckpt) {
 		pr_ndckpt("kobject_create_and_add failed.\n");
 		return -ENOMEM;
 	}
+	ndckpt_register_binfmt();
 	return sysfs_interface_init();
 }
 static void __exit ndckpt_module_cleanup(void)
 {
 	pr_ndckpt("module cleanup\n");
+	ndckpt_unregister_binfmt();
 	kobject_put(kobj_ndckpt);
 	return;
 }
@@ -1,14 +1,14 @@
 #ifndef __NDCKPT_H__
 #define __NDCKPT_H__
 
+#include <linux/jump_label.h>
 #include <asm/pgalloc.h>
+#include <asm/tlbflush.h>
 
 //#define NDCKPT_DEBUG
 
 #ifdef NDCKPT_DEBUG
 #define NDCKPT_CHECK_SYNC_ON_COMMIT
-//#define NDCKPT_PRINT_FAULTS
-//#define NDCKPT_PRINT_SYNC_PAGES
 //#define NDCKPT_PRINT_PGTABLE_ALLOC
 #endif
 
@@ -56,18 +56,34 @@
 #define pr_ndckpt_pgalloc(fmt, ...)
 #endif
 
-#ifdef NDCKPT_PRINT_FAULTS
-#define pr_ndckpt_fault(fmt, ...) pr_ndckpt(fmt, ##__VA_ARGS__)
-#else
-#define pr_ndckpt_fault(fmt, ...)
-#endif
-
 // struct vm_area_struct -> vm_ckpt_flags
 #define VM_CKPT_TARGET 0x0001
 
 // struct mm_struct -> ndckpt_flags
 #define MM_NDCKPT_FLUSH_CR3 0x0001
 
+// Leaf pte which maps an NVDIMM page shared with a forked process.
+// Such ptes are read-only and the first write makes a private copy.
+#define _PAGE_NDCKPT_COW _PAGE_SOFTW2
+
+// PD entry which maps a 2MiB NVDIMM page modified since the last sync of
+// contexts. Set when a dirty 2MiB page is flushed on commit.
+#define _PAGE_NDCKPT_UNSYNCED _PAGE_SOFTW1
+
+// Leaf pte which maps a DRAM page caching an NVDIMM page in a target vma.
+// The bit is shared with _PAGE_NDCKPT_COW, which is only set on ptes of
+// NVDIMM pages. Such ptes are also special to be ignored by vm_normal_page().
+#define _PAGE_NDCKPT_CACHED _PAGE_SOFTW2
+
+// Cases of handle_pte_fault_ndckpt() counted in /proc/<pid>/ndckpt
+#define NDCKPT_FAULT_FILE 0 // No pte in a file vma
+#define NDCKPT_FAULT_ANON 1 // No pte in an anonymous vma
+#define NDCKPT_FAULT_FORK_COW 2 // Write to a page shared by fork
+#define NDCKPT_FAULT_FILE_COW 3 // Write to a read-only page in a file vma
+#define NDCKPT_FAULT_WRITE 4 // Write to a clean page on NVDIMM
+#define NDCKPT_FAULT_ZERO_COW 5 // Write to the zero page
+#define NDCKPT_NUM_OF_FAULT_TYPES 6
+
 /*
 	struct vm_fault vmf = {
 		.vma = vma,
@@ -79,27 +95,97 @@
 */
 
 struct pmem_device;
+struct seq_file;
+
+extern unsigned int ndckpt_fault_around_pages;
+extern bool ndckpt_huge_pages;
+extern bool ndckpt_zero_page;
+extern uint64_t ndckpt_zero_page_paddr;
 
 // @ndckpt.c
 void ndckpt_notify_pmem(struct pmem_device *pmem);
 int ndckpt_enable_checkpointing(struct task_struct *task, int restore_obj_id);
 uint64_t ndckpt_alloc_zeroed_phys_page(void);
 void *ndckpt_alloc_zeroed_virt_page(void);
+void *ndckpt_alloc_zeroed_virt_pages(uint64_t num_of_pages);
+void *ndckpt_alloc_zeroed_huge_page(void);
+uint64_t ndckpt_get_zero_page(void);
 uint64_t ndckpt_virt_to_phys(void *vaddr);
 void *ndckpt_phys_to_virt(uint64_t paddr);
 int ndckpt_is_phys_addr_in_nvdimm(uint64_t paddr);
 int ndckpt_is_virt_addr_in_nvdimm(void *vaddr);
 int ndckpt_handle_checkpoint(void);
-void ndckpt_exit_mm(struct task_struct *target);
+void ndckpt_exit_mmap(struct mm_struct *mm);
 int64_t ndckpt_handle_execve(struct task_struct *task);
+int ndckpt_dup_mmap(struct mm_struct *mm, struct mm_struct *oldmm);
+void ndckpt_handle_fork(struct task_struct *child);
 void ndckpt_notify_mmap_region(void);
+void ndckpt_lazy_restore_fault(struct mm_struct *mm, uint64_t address);
+void ndckpt_lazy_restore_complete(struct mm_struct *mm);
+void ndckpt_dram_cache_evict(struct mm_struct *mm);
+
+// @stats.c
+void ndckpt_notify_fault(struct vm_fault *vmf, int type);
+int ndckpt_proc_show(struct seq_file *m, struct task_struct *task);
+
+// @image.c
+int ndckpt_export_image(uint64_t obj_id, int fd, unsigned long flags);
+int64_t ndckpt_import_image(int fd, int exe_fd);
 
 static const uint64_t kCacheLineSize = 64;
 static const uint64_t kPageSizeExponent = 12;
 
+// Instruction to write back cache lines to NVDIMM. The best one supported
+// by the cpu is selected on init and can be switched via
+// /sys/kernel/ndckpt/flush. Keys are checked in the order of none, clflush
+// and clflushopt, and clwb is used if none of them is enabled.
+// With none, write-backs are skipped since cpu caches are in the
+// persistence domain (eADR). Fences are still issued to order stores.
+#define NDCKPT_FLUSH_CLWB 0
+#define NDCKPT_FLUSH_CLFLUSHOPT 1
+#define NDCKPT_FLUSH_CLFLUSH 2
+#define NDCKPT_FLUSH_NONE 3
+DECLARE_STATIC_KEY_FALSE(ndckpt_flush_clflushopt);
+DECLARE_STATIC_KEY_FALSE(ndckpt_flush_clflush);
+DECLARE_STATIC_KEY_FALSE(ndckpt_flush_none);
+
+int ndckpt_get_flush(void); // @ndckpt.c
+int ndckpt_set_flush(int insn); // @ndckpt.c
+
+// Delays of slow NVDIMM injected into write-backs and fences. See emul.c.
+DECLARE_STATIC_KEY_FALSE(ndckpt_emul);
+void ndckpt_emul_write_back(size_t num_of_lines); // @emul.c
+void ndckpt_emul_fence(void); // @emul.c
+
+static __always_inline void ndckpt_flush_line(volatile void *__p, int insn)
+{
+	switch (insn) {
+	case NDCKPT_FLUSH_NONE:
+		break;
+	case NDCKPT_FLUSH_CLFLUSHOPT:
+		clflushopt(__p);
+		break;
+	case NDCKPT_FLUSH_CLFLUSH:
+		clflush(__p);
+		break;
+	default:
+		asm volatile("clwb %0" : "+m"(*(volatile char __force *)__p));
+		break;
+	}
+}
+
 static inline void ndckpt_clwb(volatile void *__p)
 {
-	asm volatile("clwb %0" : "+m"(*(volatile char __force *)__p));
+	if (static_branch_unlikely(&ndckpt_flush_none))
+		return;
+	if (static_branch_unlikely(&ndckpt_flush_clflush))
+		ndckpt_flush_line(__p, NDCKPT_FLUSH_CLFLUSH);
+	else if (static_branch_unlikely(&ndckpt_flush_clflushopt))
+		ndckpt_flush_line(__p, NDCKPT_FLUSH_CLFLUSHOPT);
+	else
+		ndckpt_flush_line(__p, NDCKPT_FLUSH_CLWB);
+	if (static_branch_unlikely(&ndckpt_emul))
+		ndckpt_emul_write_back(1);
 }
 
 static inline void ndckpt_invlpg(volatile void *__p)
@@ -110,21 +196,11 @@ static inline void ndckpt_invlpg(volatile void *__p)
 static inline void ndckpt_mfence(void)
 {
 	asm volatile("mfence");
+	if (static_branch_unlikely(&ndckpt_emul))
+		ndckpt_emul_fence();
 }
 
-static inline void ndckpt_clwb_range(volatile void *p, size_t byte_size)
-{
-	const uint64_t end_addr = (uint64_t)p + byte_size;
-	const size_t num_of_lines =
-		((end_addr - ((uint64_t)p & ~(kCacheLineSize - 1))) +
-		 kCacheLineSize - 1) /
-		kCacheLineSize;
-	size_t i;
-	for (i = 0; i < num_of_lines; i++) {
-		ndckpt_clwb(p);
-		p = (volatile uint8_t *)p + kCacheLineSize;
-	}
-}
+void ndckpt_clwb_range(volatile void *p, size_t byte_size); // @ndckpt.c
 
 static inline void memcpy_and_clwb(void *dst, void *src, size_t size)
 {
@@ -132,16 +208,30 @@ static inline void memcpy_and_clwb(void *dst, void *src, size_t size)
 	ndckpt_clwb_range(dst, size);
 }
 
+static inline void memcpy_nt(void *dst, const void *src, size_t size)
+{
+	// Non-temporal stores which bypass cpu caches. No clwb is needed but
+	// ndckpt_sfence() is, as with clwb.
+	memcpy_flushcache(dst, src, size);
+	if (static_branch_unlikely(&ndckpt_emul))
+		ndckpt_emul_write_back(DIV_ROUND_UP(size, kCacheLineSize));
+}
+
 static inline int ndckpt_is_target_vma(struct vm_area_struct *vma)
 {
 	return (vma->vm_ckpt_flags & VM_CKPT_TARGET) != 0;
 }
 
+static inline int ndckpt_is_enabled_on_mm(struct mm_struct *mm)
+{
+	// Decided by mm since all tasks on it share the page tables: threads
+	// and a forked child before exec run on the checkpoint as well.
+	return mm && mm->ndckpt_pproc && ndckpt_is_virt_addr_in_nvdimm(mm->pgd);
+}
+
 static inline int ndckpt_is_enabled_on_task(struct task_struct *target)
 {
-	return target->flags & PF_NDCKPT_ENABLED &&
-	       (target->flags & PF_FORKNOEXEC) == 0 &&
-	       ndckpt_is_virt_addr_in_nvdimm(target->mm->pgd);
+	return ndckpt_is_enabled_on_mm(target->mm);
 }
 
 static inline int ndckpt_is_enabled_on_current(void)
@@ -272,6 +362,32 @@ static inline int ndckpt_pte_alloc(struct mm_struct *mm, pmd_t *pmd,
 		ndckpt___pte_alloc(mm, pmd, vma, address));
 }
 
+spinlock_t *ndckpt_table_lockptr(struct mm_struct *mm,
+				 uint64_t paddr); // @ndckpt.c
+
+static inline spinlock_t *ndckpt_pte_lockptr(struct mm_struct *mm, pmd_t *pmd)
+{
+	// Lock for the PT pointed by pmd. cf. pte_lockptr()
+	if (!ndckpt_is_pmd_points_nvdimm_page(*pmd))
+		return pte_lockptr(mm, pmd);
+	return ndckpt_table_lockptr(mm, ndckpt_pmd_to_pdpt_paddr(*pmd));
+}
+
+static inline spinlock_t *ndckpt_pmd_lockptr(struct mm_struct *mm, pmd_t *pmd)
+{
+	// Lock for the PD which contains pmd. cf. pmd_lockptr()
+	if (!ndckpt_is_virt_addr_in_nvdimm(pmd))
+		return pmd_lockptr(mm, pmd);
+	return ndckpt_table_lockptr(mm, ndckpt_virt_to_phys(pmd) & PAGE_MASK);
+}
+
+static inline spinlock_t *ndckpt_pmd_lock(struct mm_struct *mm, pmd_t *pmd)
+{
+	spinlock_t *ptl = ndckpt_pmd_lockptr(mm, pmd);
+	spin_lock(ptl);
+	return ptl;
+}
+
 static inline void ndckpt_pmd_populate(struct mm_struct *mm, pmd_t *pmd,
 				       pte_t *pte)
 {
@@ -300,20 +416,91 @@ static inline void replace_pt_with_nvdimm_page(pmd_t *ent_of_page)
 	ndckpt_clwb(ent_of_page);
 }
 
-static inline void ndckpt_replace_page_with_nvdimm_page(pte_t *ent_of_page,
-							uint64_t vaddr)
+static inline int ndckpt_is_pte_zero_page(pte_t e)
+{
+	// The zero page is shared by all processes and never written.
+	// See ndckpt_get_zero_page().
+	return (pte_val(e) & _PAGE_PRESENT) && ndckpt_zero_page_paddr &&
+	       (pte_val(e) & PTE_PFN_MASK) == ndckpt_zero_page_paddr;
+}
+
+static inline void ndckpt_replace_page_with_nvdimm_page(pte_t *ent_of_page)
 {
+	// Callers flush the TLB entry of the page.
 	void *old_page_vaddr = (void *)ndckpt_page_page_vaddr(*ent_of_page);
 	void *new_page_vaddr = ndckpt_alloc_zeroed_virt_page();
 	uint64_t new_page_paddr = ndckpt_virt_to_phys(new_page_vaddr);
-	memcpy_and_clwb(new_page_vaddr, old_page_vaddr, PAGE_SIZE);
+	if (!ndckpt_is_pte_zero_page(*ent_of_page))
+		memcpy_and_clwb(new_page_vaddr, old_page_vaddr, PAGE_SIZE);
 	ent_of_page->pte = (ent_of_page->pte & ~PTE_PFN_MASK) | new_page_paddr;
 	pte_mkwrite(*ent_of_page);
 	pte_mkdirty(*ent_of_page);
 	ndckpt_clwb(ent_of_page);
-	ndckpt_invlpg((void *)vaddr);
 }
 
+static inline int ndckpt_is_pte_cow(pte_t e)
+{
+	// Ptes of the zero page may lack the bit, e.g. after mprotect.
+	return ((pte_val(e) & _PAGE_NDCKPT_COW) != 0 &&
+		ndckpt_is_pte_points_nvdimm_page(e)) ||
+	       ndckpt_is_pte_zero_page(e);
+}
+
+static inline int ndckpt_is_pte_dram_cached(pte_t e)
+{
+	// See dram_cache.c
+	return (pte_val(e) & _PAGE_PRESENT) &&
+	       (pte_val(e) & _PAGE_NDCKPT_CACHED) != 0 &&
+	       !ndckpt_is_pte_points_nvdimm_page(e);
+}
+
+static inline void ndckpt_break_cow(struct vm_area_struct *vma,
+				    pte_t *ent_of_page, uint64_t vaddr)
+{
+	// Give the writer a private copy of the page shared by fork or of
+	// the zero page. Other threads may cache the shared page.
+	ndckpt_replace_page_with_nvdimm_page(ent_of_page);
+	ent_of_page->pte = (ent_of_page->pte & ~_PAGE_NDCKPT_COW) | _PAGE_RW |
+			   _PAGE_DIRTY;
+	ndckpt_clwb(ent_of_page);
+	flush_tlb_page(vma, vaddr);
+}
+
+static inline int ndckpt_is_pmd_huge(pmd_t e)
+{
+	// PD entry which maps a 2MiB page instead of a PT
+	return (pmd_val(e) & (_PAGE_PRESENT | _PAGE_PSE)) ==
+	       (_PAGE_PRESENT | _PAGE_PSE);
+}
+
+static inline uint64_t ndckpt_huge_page_paddr(pmd_t e)
+{
+	return pmd_val(e) & pmd_pfn_mask(e);
+}
+
+static inline void ndckpt_split_huge_pmd(pmd_t *ent_of_page)
+{
+	// Replace a 2MiB mapping with a PT which maps the same pages.
+	// Dirty and accessed bits are inherited by all of the ptes.
+	// Translations are unchanged, so callers flush the 2MiB range on all
+	// cpus before changing the ptes, or batch it with their changes.
+	pte_t *t1 = ndckpt_alloc_zeroed_virt_page();
+	uint64_t paddr = ndckpt_huge_page_paddr(*ent_of_page);
+	uint64_t attr = pgprot_val(pgprot_large_2_4k(
+				__pgprot(pmd_flags(*ent_of_page)))) &
+			~_PAGE_NDCKPT_UNSYNCED;
+	int i;
+	for (i = 0; i < PTRS_PER_PTE; i++) {
+		t1[i].pte = (paddr + ((uint64_t)i << PAGE_SHIFT)) | attr;
+	}
+	ndckpt_clwb_range(t1, PAGE_SIZE);
+	ent_of_page->pmd = ndckpt_virt_to_phys(t1) | _PAGE_TABLE;
+	ndckpt_clwb(ent_of_page);
+}
+
+void ndckpt_split_huge_pages(pgd_t *t4, uint64_t start,
+			     uint64_t end); // @pproc.c
+
 void ndckpt_move_pages(struct vm_area_struct *dst_vma,
 		       struct vm_area_struct *src_vma, uint64_t dst_start,
 		       uint64_t src_start, uint64_t size); // @pgtable.c
@@ -332,4 +519,16 @@ int ndckpt_do_ndckpt(struct task_struct *target);
 void ndckpt_erase_page_mappings(pgd_t *t4, uint64_t start,
 				uint64_t end); // @pproc.c
 
+long ndckpt_populate_vma_range(struct vm_area_struct *vma,
+			       unsigned long start,
+			       unsigned long end); // @mm/memory.c
+
+static inline int ndckpt_can_populate_vma(struct vm_area_struct *vma)
+{
+	// Anonymous target vmas are populated on NVDIMM without GUP.
+	return ndckpt_is_enabled_on_current() && vma->vm_mm == current->mm &&
+	       ndckpt_is_target_vma(vma) && vma_is_anonymous(vma) &&
+	       !(vma->vm_flags & VM_SHARED);
+}
+
 #endif /* __NDCKPT_H__ */
@@ -8,7 +8,18 @@
 #include <linux/timekeeping.h>
 #include <linux/ptrace.h>
 #include <linux/sched/task_stack.h>
+#include <linux/sched/mm.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/mman.h>
+#include <linux/workqueue.h>
+#include <linux/sort.h>
+#include <linux/prefetch.h>
+#include <linux/log2.h>
+#include <linux/hash.h>
+#include <linux/dax.h>
 #include <asm/proto.h>
+#include <asm/tlbflush.h>
 #include <uapi/asm/prctl.h>
 
 #include "../nvdimm/pmem.h"
@@ -36,6 +47,22 @@
 static inline void ndckpt_sfence(void)
 {
 	asm volatile("sfence");
+	if (static_branch_unlikely(&ndckpt_emul))
+		ndckpt_emul_fence();
+}
+
+static inline bool ndckpt_is_page_zeroed(const void *page)
+{
+	// ORs 64-bit words a cache line at a time, so a page with data is
+	// rejected after its first non-zero line. SIMD registers are not
+	// usable here without kernel_fpu_begin().
+	const uint64_t *p = page;
+	const uint64_t *end = p + PAGE_SIZE / sizeof(*p);
+	for (; p < end; p += kCacheLineSize / sizeof(*p)) {
+		if (p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7])
+			return false;
+	}
+	return true;
 }
 
 static inline const char *get_str_dram_or_nvdimm(void *p)
@@ -58,7 +85,9 @@ struct PersistentObjectHeader {
 	struct PersistentObjectHeader *volatile next;
 };
 
-#define PMAN_SIGNATURE 0x4D50534F6D75696CULL
+// Changed whenever the layout of the persistent structs changes, so that
+// pmem formatted by an older kernel is initialized again.
+#define PMAN_SIGNATURE 0x4D34534F6D75696CULL
 struct PersistentMemoryManager {
 	volatile uint64_t page_idx; // in virtual addr
 	volatile uint64_t num_of_pages;
@@ -67,11 +96,21 @@ struct PersistentMemoryManager {
 	struct PersistentObjectHeader sentinel;
 	// 2nd cache line begins here
 	volatile uint64_t signature;
+	// Page filled with zero, mapped read-only into target vmas of all
+	// processes. See pman_get_zero_page().
+	void *volatile zero_page;
+	// Scratch pages of bench.c, reused across boots. See pman_get_bench_buf().
+	void *volatile bench_buf;
+	volatile uint64_t num_of_bench_buf_pages;
 };
 
 // @ndckpt.c
 extern struct kobject *kobj_ndckpt;
 extern struct pmem_device *first_pmem_device;
+extern bool ndckpt_lazy_restore;
+extern bool ndckpt_restore_prefetch;
+extern unsigned int ndckpt_dram_cache_pages;
+extern unsigned int ndckpt_tlb_flush_ceiling;
 
 // @pgtable.c
 /*
@@ -116,6 +155,7 @@ static inline int table_state(uint64_t ev)
 
 #define PAGE_STATE_X 0
 #define PAGE_STATE_Pv 4
+#define PAGE_STATE_Pvc 5 // On DRAM, cached with a home page on NVDIMM
 #define PAGE_STATE_Pnc 6
 #define PAGE_STATE_Pnd 7
 
@@ -129,6 +169,9 @@ static inline int page_state(uint64_t ev)
 	if (ndckpt_is_phys_addr_in_nvdimm(ev & PTE_PFN_MASK)) {
 		return PAGE_STATE_Pnc + ((ev & _PAGE_DIRTY) ? 1 : 0);
 	}
+	if (ev & _PAGE_NDCKPT_CACHED) {
+		return PAGE_STATE_Pvc;
+	}
 	return PAGE_STATE_Pv;
 }
 
@@ -174,10 +217,24 @@ static inline uint64_t page_fixed_attr_pte(pte_t *e)
 	return e->pte & PTE_FIXED_ATTR_MASK;
 }
 
+static inline uint64_t huge_page_fixed_attr_pde(pmd_t *e)
+{
+	return e->pmd & ~pmd_pfn_mask(*e) & ~_PAGE_DIRTY & ~_PAGE_ACCESSED &
+	       ~_PAGE_NDCKPT_UNSYNCED;
+}
+
+static inline uint64_t private_page_fixed_attr_pte(pte_t *e)
+{
+	// Attrs for a private copy of the NVDIMM page mapped by e. It is not
+	// shared by fork, so the first write just makes it writable again.
+	return page_fixed_attr_pte(e) & ~_PAGE_NDCKPT_COW;
+}
+
 static inline void sync_fixed_attr_pte(pte_t *dst, pte_t *src)
 {
+	// dst maps its own copy of the page of src.
 	dst->pte = (dst->pte & ~PTE_FIXED_ATTR_MASK) |
-		   (src->pte & PTE_FIXED_ATTR_MASK);
+		   private_page_fixed_attr_pte(src);
 	ndckpt_clwb(dst);
 }
 
@@ -276,6 +333,14 @@ static inline void map_zeroed_nvdimm_page_page(pte_t *e, uint64_t attr)
 	ndckpt_clwb(e);
 }
 
+static inline void map_zeroed_nvdimm_huge_page(pmd_t *e, uint64_t attr)
+{
+	void *new_page_vaddr = ndckpt_alloc_zeroed_huge_page();
+	uint64_t new_page_paddr = ndckpt_virt_to_phys(new_page_vaddr);
+	e->pmd = new_page_paddr | _PAGE_PRESENT | _PAGE_PSE | attr;
+	ndckpt_clwb(e);
+}
+
 static inline void unmap_pdpt_and_clwb(pgd_t *ent_of_page)
 {
 	ent_of_page->pgd = 0;
@@ -334,6 +399,52 @@ static inline void copy_pde_and_clwb(pmd_t *dst, pmd_t *src)
 	ndckpt_clwb(dst);
 }
 
+// Range of user addresses to be flushed from TLB at once, like struct
+// mmu_gather. Entries are flushed on all cpus using the mm.
+struct TlbFlushBatch {
+	struct mm_struct *mm;
+	uint64_t start;
+	uint64_t end;
+	bool freed_tables;
+};
+
+static inline void tlb_flush_batch_init(struct TlbFlushBatch *tlb,
+					struct mm_struct *mm, pgd_t *t4)
+{
+	// Entries of a pgd other than mm->pgd can not be in TLB. They are
+	// dropped when the pgd is loaded. See switch_mm_context().
+	tlb->mm = t4 == mm->pgd ? mm : NULL;
+	tlb->start = TASK_SIZE_MAX;
+	tlb->end = 0;
+	tlb->freed_tables = false;
+}
+
+static inline void tlb_flush_batch_add(struct TlbFlushBatch *tlb,
+				       uint64_t addr, uint64_t size)
+{
+	tlb->start = min(tlb->start, addr);
+	tlb->end = max(tlb->end, addr + size);
+}
+
+static inline void tlb_flush_batch_add_table(struct TlbFlushBatch *tlb,
+					     uint64_t addr)
+{
+	// A table above addr is replaced. Any flush drops paging-structure
+	// caches, so one page is enough.
+	tlb_flush_batch_add(tlb, addr, PAGE_SIZE);
+	tlb->freed_tables = true;
+}
+
+static inline void tlb_flush_batch_flush(struct TlbFlushBatch *tlb)
+{
+	if (tlb->mm && tlb->start < tlb->end)
+		flush_tlb_mm_range(tlb->mm, tlb->start, tlb->end, PAGE_SHIFT,
+				   tlb->freed_tables);
+	tlb->start = TASK_SIZE_MAX;
+	tlb->end = 0;
+	tlb->freed_tables = false;
+}
+
 static inline void unmap_page_and_clwb(pte_t *ent_of_page, uint64_t addr)
 {
 	ent_of_page->pte = 0;
@@ -358,9 +469,70 @@ static inline void replace_page_with_nvdimm_page(pte_t *ent_of_page)
 	ndckpt_clwb(ent_of_page);
 }
 
+static inline void replace_huge_page_with_nvdimm_page(pmd_t *ent_of_page)
+{
+	void *old_page_vaddr =
+		ndckpt_p2v(ndckpt_huge_page_paddr(*ent_of_page));
+	void *new_page_vaddr = ndckpt_alloc_zeroed_huge_page();
+	uint64_t new_page_paddr = ndckpt_virt_to_phys(new_page_vaddr);
+	memcpy_and_clwb(new_page_vaddr, old_page_vaddr, PMD_SIZE);
+	ent_of_page->pmd =
+		(ent_of_page->pmd & ~pmd_pfn_mask(*ent_of_page)) | new_page_paddr;
+	ndckpt_clwb(ent_of_page);
+}
+
 void ndckpt_print_pml4(pgd_t *pgd);
 void pr_ndckpt_pml4(pgd_t *pgd);
 
+// Per-process counters shown in /proc/<pid>/ndckpt. See stats.c.
+#define PPROC_STAT_COMMITS 0
+#define PPROC_STAT_DIRTY_PAGES 1 // in 4KiB pages
+#define PPROC_STAT_BYTES_FLUSHED 2
+#define PPROC_STAT_BYTES_COPIED 3
+#define PPROC_STAT_ZERO_PAGES_FOLDED 4
+#define PPROC_STAT_FAULTS 5 // + NDCKPT_FAULT_*
+#define PPROC_NUM_OF_STATS (PPROC_STAT_FAULTS + NDCKPT_NUM_OF_FAULT_TYPES)
+
+struct PprocStatCounters {
+	uint64_t v[PPROC_NUM_OF_STATS];
+};
+
+struct PprocStats {
+	// Updated without locks on the cpu running the code path
+	struct PprocStatCounters __percpu *counters;
+	// Updated by commits under ckpt_lock
+	uint64_t commit_start_ns;
+	uint64_t commit_start_dirty_pages;
+	uint64_t last_commit_ns;
+	uint64_t last_commit_dirty_pages;
+};
+
+static inline void pproc_stats_add(struct PprocStats *stats, int idx,
+				   uint64_t v)
+{
+	if (stats)
+		this_cpu_add(stats->counters->v[idx], v);
+}
+
+// @bench.c
+int bench_run(const char *args);
+ssize_t bench_show(char *buf);
+
+// @emul.c
+int ndckpt_set_emul(uint64_t wb_ns, uint64_t fence_ns, uint64_t bandwidth_mbps);
+ssize_t ndckpt_emul_show(char *buf);
+
+// @dram_cache.c
+struct DramCacheState;
+struct DramCacheState *dram_cache_alloc(void);
+void dram_cache_free(struct DramCacheState *cache);
+void dram_cache_writeback_page(struct DramCacheState *cache, pte_t *e,
+			       uint64_t addr);
+void dram_cache_add_candidate(struct DramCacheState *cache, uint64_t addr);
+void dram_cache_install(struct DramCacheState *cache, pgd_t *t4);
+void dram_cache_free_demoted(struct DramCacheState *cache);
+void dram_cache_evict(struct DramCacheState *cache, struct mm_struct *mm);
+
 // @pman.c
 bool pman_is_valid(struct PersistentMemoryManager *pman);
 void pman_update_head(struct PersistentMemoryManager *pman,
@@ -370,6 +542,17 @@ void pman_set_last_proc_info(struct PersistentMemoryManager *pman,
 void pman_init(struct pmem_device *pmem);
 void *pman_alloc_zeroed_pages(struct PersistentMemoryManager *pman,
 			      uint64_t num_of_pages_requested);
+void *pman_alloc_pages(struct PersistentMemoryManager *pman,
+		       uint64_t num_of_pages_requested);
+void *pman_alloc_zeroed_huge_page(struct PersistentMemoryManager *pman);
+uint64_t pman_get_num_of_free_pages(struct PersistentMemoryManager *pman);
+void pman_free_zeroed_page(struct PersistentMemoryManager *pman, void *page);
+void *pman_get_zero_page(struct PersistentMemoryManager *pman);
+void *pman_load_zero_page(struct PersistentMemoryManager *pman);
+void *pman_get_bench_buf(struct PersistentMemoryManager *pman,
+			 uint64_t num_of_pages);
+struct PersistentProcessInfo *
+pman_find_proc_info(struct PersistentMemoryManager *pman, uint64_t obj_id);
 void pman_printk(struct PersistentMemoryManager *pman);
 void pman_print_last_proc_info(struct PersistentMemoryManager *pman);
 
@@ -384,11 +567,23 @@ void pobj_printk(struct PersistentObjectHeader *pobj);
 // @pproc.c
 struct PersistentProcessInfo;
 bool pproc_is_valid(struct PersistentProcessInfo *pproc);
+void pproc_discard(struct PersistentProcessInfo *pproc);
 pgd_t *pproc_get_org_pgd(struct PersistentProcessInfo *pproc);
 void pproc_set_pgd(struct PersistentProcessInfo *pproc, int ctx_idx,
 		   pgd_t *pgd);
 void pproc_set_valid_ctx(struct PersistentProcessInfo *pproc, int ctx_idx);
 int pproc_get_running_ctx(struct PersistentProcessInfo *pproc);
+int pproc_get_valid_ctx(struct PersistentProcessInfo *pproc);
+pgd_t *pproc_get_pgd(struct PersistentProcessInfo *pproc, int ctx_idx);
+struct PprocStats *pproc_get_stats(struct PersistentProcessInfo *pproc);
+uint64_t pproc_get_commit_seq(struct PersistentProcessInfo *pproc);
+size_t pproc_get_ctx_state_size(void);
+void pproc_get_ctx_state(struct PersistentProcessInfo *pproc, int ctx_idx,
+			 void *dst);
+struct PersistentProcessInfo *
+pproc_alloc_imported(struct PersistentMemoryManager *pman,
+		     const void *ctx_state, struct file *exe);
+void pproc_stats_release(struct PersistentProcessInfo *pproc);
 void pproc_set_regs(struct PersistentProcessInfo *proc, int ctx_idx,
 		    struct task_struct *src);
 void pproc_restore_regs(struct task_struct *dst,
@@ -403,6 +598,31 @@ int64_t pproc_restore(struct PersistentMemoryManager *, struct task_struct *,
 		      struct PersistentProcessInfo *);
 int64_t pproc_init(struct task_struct *, struct PersistentMemoryManager *,
 		   struct mm_struct *, struct pt_regs *);
+int pproc_dup_mmap(struct PersistentMemoryManager *pman, struct mm_struct *mm,
+		   struct mm_struct *oldmm);
+void pproc_fork(struct PersistentProcessInfo *pproc, struct task_struct *child);
+bool pproc_is_restorable_from_file(struct PersistentProcessInfo *pproc,
+				   struct file *file);
+int pproc_build_mm(struct PersistentProcessInfo *pproc, struct mm_struct *mm,
+		   struct file *file);
+void pproc_lazy_restore_fault(struct PersistentProcessInfo *pproc,
+			      uint64_t addr);
+void pproc_lazy_restore_complete(struct PersistentProcessInfo *pproc);
+void pproc_lazy_restore_release(struct PersistentProcessInfo *pproc,
+				struct mm_struct *mm, bool finish);
+void pproc_dram_cache_evict(struct PersistentProcessInfo *pproc,
+			    struct mm_struct *mm);
+void pproc_dram_cache_release(struct PersistentProcessInfo *pproc);
+
+// @stats.c
+struct PprocStats *pproc_stats_alloc(void);
+void pproc_stats_free(struct PprocStats *stats);
+void pproc_stats_commit_begin(struct PprocStats *stats);
+void pproc_stats_commit_end(struct PprocStats *stats);
+
+// @binfmt.c
+void ndckpt_register_binfmt(void);
+void ndckpt_unregister_binfmt(void);
 
 // @sysfs.c
 int sysfs_interface_init(void);
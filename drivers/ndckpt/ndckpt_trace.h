@@ -0,0 +1,223 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#if !defined(_NDCKPT_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _NDCKPT_TRACE_H_
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+#include "ndckpt_internal.h"
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ndckpt
+#define TRACE_INCLUDE_FILE ndckpt_trace
+
+// Tracepoints are defined in ndckpt.c. Enable them with e.g.
+//   echo 1 > /sys/kernel/debug/tracing/events/ndckpt/enable
+// or perf record -e 'ndckpt:*'.
+
+#define show_fault_type(type)                                                  \
+	__print_symbolic(type, { NDCKPT_FAULT_FILE, "file" },                  \
+			 { NDCKPT_FAULT_ANON, "anon" },                        \
+			 { NDCKPT_FAULT_FORK_COW, "fork_cow" },                \
+			 { NDCKPT_FAULT_FILE_COW, "file_cow" },                \
+			 { NDCKPT_FAULT_WRITE, "write" },                      \
+			 { NDCKPT_FAULT_ZERO_COW, "zero_cow" })
+
+#define show_page_state(state)                                                 \
+	__print_symbolic(state, { PAGE_STATE_X, "X" }, { PAGE_STATE_Pv, "Pv" }, \
+			 { PAGE_STATE_Pvc, "Pvc" }, { PAGE_STATE_Pnc, "Pnc" },  \
+			 { PAGE_STATE_Pnd, "Pnd" })
+
+TRACE_EVENT(ndckpt_fault,
+	    TP_PROTO(struct vm_fault *vmf, int type),
+	    TP_ARGS(vmf, type),
+
+	    TP_STRUCT__entry(
+			     __field(unsigned long, address)
+			     __field(unsigned int, flags)
+			     __field(int, type)
+			     __field(u64, pte)
+			     ),
+
+	    TP_fast_assign(
+			   __entry->address = vmf->address;
+			   __entry->flags = vmf->flags;
+			   __entry->type = type;
+			   __entry->pte = vmf->pte ? pte_val(vmf->orig_pte) : 0;
+			   ),
+
+	    TP_printk("address=0x%lx flags=0x%x type=%s pte=0x%llx",
+		      __entry->address, __entry->flags,
+		      show_fault_type(__entry->type), __entry->pte)
+);
+
+TRACE_EVENT(ndckpt_pman_alloc,
+	    TP_PROTO(void *addr, u64 num_of_pages, u64 align_in_pages,
+		     u64 num_of_free_pages),
+	    TP_ARGS(addr, num_of_pages, align_in_pages, num_of_free_pages),
+
+	    TP_STRUCT__entry(
+			     __field(u64, paddr)
+			     __field(u64, num_of_pages)
+			     __field(u64, align_in_pages)
+			     __field(u64, num_of_free_pages)
+			     ),
+
+	    TP_fast_assign(
+			   __entry->paddr = ndckpt_virt_to_phys(addr);
+			   __entry->num_of_pages = num_of_pages;
+			   __entry->align_in_pages = align_in_pages;
+			   __entry->num_of_free_pages = num_of_free_pages;
+			   ),
+
+	    TP_printk("paddr=0x%llx pages=%llu align=%llu free=%llu",
+		      __entry->paddr, __entry->num_of_pages,
+		      __entry->align_in_pages, __entry->num_of_free_pages)
+);
+
+TRACE_EVENT(ndckpt_sync_page,
+	    TP_PROTO(u64 addr, int prev_state, int next_state),
+	    TP_ARGS(addr, prev_state, next_state),
+
+	    TP_STRUCT__entry(
+			     __field(u64, addr)
+			     __field(int, prev_state)
+			     __field(int, next_state)
+			     ),
+
+	    TP_fast_assign(
+			   __entry->addr = addr;
+			   __entry->prev_state = prev_state;
+			   __entry->next_state = next_state;
+			   ),
+
+	    TP_printk("addr=0x%llx %s -> %s", __entry->addr,
+		      show_page_state(__entry->prev_state),
+		      show_page_state(__entry->next_state))
+);
+
+TRACE_EVENT(ndckpt_flush_page,
+	    TP_PROTO(u64 addr, void *page, u64 size, bool dirty),
+	    TP_ARGS(addr, page, size, dirty),
+
+	    TP_STRUCT__entry(
+			     __field(u64, addr)
+			     __field(u64, paddr)
+			     __field(u64, size)
+			     __field(bool, dirty)
+			     ),
+
+	    TP_fast_assign(
+			   __entry->addr = addr;
+			   __entry->paddr = ndckpt_v2p(page);
+			   __entry->size = size;
+			   __entry->dirty = dirty;
+			   ),
+
+	    TP_printk("addr=0x%llx paddr=0x%llx size=%llu dirty=%d",
+		      __entry->addr, __entry->paddr, __entry->size,
+		      __entry->dirty)
+);
+
+TRACE_EVENT(ndckpt_switch_mm_context,
+	    TP_PROTO(struct task_struct *target, pgd_t *pgd, bool deferred,
+		     bool full, int num_of_ranges, u64 num_of_invlpgs),
+	    TP_ARGS(target, pgd, deferred, full, num_of_ranges, num_of_invlpgs),
+
+	    TP_STRUCT__entry(
+			     __field(pid_t, pid)
+			     __field(u64, pgd)
+			     __field(bool, deferred)
+			     __field(bool, full)
+			     __field(int, num_of_ranges)
+			     __field(u64, num_of_invlpgs)
+			     ),
+
+	    TP_fast_assign(
+			   __entry->pid = target->pid;
+			   __entry->pgd = ndckpt_virt_to_phys(pgd);
+			   __entry->deferred = deferred;
+			   __entry->full = full;
+			   __entry->num_of_ranges = num_of_ranges;
+			   __entry->num_of_invlpgs = num_of_invlpgs;
+			   ),
+
+	    TP_printk("pid=%d pgd=0x%llx deferred=%d full=%d ranges=%d invlpgs=%llu",
+		      __entry->pid, __entry->pgd, __entry->deferred,
+		      __entry->full, __entry->num_of_ranges,
+		      __entry->num_of_invlpgs)
+);
+
+DECLARE_EVENT_CLASS(ndckpt_commit,
+	    TP_PROTO(struct task_struct *target, int ctx_idx),
+	    TP_ARGS(target, ctx_idx),
+
+	    TP_STRUCT__entry(
+			     __field(pid_t, pid)
+			     __field(int, ctx_idx)
+			     ),
+
+	    TP_fast_assign(
+			   __entry->pid = target->pid;
+			   __entry->ctx_idx = ctx_idx;
+			   ),
+
+	    TP_printk("pid=%d ctx=%d", __entry->pid, __entry->ctx_idx)
+);
+
+DEFINE_EVENT(ndckpt_commit, ndckpt_commit_begin,
+	TP_PROTO(struct task_struct *target, int ctx_idx),
+	TP_ARGS(target, ctx_idx)
+);
+
+DEFINE_EVENT(ndckpt_commit, ndckpt_commit_end,
+	TP_PROTO(struct task_struct *target, int ctx_idx),
+	TP_ARGS(target, ctx_idx)
+);
+
+TRACE_EVENT(ndckpt_restore_begin,
+	    TP_PROTO(struct task_struct *target,
+		     struct PersistentProcessInfo *pproc, bool lazy),
+	    TP_ARGS(target, pproc, lazy),
+
+	    TP_STRUCT__entry(
+			     __field(pid_t, pid)
+			     __field(u64, obj_id)
+			     __field(int, valid_ctx_idx)
+			     __field(bool, lazy)
+			     ),
+
+	    TP_fast_assign(
+			   __entry->pid = target->pid;
+			   __entry->obj_id = pobj_get_header(pproc)->id;
+			   __entry->valid_ctx_idx = pproc_get_valid_ctx(pproc);
+			   __entry->lazy = lazy;
+			   ),
+
+	    TP_printk("pid=%d obj=%llu valid_ctx=%d lazy=%d", __entry->pid,
+		      __entry->obj_id, __entry->valid_ctx_idx, __entry->lazy)
+);
+
+TRACE_EVENT(ndckpt_restore_end,
+	    TP_PROTO(struct task_struct *target, s64 ret),
+	    TP_ARGS(target, ret),
+
+	    TP_STRUCT__entry(
+			     __field(pid_t, pid)
+			     __field(s64, ret)
+			     ),
+
+	    TP_fast_assign(
+			   __entry->pid = target->pid;
+			   __entry->ret = ret;
+			   ),
+
+	    TP_printk("pid=%d ret=%lld", __entry->pid, __entry->ret)
+);
+
+#endif /* _NDCKPT_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH ../../drivers/ndckpt
+#include <trace/define_trace.h>
@@ -39,6 +39,8 @@ static void ndckpt_print_pd(pmd_t *pmd)
 		if ((e & _PAGE_PRESENT) == 0)
 			continue;
 		pr_ndckpt("    PD  [0x%03X] = 0x%016llX\n", i, e);
+		if (ndckpt_is_pmd_huge(pmd[i]))
+			continue;
 		ndckpt_print_pt((pte_t *)ndckpt_pmd_page_vaddr(pmd[i]));
 	}
 }
@@ -133,6 +135,14 @@ void pr_ndckpt_pgtable_range(pgd_t *t4, uint64_t start, uint64_t end)
 			addr = next_pde_addr(addr);
 			continue;
 		}
+		if (ndckpt_is_pmd_huge(*e2)) {
+			page_paddr = ndckpt_huge_page_paddr(*e2);
+			pr_ndckpt("    HUGE @ 0x%016llX v->p 0x%016llX on %s\n",
+				  addr & PMD_MASK, page_paddr,
+				  get_str_dram_or_nvdimm_phys(page_paddr));
+			addr = next_pde_addr(addr);
+			continue;
+		}
 		t1 = (void *)ndckpt_pmd_page_vaddr(*e2);
 		i1 = PADDR_TO_IDX_IN_PT(addr);
 		e1 = &t1[i1];
@@ -150,6 +160,14 @@ void pr_ndckpt_pgtable_range(pgd_t *t4, uint64_t start, uint64_t end)
 }
 EXPORT_SYMBOL(pr_ndckpt_pgtable_range);
 
+static inline bool can_move_table(uint64_t dst, uint64_t src, uint64_t size,
+				  uint64_t table_size)
+{
+	// Both ranges are covered by whole entries of the upper tables
+	return size >= table_size && (dst & (table_size - 1)) == 0 &&
+	       (src & (table_size - 1)) == 0;
+}
+
 void ndckpt_move_pages(struct vm_area_struct *dst_vma,
 		       struct vm_area_struct *src_vma, uint64_t dst_start,
 		       uint64_t src_start, uint64_t size)
@@ -181,12 +199,15 @@ void ndckpt_move_pages(struct vm_area_struct *dst_vma,
 	void *dst_page_vaddr;
 	//
 	void *tmp_page_addr;
+	struct TlbFlushBatch tlb;
 
 	pr_ndckpt_vma(dst_vma);
 	pr_ndckpt_vma(src_vma);
 	pr_ndckpt("[0x%016llX - 0x%016llX] <= [0x%016llX - 0x%016llX]\n",
 		  dst_start, dst_start + size, src_start, src_start + size);
 
+	// Both vmas are in the same mm. See move_vma() @ mm/mremap.c
+	tlb_flush_batch_init(&tlb, src_vma->vm_mm, src_t4);
 	for (ofs = 0; ofs < size;) {
 		traverse_pml4e(src_start + ofs, src_t4, &src_e4, &src_t3);
 		traverse_pml4e(dst_start + ofs, dst_t4, &dst_e4, &dst_t3);
@@ -205,8 +226,7 @@ void ndckpt_move_pages(struct vm_area_struct *dst_vma,
 				__p4d(_PAGE_TABLE |
 				      ndckpt_virt_to_phys(tmp_page_addr));
 			ndckpt_clwb(dst_e4);
-			ndckpt_invlpg((void *)(src_start + ofs));
-			ndckpt_invlpg((void *)(dst_start + ofs));
+			tlb_flush_batch_add_table(&tlb, dst_start + ofs);
 			continue; // Retry
 		}
 		traverse_pdpte(src_start + ofs, src_t3, &src_e3, &src_t2);
@@ -215,6 +235,19 @@ void ndckpt_move_pages(struct vm_area_struct *dst_vma,
 			ofs = next_pdpte_addr(src_start + ofs) - src_start;
 			continue;
 		}
+		if (!dst_t2 && ndckpt_is_virt_addr_in_nvdimm(src_t2) &&
+		    can_move_table(dst_start + ofs, src_start + ofs, size - ofs,
+				   PUD_SIZE)) {
+			// Relink the whole PD
+			*dst_e3 = *src_e3;
+			ndckpt_clwb(dst_e3);
+			src_e3->pud = 0;
+			ndckpt_clwb(src_e3);
+			tlb_flush_batch_add(&tlb, src_start + ofs, PUD_SIZE);
+			tlb_flush_batch_add_table(&tlb, src_start + ofs);
+			ofs += PUD_SIZE;
+			continue;
+		}
 		if (!dst_t2 || !ndckpt_is_virt_addr_in_nvdimm(dst_t2)) {
 			// Alloc
 			tmp_page_addr = ndckpt_alloc_zeroed_virt_page();
@@ -225,8 +258,7 @@ void ndckpt_move_pages(struct vm_area_struct *dst_vma,
 			*dst_e3 = __pud(_PAGE_TABLE |
 					ndckpt_virt_to_phys(tmp_page_addr));
 			ndckpt_clwb(dst_e3);
-			ndckpt_invlpg((void *)(src_start + ofs));
-			ndckpt_invlpg((void *)(dst_start + ofs));
+			tlb_flush_batch_add_table(&tlb, dst_start + ofs);
 			continue; // Retry
 		}
 		traverse_pde(src_start + ofs, src_t2, &src_e2, &src_t1);
@@ -235,6 +267,30 @@ void ndckpt_move_pages(struct vm_area_struct *dst_vma,
 			ofs = next_pde_addr(src_start + ofs) - src_start;
 			continue;
 		}
+		if (!dst_t1 &&
+		    (ndckpt_is_pmd_huge(*src_e2) ||
+		     ndckpt_is_virt_addr_in_nvdimm(src_t1)) &&
+		    can_move_table(dst_start + ofs, src_start + ofs, size - ofs,
+				   PMD_SIZE)) {
+			// Relink the whole PT or 2MiB page
+			*dst_e2 = *src_e2;
+			ndckpt_clwb(dst_e2);
+			src_e2->pmd = 0;
+			ndckpt_clwb(src_e2);
+			tlb_flush_batch_add(&tlb, src_start + ofs, PMD_SIZE);
+			tlb_flush_batch_add_table(&tlb, src_start + ofs);
+			ofs += PMD_SIZE;
+			continue;
+		}
+		if (ndckpt_is_pmd_huge(*src_e2)) {
+			// Pages are moved per 4KiB
+			ndckpt_split_huge_pmd(src_e2);
+			continue; // Retry
+		}
+		if (dst_t1 && ndckpt_is_pmd_huge(*dst_e2)) {
+			ndckpt_split_huge_pmd(dst_e2);
+			continue; // Retry
+		}
 		if (!dst_t1 || !ndckpt_is_virt_addr_in_nvdimm(dst_t1)) {
 			// Alloc
 			tmp_page_addr = ndckpt_alloc_zeroed_virt_page();
@@ -245,8 +301,7 @@ void ndckpt_move_pages(struct vm_area_struct *dst_vma,
 			*dst_e2 = __pmd(_PAGE_TABLE |
 					ndckpt_virt_to_phys(tmp_page_addr));
 			ndckpt_clwb(dst_e2);
-			ndckpt_invlpg((void *)(src_start + ofs));
-			ndckpt_invlpg((void *)(dst_start + ofs));
+			tlb_flush_batch_add_table(&tlb, dst_start + ofs);
 			continue; // Retry
 		}
 		traverse_pte(src_start + ofs, src_t1, &src_e1, &src_page_vaddr);
@@ -258,16 +313,15 @@ void ndckpt_move_pages(struct vm_area_struct *dst_vma,
 		// Remap leaf page
 		*dst_e1 = *src_e1;
 		ndckpt_clwb(dst_e1);
-		ndckpt_invlpg(dst_page_vaddr);
 		// Clear old mapping
 		src_e1->pte = 0;
 		ndckpt_clwb(src_e1);
-		ndckpt_invlpg(src_page_vaddr);
-		ndckpt_invlpg((void *)(src_start + ofs));
-		ndckpt_invlpg((void *)(dst_start + ofs));
+		tlb_flush_batch_add(&tlb, src_start + ofs, PAGE_SIZE);
+		tlb_flush_batch_add(&tlb, dst_start + ofs, PAGE_SIZE);
 
 		ofs = next_pte_addr(src_start + ofs) - src_start;
 	}
 	ndckpt_sfence();
+	tlb_flush_batch_flush(&tlb);
 }
 EXPORT_SYMBOL(ndckpt_move_pages);
@@ -1,4 +1,26 @@
 #include "ndckpt_internal.h"
+#include "ndckpt_trace.h"
+
+// Serializes allocations. Faults of a process and the lazy restore worker
+// can allocate pages at the same time.
+static DEFINE_SPINLOCK(pman_alloc_lock);
+
+// 2MiB pages are carved from a pool aligned to PMD_SIZE.
+// Every object has a header page just before it, so aligning each 2MiB page
+// separately would waste almost 2MiB per page.
+// This is only valid while the power is on. Unused pages in it are wasted.
+#define PMAN_HUGE_POOL_PAGES (16 * PTRS_PER_PMD)
+static DEFINE_SPINLOCK(pman_huge_pool_lock);
+static uint8_t *pman_huge_pool_next;
+static uint8_t *pman_huge_pool_end;
+
+// Zeroed pages given back while the power is on, e.g. pages folded into the
+// zero page on commit. pman_alloc_zeroed_pages() hands them out again
+// without zeroing. Pages beyond the capacity are just wasted.
+#define PMAN_ZEROED_POOL_PAGES 1024
+static DEFINE_SPINLOCK(pman_zeroed_pool_lock);
+static void *pman_zeroed_pool[PMAN_ZEROED_POOL_PAGES];
+static int pman_zeroed_pool_size;
 
 bool pman_is_valid(struct PersistentMemoryManager *pman)
 {
@@ -30,9 +52,20 @@ void pman_init(struct pmem_device *pmem)
 	ndckpt_sfence();
 	// Initialize metadata and flush
 	pman->page_idx = (uint64_t)pmem->virt_addr >> kPageSizeExponent;
+	spin_lock(&pman_huge_pool_lock);
+	pman_huge_pool_next = NULL;
+	pman_huge_pool_end = NULL;
+	spin_unlock(&pman_huge_pool_lock);
+	spin_lock(&pman_zeroed_pool_lock);
+	pman_zeroed_pool_size = 0;
+	spin_unlock(&pman_zeroed_pool_lock);
 	pman->num_of_pages = pmem->size >> kPageSizeExponent;
 	pman->head = NULL;
 	pman->last_proc_info = NULL;
+	pman->zero_page = NULL;
+	ndckpt_zero_page_paddr = 0;
+	pman->bench_buf = NULL;
+	pman->num_of_bench_buf_pages = 0;
 	ndckpt_clwb_range(pman, sizeof(*pman));
 	ndckpt_sfence();
 
@@ -49,15 +82,28 @@ void pman_init(struct pmem_device *pmem)
 	printk("ndckpt: pman init done\n");
 }
 
-void *pman_alloc_zeroed_pages(struct PersistentMemoryManager *pman,
-			      uint64_t num_of_pages_requested)
+static void *pman_alloc_aligned_pages(struct PersistentMemoryManager *pman,
+				      uint64_t num_of_pages_requested,
+				      uint64_t align_in_pages, bool zeroed)
 {
+	// The physical address of the returned pages is aligned to
+	// align_in_pages pages. align_in_pages should be a power of 2.
+	// Pages are not zeroed unless zeroed is true.
 	struct PersistentObjectHeader *new_obj;
-	struct PersistentObjectHeader *const head = pman->head;
-	const uint64_t next_page_idx =
-		((uint64_t)pobj_get_base(head) >> kPageSizeExponent) +
-		head->num_of_pages;
+	struct PersistentObjectHeader *head;
+	uint64_t next_page_idx;
+	uint64_t base_phys_idx;
+	uint64_t num_of_free_pages;
 	void *addr;
+	spin_lock(&pman_alloc_lock);
+	head = pman->head;
+	next_page_idx = ((uint64_t)pobj_get_base(head) >> kPageSizeExponent) +
+			head->num_of_pages;
+	// Skip pages to align the base. The header is placed just before it.
+	base_phys_idx = ndckpt_virt_to_phys((void *)((next_page_idx + 1)
+						     << kPageSizeExponent)) >>
+			kPageSizeExponent;
+	next_page_idx += ALIGN(base_phys_idx, align_in_pages) - base_phys_idx;
 	if (num_of_pages_requested > pman->num_of_pages ||
 	    num_of_pages_requested + 1 + next_page_idx >=
 		    pman->page_idx + pman->num_of_pages) {
@@ -69,13 +115,149 @@ void *pman_alloc_zeroed_pages(struct PersistentMemoryManager *pman,
 						    sizeof(*new_obj));
 	pobj_init(new_obj, head->id + 1, num_of_pages_requested, head);
 	pman_update_head(pman, new_obj);
+	num_of_free_pages = pman->page_idx + pman->num_of_pages -
+			    (next_page_idx + 1 + num_of_pages_requested);
+	spin_unlock(&pman_alloc_lock);
 	addr = pobj_get_base(new_obj);
+	trace_ndckpt_pman_alloc(addr, num_of_pages_requested, align_in_pages,
+				num_of_free_pages);
+	if (!zeroed)
+		return addr;
 	memset(addr, 0, PAGE_SIZE * num_of_pages_requested);
 	ndckpt_clwb_range(addr, PAGE_SIZE * num_of_pages_requested);
 	ndckpt_sfence();
 	return addr;
 }
 
+uint64_t pman_get_num_of_free_pages(struct PersistentMemoryManager *pman)
+{
+	// Pages after head. Other allocations may take them right after this.
+	struct PersistentObjectHeader *head;
+	uint64_t next_page_idx;
+	spin_lock(&pman_alloc_lock);
+	head = pman->head;
+	next_page_idx = ((uint64_t)pobj_get_base(head) >> kPageSizeExponent) +
+			head->num_of_pages;
+	spin_unlock(&pman_alloc_lock);
+	if (next_page_idx + 1 >= pman->page_idx + pman->num_of_pages)
+		return 0;
+	return pman->page_idx + pman->num_of_pages - (next_page_idx + 1);
+}
+
+void *pman_alloc_zeroed_pages(struct PersistentMemoryManager *pman,
+			      uint64_t num_of_pages_requested)
+{
+	void *page = NULL;
+	if (num_of_pages_requested == 1) {
+		spin_lock(&pman_zeroed_pool_lock);
+		if (pman_zeroed_pool_size)
+			page = pman_zeroed_pool[--pman_zeroed_pool_size];
+		spin_unlock(&pman_zeroed_pool_lock);
+		if (page)
+			return page;
+	}
+	return pman_alloc_aligned_pages(pman, num_of_pages_requested, 1, true);
+}
+
+void pman_free_zeroed_page(struct PersistentMemoryManager *pman, void *page)
+{
+	// page should be filled with zero, flushed and no longer mapped.
+	spin_lock(&pman_zeroed_pool_lock);
+	if (pman_zeroed_pool_size < PMAN_ZEROED_POOL_PAGES)
+		pman_zeroed_pool[pman_zeroed_pool_size++] = page;
+	spin_unlock(&pman_zeroed_pool_lock);
+}
+
+void *pman_load_zero_page(struct PersistentMemoryManager *pman)
+{
+	// Returns the zero page of pman, or NULL if it has none yet.
+	if (!pman_is_valid(pman))
+		return NULL;
+	return pman->zero_page;
+}
+
+void *pman_get_zero_page(struct PersistentMemoryManager *pman)
+{
+	// Returns the zero page of pman, allocating it on the first call.
+	// It is never written after that.
+	void *old = pman->zero_page;
+	void *page = pman_load_zero_page(pman);
+	if (page)
+		return page;
+	page = pman_alloc_aligned_pages(pman, 1, 1, true);
+	if (cmpxchg(&pman->zero_page, old, page) != old) {
+		// Allocated by another one. The page is just wasted.
+		return pman->zero_page;
+	}
+	ndckpt_clwb(&pman->zero_page);
+	ndckpt_sfence();
+	return page;
+}
+
+void *pman_get_bench_buf(struct PersistentMemoryManager *pman,
+			 uint64_t num_of_pages)
+{
+	// Returns num_of_pages pages for bench.c. They are allocated once and
+	// reused on later boots unless the size changes. Callers serialize.
+	if (pman->bench_buf && pman->num_of_bench_buf_pages == num_of_pages)
+		return pman->bench_buf;
+	pman->bench_buf = pman_alloc_zeroed_pages(pman, num_of_pages);
+	pman->num_of_bench_buf_pages = num_of_pages;
+	ndckpt_clwb(&pman->bench_buf);
+	ndckpt_clwb(&pman->num_of_bench_buf_pages);
+	ndckpt_sfence();
+	return pman->bench_buf;
+}
+
+void *pman_alloc_pages(struct PersistentMemoryManager *pman,
+		       uint64_t num_of_pages_requested)
+{
+	// For callers which overwrite all of the pages.
+	return pman_alloc_aligned_pages(pman, num_of_pages_requested, 1,
+					false);
+}
+
+void *pman_alloc_zeroed_huge_page(struct PersistentMemoryManager *pman)
+{
+	// Returns a zeroed 2MiB page aligned to PMD_SIZE physically.
+	uint8_t *pool;
+	uint8_t *page = NULL;
+	spin_lock(&pman_huge_pool_lock);
+	if (pman_huge_pool_next < pman_huge_pool_end) {
+		page = pman_huge_pool_next;
+		pman_huge_pool_next += PMD_SIZE;
+	}
+	spin_unlock(&pman_huge_pool_lock);
+	if (page)
+		return page;
+	// Pages of the pool are zeroed here, out of the lock.
+	pool = pman_alloc_aligned_pages(pman, PMAN_HUGE_POOL_PAGES,
+					PTRS_PER_PMD, true);
+	spin_lock(&pman_huge_pool_lock);
+	// Another one may have refilled the pool. Rest of it is just wasted.
+	pman_huge_pool_next = pool + PMD_SIZE;
+	pman_huge_pool_end =
+		pool + ((uint64_t)PMAN_HUGE_POOL_PAGES << kPageSizeExponent);
+	spin_unlock(&pman_huge_pool_lock);
+	return pool;
+}
+
+struct PersistentProcessInfo *
+pman_find_proc_info(struct PersistentMemoryManager *pman, uint64_t obj_id)
+{
+	struct PersistentObjectHeader *pobj;
+	struct PersistentProcessInfo *pproc;
+	if (!pman_is_valid(pman))
+		return NULL;
+	for (pobj = pman->head; pobj; pobj = pobj->next) {
+		if (pobj->id != obj_id || !pobj_is_valid(pobj))
+			continue;
+		pproc = pobj_get_base(pobj);
+		return pproc_is_valid(pproc) ? pproc : NULL;
+	}
+	return NULL;
+}
+
 void pman_printk(struct PersistentMemoryManager *pman)
 {
 	struct PersistentObjectHeader *pobj;
@@ -1,6 +1,10 @@
+#include <asm/fpu/internal.h>
+#include <asm/fpu/xstate.h>
+
 #include "ndckpt_internal.h"
+#include "ndckpt_trace.h"
 
-#define PPROC_SIGNATURE 0x5050534f6d75696cULL
+#define PPROC_SIGNATURE 0x5034534f6d75696cULL // See PMAN_SIGNATURE
 #define PCTX_REG_IDX_RAX 0
 #define PCTX_REG_IDX_RCX 1
 #define PCTX_REG_IDX_RDX 2
@@ -15,14 +19,48 @@
 #define PCTX_REG_IDX_GSBASE 19
 // gregs[16] + RIP + RFLAGS + FS/GS
 #define PCTX_REGS (16 + 1 + 1 + 2)
+// Bits of RFLAGS which may be restored. cf. FLAG_MASK @ ptrace.c
+#define PCTX_RFLAGS_MASK                                                       \
+	(X86_EFLAGS_CF | X86_EFLAGS_PF | X86_EFLAGS_AF | X86_EFLAGS_ZF |       \
+	 X86_EFLAGS_SF | X86_EFLAGS_TF | X86_EFLAGS_DF | X86_EFLAGS_OF |       \
+	 X86_EFLAGS_RF | X86_EFLAGS_AC | X86_EFLAGS_NT)
 
 struct PersistentVMARange {
 	// Corresponds to vma->vm_start/end
 	uint64_t vm_start, vm_end, vm_flags;
 	pgprot_t vm_page_prot;
+	uint64_t vm_pgoff;
+	// true if this is mapped from mm->exe_file
+	bool is_exe_file;
 };
 
 #define PCTX_NUM_OF_VMAS 16
+// vm_flags of private mappings which may be imported. Others, e.g. VM_IO or
+// VM_LOCKED, need setup or accounting which importing does not do.
+#define PCTX_IMPORTED_VM_FLAGS                                                 \
+	(VM_READ | VM_WRITE | VM_EXEC | VM_MAYREAD | VM_MAYWRITE |             \
+	 VM_MAYEXEC | VM_GROWSDOWN | VM_DENYWRITE | VM_ACCOUNT | VM_NORESERVE | \
+	 VM_DONTDUMP | VM_SOFTDIRTY | VM_HUGEPAGE | VM_NOHUGEPAGE |            \
+	 VM_SEQ_READ | VM_RAND_READ | VM_DONTCOPY | VM_WIPEONFORK)
+
+// Hotness of 2MiB chunks in target vmas, updated on every commit
+// from accessed bits of the running ctx. Used to prefetch on restore.
+#define PPROC_NUM_OF_HOT_CHUNKS 256
+struct PersistentHotChunk {
+	uint64_t addr; // aligned to PMD_SIZE
+	uint64_t score; // 0 if this entry is not used
+};
+
+struct PersistentMMLayout {
+	// Corresponds to mm->start_code etc.
+	uint64_t start_code, end_code, start_data, end_data;
+	uint64_t start_brk, brk, start_stack;
+	uint64_t arg_start, arg_end, env_start, env_end;
+	// To identify mm->exe_file. ino alone may be reused by another file.
+	uint64_t exe_ino, exe_size;
+	uint64_t exe_dev, exe_generation;
+	int64_t exe_mtime_sec, exe_mtime_nsec;
+};
 
 struct PersistentProcessInfo {
 	struct PersistentExecutionContext {
@@ -33,11 +71,22 @@ struct PersistentProcessInfo {
 		int vma_idx_data;
 		int end_vma_idx;
 		struct PersistentVMARange vmas[PCTX_NUM_OF_VMAS];
+		// Non-target vmas. -1 if they can not be rebuilt without exec.
+		int end_ro_vma_idx;
+		struct PersistentVMARange ro_vmas[PCTX_NUM_OF_VMAS];
+		struct PersistentMMLayout layout;
 		struct fpu fpu;
 	} ctx[2];
+	struct PersistentHotChunk hot_chunks[PPROC_NUM_OF_HOT_CHUNKS];
 	pgd_t *volatile org_pgd; // on DRAM
+	struct LazyRestoreState *volatile lazy; // on DRAM
+	struct DramCacheState *volatile dram_cache; // on DRAM
+	struct PprocStats *volatile stats; // on DRAM
 	int valid_ctx_idx;
 	spinlock_t ckpt_lock;
+	// Bumped before ctxs are changed by commit or restore. Only valid while
+	// the power is on, so it is not flushed. See image.c.
+	uint64_t commit_seq;
 	volatile uint64_t signature;
 };
 
@@ -46,6 +95,15 @@ bool pproc_is_valid(struct PersistentProcessInfo *pproc)
 	return pproc && pproc->signature == PPROC_SIGNATURE;
 }
 
+void pproc_discard(struct PersistentProcessInfo *pproc)
+{
+	// pproc is never found or restored again. Its pages are not reclaimed
+	// since pman never frees pages.
+	pproc->signature = ~PPROC_SIGNATURE;
+	ndckpt_clwb(&pproc->signature);
+	ndckpt_sfence();
+}
+
 pgd_t *pproc_get_org_pgd(struct PersistentProcessInfo *pproc)
 {
 	return pproc->org_pgd;
@@ -90,6 +148,186 @@ int pproc_get_running_ctx(struct PersistentProcessInfo *pproc)
 	return (1 - pproc->valid_ctx_idx);
 }
 
+int pproc_get_valid_ctx(struct PersistentProcessInfo *pproc)
+{
+	return pproc->valid_ctx_idx;
+}
+
+pgd_t *pproc_get_pgd(struct PersistentProcessInfo *pproc, int ctx_idx)
+{
+	BUG_ON(ctx_idx < 0 || 2 <= ctx_idx);
+	return pproc->ctx[ctx_idx].pgd;
+}
+
+struct PprocStats *pproc_get_stats(struct PersistentProcessInfo *pproc)
+{
+	return pproc->stats;
+}
+
+uint64_t pproc_get_commit_seq(struct PersistentProcessInfo *pproc)
+{
+	uint64_t seq = READ_ONCE(pproc->commit_seq);
+	smp_rmb();
+	return seq;
+}
+
+static inline void pproc_bump_commit_seq(struct PersistentProcessInfo *pproc)
+{
+	WRITE_ONCE(pproc->commit_seq, pproc->commit_seq + 1);
+	smp_wmb();
+}
+
+size_t pproc_get_ctx_state_size(void)
+{
+	return sizeof(struct PersistentExecutionContext);
+}
+
+void pproc_get_ctx_state(struct PersistentProcessInfo *pproc, int ctx_idx,
+			 void *dst)
+{
+	// Registers, vmas and mm layout of ctx, without pgd.
+	BUG_ON(ctx_idx < 0 || 2 <= ctx_idx);
+	memcpy(dst, &pproc->ctx[ctx_idx], sizeof(pproc->ctx[ctx_idx]));
+	((struct PersistentExecutionContext *)dst)->pgd = NULL;
+}
+
+static bool is_vma_idx_valid(int idx, int end)
+{
+	return -1 <= idx && idx < end;
+}
+
+static bool is_vma_range_valid(const struct PersistentVMARange *r)
+{
+	const uint64_t prot = r->vm_flags & (VM_READ | VM_WRITE | VM_EXEC);
+	return !(r->vm_start & ~PAGE_MASK) && !(r->vm_end & ~PAGE_MASK) &&
+	       r->vm_start < r->vm_end && r->vm_end <= TASK_SIZE &&
+	       !(r->vm_flags & ~PCTX_IMPORTED_VM_FLAGS) &&
+	       (prot & (r->vm_flags >> 4)) == prot;
+}
+
+static bool are_vma_ranges_valid(const struct PersistentVMARange *vmas,
+				 int end, const struct PersistentVMARange *others,
+				 int end_of_others)
+{
+	// Ranges in vmas are sorted and overlap neither each other nor others.
+	int i, j;
+	for (i = 0; i < end; i++) {
+		if (!is_vma_range_valid(&vmas[i]) ||
+		    (i && vmas[i - 1].vm_end > vmas[i].vm_start))
+			return false;
+		for (j = 0; j < end_of_others; j++) {
+			if (vmas[i].vm_start < others[j].vm_end &&
+			    others[j].vm_start < vmas[i].vm_end)
+				return false;
+		}
+	}
+	return true;
+}
+
+static int validate_imported_fpu(const struct fpu *fpu)
+{
+	// fpu__restore() loads the state as is. Reserved bits of MXCSR or a
+	// header in another format would fault in the kernel.
+	const struct xstate_header *header = &fpu->state.xsave.header;
+	if (fpu->state.fxsave.mxcsr & ~mxcsr_feature_mask)
+		return -EINVAL;
+	if (!boot_cpu_has(X86_FEATURE_XSAVE))
+		return 0;
+	// The fpu state may come from a cpu with other xfeatures.
+	if (header->xfeatures & ~xfeatures_mask)
+		return -EOPNOTSUPP;
+	if (header->xcomp_bv != (using_compacted_format() ?
+					 XCOMP_BV_COMPACTED_FORMAT |
+						 xfeatures_mask :
+					 0))
+		return -EOPNOTSUPP;
+	if (memchr_inv(header->reserved, 0, sizeof(header->reserved)))
+		return -EINVAL;
+	return 0;
+}
+
+static void pproc_set_exe_id(struct PersistentMMLayout *layout,
+			     struct file *exe_file)
+{
+	struct inode *inode = exe_file ? file_inode(exe_file) : NULL;
+	layout->exe_ino = inode ? inode->i_ino : 0;
+	layout->exe_size = inode ? i_size_read(inode) : 0;
+	layout->exe_dev = inode ? inode->i_sb->s_dev : 0;
+	layout->exe_generation = inode ? inode->i_generation : 0;
+	layout->exe_mtime_sec = inode ? inode->i_mtime.tv_sec : 0;
+	layout->exe_mtime_nsec = inode ? inode->i_mtime.tv_nsec : 0;
+}
+
+static bool pproc_is_exe_id_of(struct PersistentMMLayout *layout,
+			       struct inode *inode)
+{
+	// mtime catches an executable rewritten in place.
+	return layout->exe_ino == inode->i_ino &&
+	       layout->exe_size == i_size_read(inode) &&
+	       layout->exe_dev == inode->i_sb->s_dev &&
+	       layout->exe_generation == inode->i_generation &&
+	       layout->exe_mtime_sec == inode->i_mtime.tv_sec &&
+	       layout->exe_mtime_nsec == inode->i_mtime.tv_nsec;
+}
+
+struct PersistentProcessInfo *
+pproc_alloc_imported(struct PersistentMemoryManager *pman,
+		     const void *ctx_state, struct file *exe)
+{
+	// Returns a pproc with ctx_state in ctx[0] and empty page tables.
+	// It has no valid ctx until the caller fills the user half of ctx[0]
+	// and calls pproc_set_valid_ctx(pproc, 0).
+	// If exe is given, ctx[0] is bound to its inode so that execve of exe
+	// restores the pproc on this host, where the original inode differs.
+	// ctx_state comes from an image file and is not trusted. vmas are
+	// inserted and the fpu state is loaded without further checks.
+	const struct PersistentExecutionContext *src = ctx_state;
+	struct PersistentProcessInfo *pproc;
+	struct PersistentExecutionContext *ctx;
+	int i, error;
+	if (src->end_vma_idx < 0 || PCTX_NUM_OF_VMAS < src->end_vma_idx ||
+	    src->end_ro_vma_idx < -1 ||
+	    PCTX_NUM_OF_VMAS < src->end_ro_vma_idx ||
+	    !is_vma_idx_valid(src->vma_idx_stack, src->end_vma_idx) ||
+	    !is_vma_idx_valid(src->vma_idx_heap, src->end_vma_idx) ||
+	    !is_vma_idx_valid(src->vma_idx_data, src->end_vma_idx))
+		return ERR_PTR(-EINVAL);
+	if (!are_vma_ranges_valid(src->vmas, src->end_vma_idx, src->ro_vmas,
+				  max(src->end_ro_vma_idx, 0)) ||
+	    !are_vma_ranges_valid(src->ro_vmas, max(src->end_ro_vma_idx, 0),
+				  NULL, 0))
+		return ERR_PTR(-EINVAL);
+	if ((error = validate_imported_fpu(&src->fpu)))
+		return ERR_PTR(error);
+	if (exe && src->layout.exe_size != i_size_read(file_inode(exe)))
+		return ERR_PTR(-EINVAL);
+
+	pproc = pproc_alloc(pman);
+	ctx = &pproc->ctx[0];
+	memcpy(ctx, (void *)src, sizeof(*ctx));
+	// Derived from the flags on this host, as mmap does.
+	for (i = 0; i < ctx->end_vma_idx; i++) {
+		ctx->vmas[i].vm_page_prot =
+			vm_get_page_prot(ctx->vmas[i].vm_flags);
+	}
+	for (i = 0; i < ctx->end_ro_vma_idx; i++) {
+		ctx->ro_vmas[i].vm_page_prot =
+			vm_get_page_prot(ctx->ro_vmas[i].vm_flags);
+	}
+	ctx->regs[PCTX_REG_IDX_RFLAGS] &= PCTX_RFLAGS_MASK;
+	if (exe)
+		pproc_set_exe_id(&ctx->layout, exe);
+	ndckpt_clwb_range(ctx, sizeof(*ctx));
+	pproc_set_pgd(pproc, 0, ndckpt_alloc_zeroed_virt_page());
+	pproc_set_pgd(pproc, 1, ndckpt_alloc_zeroed_virt_page());
+	return pproc;
+}
+
+static inline struct PprocStats *mm_stats(struct mm_struct *mm)
+{
+	return mm->ndckpt_pproc ? mm->ndckpt_pproc->stats : NULL;
+}
+
 void pproc_set_regs(struct PersistentProcessInfo *proc, int ctx_idx,
 		    struct task_struct *src)
 {
@@ -217,23 +455,85 @@ void pproc_restore_regs(struct task_struct *dst,
 	regs->r14 = ctx->regs[14];
 	regs->r15 = ctx->regs[15];
 	regs->ip = ctx->regs[PCTX_REG_IDX_RIP];
-	regs->flags = ctx->regs[PCTX_REG_IDX_RFLAGS];
+	regs->flags = (regs->flags & ~PCTX_RFLAGS_MASK) |
+		      (ctx->regs[PCTX_REG_IDX_RFLAGS] & PCTX_RFLAGS_MASK);
 
 	// https://elixir.bootlin.com/linux/v5.1.3/source/arch/x86/kernel/process_64.c#L712
 	do_arch_prctl_64(dst, ARCH_SET_FS, ctx->regs[PCTX_REG_IDX_FSBASE]);
 	do_arch_prctl_64(dst, ARCH_SET_GS, ctx->regs[PCTX_REG_IDX_GSBASE]);
 
 	BUG_ON(!dst->thread.fpu.initialized);
-	memcpy(&dst->thread.fpu, &ctx->fpu, sizeof(ctx->fpu));
+	// last_cpu and initialized are states of this boot.
+	memcpy(&dst->thread.fpu.state, &ctx->fpu.state, sizeof(ctx->fpu.state));
 	dst->thread.fpu.last_cpu = -1;
 	fpu__restore(&dst->thread.fpu);
 }
 
+static bool is_exe_file_vma(struct vm_area_struct *vma, struct file *exe_file)
+{
+	return vma->vm_file && exe_file &&
+	       file_inode(vma->vm_file) == file_inode(exe_file);
+}
+
+static void pproc_save_layout(struct PersistentExecutionContext *ctx,
+			      struct mm_struct *mm, struct file *exe_file)
+{
+	// Save things which exec sets up, to rebuild mm without exec.
+	// See pproc_build_mm().
+	struct PersistentMMLayout *layout = &ctx->layout;
+	struct vm_area_struct *vma;
+	int used = 0;
+
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (ndckpt_is_target_vma(vma)) {
+			continue;
+		}
+		if (!vma->vm_file && vma->vm_ops) {
+			// Special mappings (vdso etc.) are set up again.
+			continue;
+		}
+		if ((vma->vm_file && !is_exe_file_vma(vma, exe_file)) ||
+		    used >= PCTX_NUM_OF_VMAS) {
+			// Only the exe is reopened on rebuild, so processes
+			// with shared libraries or other file mappings are
+			// restored by exec only. Static binaries are fine.
+			used = -1;
+			break;
+		}
+		ctx->ro_vmas[used].vm_start = vma->vm_start;
+		ctx->ro_vmas[used].vm_end = vma->vm_end;
+		ctx->ro_vmas[used].vm_flags = vma->vm_flags;
+		ctx->ro_vmas[used].vm_page_prot = vma->vm_page_prot;
+		ctx->ro_vmas[used].vm_pgoff = vma->vm_pgoff;
+		ctx->ro_vmas[used].is_exe_file = vma->vm_file != NULL;
+		ndckpt_clwb_range(&ctx->ro_vmas[used],
+				  sizeof(struct PersistentVMARange));
+		used++;
+	}
+	ctx->end_ro_vma_idx = exe_file ? used : -1;
+	ndckpt_clwb(&ctx->end_ro_vma_idx);
+
+	layout->start_code = mm->start_code;
+	layout->end_code = mm->end_code;
+	layout->start_data = mm->start_data;
+	layout->end_data = mm->end_data;
+	layout->start_brk = mm->start_brk;
+	layout->brk = mm->brk;
+	layout->start_stack = mm->start_stack;
+	layout->arg_start = mm->arg_start;
+	layout->arg_end = mm->arg_end;
+	layout->env_start = mm->env_start;
+	layout->env_end = mm->env_end;
+	pproc_set_exe_id(layout, exe_file);
+	ndckpt_clwb_range(layout, sizeof(*layout));
+}
+
 void pproc_save_vmas(struct PersistentProcessInfo *pproc, int ctx_idx,
 		     struct mm_struct *mm)
 {
 	struct vm_area_struct *vma;
 	struct PersistentExecutionContext *ctx = &pproc->ctx[ctx_idx];
+	struct file *exe_file = get_mm_exe_file(mm);
 	int used = 0;
 
 	ctx->vma_idx_stack = -1;
@@ -257,6 +557,8 @@ void pproc_save_vmas(struct PersistentProcessInfo *pproc, int ctx_idx,
 		ctx->vmas[used].vm_end = vma->vm_end;
 		ctx->vmas[used].vm_flags = vma->vm_flags;
 		ctx->vmas[used].vm_page_prot = vma->vm_page_prot;
+		ctx->vmas[used].vm_pgoff = vma->vm_pgoff;
+		ctx->vmas[used].is_exe_file = is_exe_file_vma(vma, exe_file);
 		if (!vma_is_anonymous(vma)) {
 			pr_ndckpt("  vma[%d] is .data\n", used);
 			BUG_ON(ctx->vma_idx_data != -1);
@@ -284,6 +586,91 @@ void pproc_save_vmas(struct PersistentProcessInfo *pproc, int ctx_idx,
 	ctx->end_vma_idx = used;
 	ndckpt_clwb(&ctx->end_vma_idx);
 	pr_ndckpt("Saved %d vmas\n", ctx->end_vma_idx);
+	pproc_save_layout(ctx, mm, exe_file);
+	if (exe_file)
+		fput(exe_file);
+}
+
+bool pproc_is_restorable_from_file(struct PersistentProcessInfo *pproc,
+				   struct file *file)
+{
+	// Returns true if mm can be rebuilt from pproc and file,
+	// which should be the same executable as the checkpointed one.
+	struct PersistentExecutionContext *ctx;
+	struct inode *inode = file_inode(file);
+	if (!pproc_is_valid(pproc) || pproc->valid_ctx_idx < 0 ||
+	    2 <= pproc->valid_ctx_idx)
+		return false;
+	ctx = &pproc->ctx[pproc->valid_ctx_idx];
+	if (ctx->end_ro_vma_idx < 0 || !pproc_is_exe_id_of(&ctx->layout, inode))
+		return false;
+	if (ctx->vma_idx_data >= 0 &&
+	    !ctx->vmas[ctx->vma_idx_data].is_exe_file)
+		return false;
+	return true;
+}
+
+static int pproc_map_vma(struct PersistentVMARange *range, struct file *file)
+{
+	unsigned long prot = 0;
+	unsigned long flags = MAP_FIXED | MAP_PRIVATE;
+	unsigned long addr;
+	if (range->vm_flags & VM_READ)
+		prot |= PROT_READ;
+	if (range->vm_flags & VM_WRITE)
+		prot |= PROT_WRITE;
+	if (range->vm_flags & VM_EXEC)
+		prot |= PROT_EXEC;
+	if (range->vm_flags & VM_GROWSDOWN)
+		flags |= MAP_GROWSDOWN;
+	if (!range->is_exe_file) {
+		file = NULL;
+		flags |= MAP_ANONYMOUS;
+	}
+	addr = vm_mmap(file, range->vm_start, range->vm_end - range->vm_start,
+		       prot, flags, range->vm_pgoff << PAGE_SHIFT);
+	if (IS_ERR_VALUE(addr))
+		return (int)addr;
+	return addr == range->vm_start ? 0 : -EINVAL;
+}
+
+int pproc_build_mm(struct PersistentProcessInfo *pproc, struct mm_struct *mm,
+		   struct file *file)
+{
+	// Called from the binfmt instead of loading ELF.
+	// Only vmas which pproc_restore_vmas() expects to exist are mapped here.
+	// Others are inserted by pproc_restore_vmas() later.
+	struct PersistentExecutionContext *ctx =
+		&pproc->ctx[pproc->valid_ctx_idx];
+	struct PersistentMMLayout *layout = &ctx->layout;
+	const int idxs[3] = { ctx->vma_idx_data, ctx->vma_idx_heap,
+			      ctx->vma_idx_stack };
+	int i, retval;
+
+	for (i = 0; i < ctx->end_ro_vma_idx; i++) {
+		retval = pproc_map_vma(&ctx->ro_vmas[i], file);
+		if (retval)
+			return retval;
+	}
+	for (i = 0; i < 3; i++) {
+		if (idxs[i] < 0)
+			continue;
+		retval = pproc_map_vma(&ctx->vmas[idxs[i]], file);
+		if (retval)
+			return retval;
+	}
+	mm->start_code = layout->start_code;
+	mm->end_code = layout->end_code;
+	mm->start_data = layout->start_data;
+	mm->end_data = layout->end_data;
+	mm->start_brk = layout->start_brk;
+	mm->brk = layout->brk;
+	mm->start_stack = layout->start_stack;
+	mm->arg_start = layout->arg_start;
+	mm->arg_end = layout->arg_end;
+	mm->env_start = layout->env_start;
+	mm->env_end = layout->env_end;
+	return 0;
 }
 
 #ifdef NDCKPT_DEBUG
@@ -402,13 +789,19 @@ static void sync_dram_pages(pgd_t *dst_t4, pgd_t *src_t4, uint64_t start,
 			addr = next_pde_addr(addr);
 			continue;
 		}
-		if (!ndckpt_is_virt_addr_in_nvdimm(dst_t1) &&
+		if ((!ndckpt_is_virt_addr_in_nvdimm(dst_t1) ||
+		     ndckpt_is_pmd_huge(*dst_e2)) &&
 		    dst_t1 != src_t1) {
 			*dst_e2 = *src_e2;
 			ndckpt_clwb(dst_e2);
 			count++;
 			continue; // Retry
 		}
+		if (ndckpt_is_pmd_huge(*src_e2)) {
+			// 2MiB page on DRAM is shared as is
+			addr = next_pde_addr(addr);
+			continue;
+		}
 		traverse_pte(addr, src_t1, &src_e1, &src_page_vaddr);
 		traverse_pte(addr, dst_t1, &dst_e1, &dst_page_vaddr);
 		if (!src_page_vaddr) {
@@ -432,9 +825,47 @@ static void sync_dram_pages(pgd_t *dst_t4, pgd_t *src_t4, uint64_t start,
 #endif
 }
 
-//#define DEBUG_FLUSH_DIRTY_PAGES
-static void flush_dirty_pages(pgd_t *t4, uint64_t start, uint64_t end)
+static bool is_hot_chunk(struct PersistentProcessInfo *pproc, uint64_t addr)
+{
+	int i;
+	for (i = 0; i < PPROC_NUM_OF_HOT_CHUNKS; i++) {
+		if (pproc->hot_chunks[i].score &&
+		    pproc->hot_chunks[i].addr == (addr & PMD_MASK))
+			return true;
+	}
+	return false;
+}
+
+static void fold_into_zero_page(struct PersistentProcessInfo *pproc,
+				struct TlbFlushBatch *tlb, pte_t *e,
+				void *page_vaddr, uint64_t addr)
+{
+	// Map the zero page instead of a dirty page filled with zero.
+	// The page is flushed and reused as a zeroed page. The caller ensures
+	// that nothing can write to it via stale TLB entries meanwhile.
+	ndckpt_clwb_range(page_vaddr, PAGE_SIZE);
+	e->pte = ndckpt_get_zero_page() |
+		 (page_fixed_attr_pte(e) & ~(uint64_t)_PAGE_RW);
+	ndckpt_clwb(e);
+	tlb_flush_batch_add(tlb, addr, PAGE_SIZE);
+	pman_free_zeroed_page(first_pmem_device->virt_addr, page_vaddr);
+	pproc_stats_add(pproc->stats, PPROC_STAT_ZERO_PAGES_FOLDED, 1);
+	pproc_stats_add(pproc->stats, PPROC_STAT_BYTES_FLUSHED, PAGE_SIZE);
+}
+
+static void flush_dirty_pages(struct PersistentProcessInfo *pproc,
+			      struct TlbFlushBatch *tlb, pgd_t *t4,
+			      uint64_t start, uint64_t end, bool is_file_vma,
+			      bool fold_zero_pages)
 {
+	// Dirty pages in hot chunks become candidates of the DRAM cache.
+	// Page cache pages mapped read-only in file vmas are kept on DRAM.
+	// Dirty pages filled with zero are folded into the zero page if
+	// fold_zero_pages is set.
+	struct DramCacheState *cache = pproc->dram_cache;
+	struct PprocStats *stats = pproc->stats;
+	uint64_t hot_chunk_addr = 1; // Not aligned. Never matches.
+	bool hot = false;
 	uint64_t addr;
 	pgd_t *e4;
 	pud_t *t3 = NULL;
@@ -444,11 +875,6 @@ static void flush_dirty_pages(pgd_t *t4, uint64_t start, uint64_t end)
 	pte_t *t1 = NULL;
 	pte_t *e1;
 	void *page_vaddr;
-	uint64_t page_paddr;
-#ifdef DEBUG_FLUSH_DIRTY_PAGES
-	pr_ndckpt_pgtable_range(t4, start, end);
-	pr_ndckpt("flush_dirty_pages: [0x%016llX, 0x%016llX)\n", start, end);
-#endif
 	BUG_ON(!ndckpt_is_virt_addr_in_nvdimm(t4));
 	for (addr = start; addr < end;) {
 		traverse_pml4e(addr, t4, &e4, &t3);
@@ -466,27 +892,91 @@ static void flush_dirty_pages(pgd_t *t4, uint64_t start, uint64_t end)
 			addr = next_pde_addr(addr);
 			continue;
 		}
+		if (ndckpt_is_pmd_huge(*e2)) {
+			if (!ndckpt_is_virt_addr_in_nvdimm(t1)) {
+				replace_huge_page_with_nvdimm_page(e2);
+				pproc_stats_add(stats, PPROC_STAT_BYTES_COPIED,
+						PMD_SIZE);
+				tlb_flush_batch_add(tlb, addr, PAGE_SIZE);
+				continue; // retry
+			}
+			// Unlike 4KiB pages, only dirty 2MiB pages are flushed
+			// and copied to the other ctx in sync_huge_page_pde().
+			// A TLB entry caching the dirty bit cleared here was
+			// filled after record_hot_chunks() cleared the accessed
+			// bit on the last commit, so the bit is set again and
+			// sync_huge_page_pde() adds the page to the ranges
+			// flushed on the cr3 switch. Writes after the switch
+			// set the dirty bit again.
+			if (e2->pmd & _PAGE_DIRTY) {
+				trace_ndckpt_flush_page(addr, t1, PMD_SIZE,
+							true);
+				ndckpt_clwb_range(t1, PMD_SIZE);
+				pproc_stats_add(stats, PPROC_STAT_DIRTY_PAGES,
+						PTRS_PER_PTE);
+				pproc_stats_add(stats, PPROC_STAT_BYTES_FLUSHED,
+						PMD_SIZE);
+				e2->pmd = (e2->pmd & ~(uint64_t)_PAGE_DIRTY) |
+					  _PAGE_NDCKPT_UNSYNCED;
+				ndckpt_clwb(&e2->pmd);
+			}
+			addr = next_pde_addr(addr);
+			continue;
+		}
 		traverse_pte(addr, t1, &e1, &page_vaddr);
 		if (!page_vaddr) {
 			addr = next_pte_addr(addr);
 			continue;
 		}
-		page_paddr = ndckpt_v2p(page_vaddr);
+		if (ndckpt_is_pte_zero_page(*e1)) {
+			// Never written. Nothing to flush.
+			addr = next_pte_addr(addr);
+			continue;
+		}
+		if (page_state_pte(e1) == PAGE_STATE_Pvc) {
+			dram_cache_writeback_page(cache, e1, addr);
+			continue; // retry
+		}
+		if (!ndckpt_is_virt_addr_in_nvdimm(page_vaddr) && is_file_vma &&
+		    !(e1->pte & _PAGE_RW) && !PageAnon(pte_page(*e1))) {
+			// Not written yet. Dropped on restore and faulted in
+			// again from the file. See erase_page_cache_mappings().
+			addr = next_pte_addr(addr);
+			continue;
+		}
 		if (!ndckpt_is_virt_addr_in_nvdimm(page_vaddr)) {
 			// TODO: This solution is ad-hoc. We should handle this on fault
-			ndckpt_replace_page_with_nvdimm_page(e1, addr);
+			ndckpt_replace_page_with_nvdimm_page(e1);
+			pproc_stats_add(stats, PPROC_STAT_BYTES_COPIED,
+					PAGE_SIZE);
+			tlb_flush_batch_add(tlb, addr, PAGE_SIZE);
 			continue; // retry
 		}
+		if (e1->pte & _PAGE_DIRTY)
+			pproc_stats_add(stats, PPROC_STAT_DIRTY_PAGES, 1);
+		if ((e1->pte & _PAGE_DIRTY) && fold_zero_pages && !is_file_vma &&
+		    !ndckpt_is_pte_cow(*e1) &&
+		    ndckpt_is_page_zeroed(page_vaddr)) {
+			fold_into_zero_page(pproc, tlb, e1, page_vaddr, addr);
+			addr = next_pte_addr(addr);
+			continue;
+		}
 		if ((e1->pte & _PAGE_DIRTY) == 0) {
 			// Page is clean. Skip flushing
+		} else if (cache && ndckpt_dram_cache_pages) {
+			if ((addr & PMD_MASK) != hot_chunk_addr) {
+				hot_chunk_addr = addr & PMD_MASK;
+				hot = is_hot_chunk(pproc, addr);
+			}
+			if (hot && !ndckpt_is_pte_cow(*e1))
+				dram_cache_add_candidate(cache, addr);
 		}
+		trace_ndckpt_flush_page(addr, page_vaddr, PAGE_SIZE,
+					e1->pte & _PAGE_DIRTY);
 		ndckpt_clwb_range(page_vaddr, PAGE_SIZE);
+		pproc_stats_add(stats, PPROC_STAT_BYTES_FLUSHED, PAGE_SIZE);
 		e1->pte &= ~(uint64_t)_PAGE_DIRTY;
 		ndckpt_clwb(&e1->pte);
-#ifdef DEBUG_FLUSH_DIRTY_PAGES
-		pr_ndckpt("flushed dirty page @ 0x%016llX v->p 0x%016llX\n",
-			  addr, page_paddr);
-#endif
 		addr = next_pte_addr(addr);
 	}
 	ndckpt_sfence();
@@ -530,6 +1020,10 @@ static void erase_dram_mappings(pgd_t *t4, uint64_t start, uint64_t end)
 			addr = next_pde_addr(addr);
 			continue;
 		}
+		if (ndckpt_is_pmd_huge(*e2)) {
+			addr = next_pde_addr(addr);
+			continue;
+		}
 		traverse_pte(addr, t1, &e1, &page_vaddr);
 		if (!ndckpt_is_virt_addr_in_nvdimm(page_vaddr)) {
 			unmap_page_and_clwb(e1, addr);
@@ -544,6 +1038,60 @@ static void erase_dram_mappings(pgd_t *t4, uint64_t start, uint64_t end)
 #endif
 }
 
+static void erase_page_cache_mappings(pgd_t *t4, uint64_t start, uint64_t end)
+{
+	// Unmap read-only DRAM pages left in a file vma by flush_dirty_pages().
+	// They were page cache pages of the previous boot.
+	uint64_t addr;
+	pgd_t *e4;
+	pud_t *t3 = NULL;
+	pud_t *e3;
+	pmd_t *t2 = NULL;
+	pmd_t *e2;
+	pte_t *t1 = NULL;
+	pte_t *e1;
+	void *page_vaddr;
+	for (addr = start; addr < end;) {
+		traverse_pml4e(addr, t4, &e4, &t3);
+		if (!t3) {
+			addr = next_pml4e_addr(addr);
+			continue;
+		}
+		traverse_pdpte(addr, t3, &e3, &t2);
+		if (!t2) {
+			addr = next_pdpte_addr(addr);
+			continue;
+		}
+		traverse_pde(addr, t2, &e2, &t1);
+		if (!t1 || ndckpt_is_pmd_huge(*e2)) {
+			addr = next_pde_addr(addr);
+			continue;
+		}
+		traverse_pte(addr, t1, &e1, &page_vaddr);
+		if (page_state_pte(e1) == PAGE_STATE_Pv &&
+		    !(e1->pte & _PAGE_RW)) {
+			unmap_page_and_clwb(e1, addr);
+		}
+		addr = next_pte_addr(addr);
+	}
+}
+
+static void erase_page_cache_of_ctxs(struct mm_struct *mm,
+				     struct PersistentProcessInfo *pproc)
+{
+	struct vm_area_struct *vma;
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (!ndckpt_is_target_vma(vma) || !vma->vm_file) {
+			continue;
+		}
+		erase_page_cache_mappings(pproc->ctx[0].pgd, vma->vm_start,
+					  vma->vm_end);
+		erase_page_cache_mappings(pproc->ctx[1].pgd, vma->vm_start,
+					  vma->vm_end);
+	}
+	ndckpt_sfence();
+}
+
 void ndckpt_erase_page_mappings(pgd_t *t4, uint64_t start, uint64_t end)
 {
 	uint64_t addr;
@@ -573,6 +1121,17 @@ void ndckpt_erase_page_mappings(pgd_t *t4, uint64_t start, uint64_t end)
 			addr = next_pde_addr(addr);
 			continue;
 		}
+		if (ndckpt_is_pmd_huge(*e2)) {
+			if ((addr & ~PMD_MASK) || end < addr + PMD_SIZE) {
+				// Partially unmapped
+				ndckpt_split_huge_pmd(e2);
+				continue; // Retry
+			}
+			unmap_pt_and_clwb(e2);
+			ndckpt_invlpg((void *)addr);
+			addr = next_pde_addr(addr);
+			continue;
+		}
 		traverse_pte(addr, t1, &e1, &page_vaddr);
 		if (!page_vaddr) {
 			addr = next_pte_addr(addr);
@@ -585,15 +1144,182 @@ void ndckpt_erase_page_mappings(pgd_t *t4, uint64_t start, uint64_t end)
 }
 EXPORT_SYMBOL(ndckpt_erase_page_mappings);
 
-static void flush_target_vmas(struct mm_struct *mm)
+void ndckpt_split_huge_pages(pgd_t *t4, uint64_t start, uint64_t end)
+{
+	// Split 2MiB mappings in [start, end) into 4KiB ones.
+	uint64_t addr;
+	pgd_t *e4;
+	pud_t *t3 = NULL;
+	pud_t *e3;
+	pmd_t *t2 = NULL;
+	pmd_t *e2;
+	pte_t *t1 = NULL;
+	for (addr = start & PMD_MASK; addr < end;) {
+		traverse_pml4e(addr, t4, &e4, &t3);
+		if (!t3) {
+			addr = next_pml4e_addr(addr);
+			continue;
+		}
+		traverse_pdpte(addr, t3, &e3, &t2);
+		if (!t2) {
+			addr = next_pdpte_addr(addr);
+			continue;
+		}
+		traverse_pde(addr, t2, &e2, &t1);
+		if (t1 && ndckpt_is_pmd_huge(*e2))
+			ndckpt_split_huge_pmd(e2);
+		addr = next_pde_addr(addr);
+	}
+	ndckpt_sfence();
+}
+EXPORT_SYMBOL(ndckpt_split_huge_pages);
+
+static void flush_target_vmas(struct PersistentProcessInfo *pproc,
+			      struct mm_struct *mm)
+{
+	// Other threads could write to a page between the zero check and
+	// the remap, so pages are folded only if there is none.
+	const bool fold_zero_pages =
+		ndckpt_zero_page && atomic_read(&mm->mm_users) == 1;
+	struct vm_area_struct *vma;
+	struct TlbFlushBatch tlb;
+	tlb_flush_batch_init(&tlb, mm, mm->pgd);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (!ndckpt_is_target_vma(vma)) {
+			continue;
+		}
+		flush_dirty_pages(pproc, &tlb, mm->pgd, vma->vm_start,
+				  vma->vm_end, vma->vm_file != NULL,
+				  fold_zero_pages);
+	}
+	tlb_flush_batch_flush(&tlb);
+}
+
+static void update_hot_chunk(struct PersistentProcessInfo *pproc,
+			     uint64_t addr, uint64_t score)
+{
+	struct PersistentHotChunk *victim = &pproc->hot_chunks[0];
+	int i;
+	for (i = 0; i < PPROC_NUM_OF_HOT_CHUNKS; i++) {
+		struct PersistentHotChunk *c = &pproc->hot_chunks[i];
+		if (c->score && c->addr == addr) {
+			c->score += score;
+			return;
+		}
+		if (c->score < victim->score)
+			victim = c;
+	}
+	if (victim->score >= score)
+		return;
+	victim->addr = addr;
+	victim->score = score;
+}
+
+static void record_hot_chunks(struct PersistentProcessInfo *pproc,
+			      pgd_t *t4, uint64_t start, uint64_t end)
+{
+	// Count and clear accessed bits of pages in each PT.
+	// Bits are set again after the cr3 switch at the end of commit.
+	// Called after sync_pages(), which flushes TLB entries only for
+	// NVDIMM pages accessed since this was called on the ctx last time.
+	// Others can not be in TLB: entries filled since then set the bit and
+	// the older ones were flushed on the cr3 switch following the call.
+	uint64_t addr;
+	pgd_t *e4;
+	pud_t *t3 = NULL;
+	pud_t *e3;
+	pmd_t *t2 = NULL;
+	pmd_t *e2;
+	pte_t *t1 = NULL;
+	uint64_t accessed;
+	int i;
+	for (addr = start & PMD_MASK; addr < end;) {
+		traverse_pml4e(addr, t4, &e4, &t3);
+		if (!t3) {
+			addr = next_pml4e_addr(addr);
+			continue;
+		}
+		traverse_pdpte(addr, t3, &e3, &t2);
+		if (!t2) {
+			addr = next_pdpte_addr(addr);
+			continue;
+		}
+		traverse_pde(addr, t2, &e2, &t1);
+		if (!t1) {
+			addr = next_pde_addr(addr);
+			continue;
+		}
+		if (ndckpt_is_pmd_huge(*e2)) {
+			// No finer information. Count it as fully accessed.
+			if (e2->pmd & _PAGE_ACCESSED) {
+				clear_bit(_PAGE_BIT_ACCESSED,
+					  (unsigned long *)&e2->pmd);
+				update_hot_chunk(pproc, addr, PTRS_PER_PTE);
+			}
+			addr = next_pde_addr(addr);
+			continue;
+		}
+		accessed = 0;
+		for (i = 0; i < PTRS_PER_PTE; i++) {
+			// Most of them are clear. Avoid a locked op for them.
+			if (!(t1[i].pte & _PAGE_ACCESSED))
+				continue;
+			clear_bit(_PAGE_BIT_ACCESSED,
+				  (unsigned long *)&t1[i].pte);
+			accessed++;
+		}
+		if (accessed)
+			update_hot_chunk(pproc, addr, accessed);
+		addr = next_pde_addr(addr);
+	}
+}
+
+static void record_target_vmas_hotness(struct PersistentProcessInfo *pproc,
+				       struct mm_struct *mm)
 {
 	struct vm_area_struct *vma;
+	int i;
+	for (i = 0; i < PPROC_NUM_OF_HOT_CHUNKS; i++) {
+		// Decay older accesses
+		pproc->hot_chunks[i].score >>= 1;
+	}
 	for (vma = mm->mmap; vma; vma = vma->vm_next) {
 		if (!ndckpt_is_target_vma(vma)) {
 			continue;
 		}
-		flush_dirty_pages(mm->pgd, vma->vm_start, vma->vm_end);
+		record_hot_chunks(pproc, mm->pgd, vma->vm_start, vma->vm_end);
 	}
+	ndckpt_clwb_range(pproc->hot_chunks, sizeof(pproc->hot_chunks));
+}
+
+static int cmp_hot_chunk(const void *a, const void *b)
+{
+	const struct PersistentHotChunk *ca = a;
+	const struct PersistentHotChunk *cb = b;
+	if (ca->score == cb->score)
+		return 0;
+	return ca->score < cb->score ? 1 : -1;
+}
+
+static int pproc_get_hot_chunks(struct PersistentProcessInfo *pproc,
+				uint64_t *addrs)
+{
+	// Fills addrs with chunks in hotness order and returns the number of
+	// them. addrs should have PPROC_NUM_OF_HOT_CHUNKS entries.
+	struct PersistentHotChunk *chunks;
+	int i, n = 0;
+	chunks = kmalloc_array(PPROC_NUM_OF_HOT_CHUNKS, sizeof(*chunks),
+			       GFP_KERNEL);
+	if (!chunks)
+		return 0;
+	memcpy(chunks, pproc->hot_chunks, sizeof(pproc->hot_chunks));
+	sort(chunks, PPROC_NUM_OF_HOT_CHUNKS, sizeof(*chunks), cmp_hot_chunk,
+	     NULL);
+	for (i = 0; i < PPROC_NUM_OF_HOT_CHUNKS && chunks[i].score; i++) {
+		addrs[n++] = chunks[i].addr;
+	}
+	kfree(chunks);
+	return n;
 }
 
 static void sync_normal_vmas(struct mm_struct *mm, pgd_t *dst_pgd,
@@ -612,21 +1338,126 @@ static void sync_normal_vmas(struct mm_struct *mm, pgd_t *dst_pgd,
 	}
 }
 
-static inline void switch_mm_context(struct task_struct *target,
-				     struct mm_struct *mm, pgd_t *new_pgd)
+// Virtual ranges whose leaf mappings differ between the running ctx and
+// the next one. Recorded on sync and invalidated on the cr3 switch.
+#define NDCKPT_NUM_OF_TLB_FLUSH_RANGES 16
+
+struct TlbFlushRange {
+	uint64_t start;
+	uint64_t end;
+	unsigned int stride_shift;
+};
+
+struct TlbFlushRanges {
+	// Paddr of the pgd whose entries may be in TLB
+	uint64_t ref_pgd_paddr;
+	bool is_full;
+	int num_of_ranges;
+	uint64_t num_of_invlpgs;
+	struct TlbFlushRange ranges[NDCKPT_NUM_OF_TLB_FLUSH_RANGES];
+};
+
+static inline void tlb_flush_ranges_init(struct TlbFlushRanges *fr,
+					 pgd_t *ref_pgd)
+{
+	fr->ref_pgd_paddr = ndckpt_virt_to_phys(ref_pgd);
+	fr->is_full = !ndckpt_tlb_flush_ceiling;
+	fr->num_of_ranges = 0;
+	fr->num_of_invlpgs = 0;
+}
+
+static inline void tlb_flush_ranges_add(struct TlbFlushRanges *fr,
+					uint64_t start, uint64_t end,
+					unsigned int stride_shift)
+{
+	struct TlbFlushRange *r;
+	if (!fr || fr->is_full)
+		return;
+	fr->num_of_invlpgs += (end - start) >> stride_shift;
+	if (fr->num_of_invlpgs > ndckpt_tlb_flush_ceiling) {
+		fr->is_full = true;
+		return;
+	}
+	if (fr->num_of_ranges) {
+		r = &fr->ranges[fr->num_of_ranges - 1];
+		if (r->end == start && r->stride_shift == stride_shift) {
+			r->end = end;
+			return;
+		}
+	}
+	if (fr->num_of_ranges >= NDCKPT_NUM_OF_TLB_FLUSH_RANGES) {
+		fr->is_full = true;
+		return;
+	}
+	r = &fr->ranges[fr->num_of_ranges++];
+	r->start = start;
+	r->end = end;
+	r->stride_shift = stride_shift;
+}
+
+static void reload_cr3_func(void *info)
+{
+	struct mm_struct *mm = info;
+	if (this_cpu_read(cpu_tlbstate.loaded_mm) != mm)
+		return;
+	write_cr3((CR3_ADDR_MASK & ndckpt_virt_to_phys(mm->pgd)) |
+		  (CR3_PCID_MASK & __read_cr3()));
+}
+
+static inline void reload_cr3_on_other_cpus(struct mm_struct *mm)
+{
+	// Cpus which run other threads of mm, or keep it in lazy TLB mode,
+	// still have the previous ctx as cr3. Switching between tasks of the
+	// same mm does not reload it, so do it here with all entries flushed.
+	preempt_disable();
+	smp_call_function_many(mm_cpumask(mm), reload_cr3_func, mm, true);
+	preempt_enable();
+}
+
+static inline void switch_mm_context(struct task_struct *target,
+				     struct mm_struct *mm, pgd_t *new_pgd,
+				     struct TlbFlushRanges *fr)
 {
 	// Set mm->pgd and cr3
+	// If fr is NULL, all TLB entries of the mm are flushed.
+	int i;
 	mm->pgd = new_pgd;
 	if (target != current) {
 		// skip updating cr3 because current context is not a target.
+		// Other cpus may also have entries for the mm, so flush all.
 		mm->ndckpt_flags |= MM_NDCKPT_FLUSH_CR3;
+		trace_ndckpt_switch_mm_context(target, new_pgd, true, true, 0,
+					       0);
 		return;
 	}
 	// https://elixir.bootlin.com/linux/v5.1.3/source/arch/x86/include/asm/tlbflush.h#L131
-	// We can't specify CR3_NOFLUSH here
-	// because mappings may be different between two contexts.
+	// CR3_NOFLUSH can be specified only if the differences of mappings
+	// are known. Entries of the loaded pgd are in TLB, so on restore
+	// (mm->pgd is replaced without loading it) all of them are flushed.
+	if (!fr || fr->is_full || !static_cpu_has(X86_FEATURE_PCID) ||
+	    (__read_cr3() & CR3_ADDR_MASK) != fr->ref_pgd_paddr) {
+		write_cr3((CR3_ADDR_MASK & ndckpt_virt_to_phys(new_pgd)) |
+			  (CR3_PCID_MASK & __read_cr3()));
+		reload_cr3_on_other_cpus(mm);
+		trace_ndckpt_switch_mm_context(target, new_pgd, false, true, 0,
+					       0);
+		return;
+	}
 	write_cr3((CR3_ADDR_MASK & ndckpt_virt_to_phys(new_pgd)) |
-		  (CR3_PCID_MASK & __read_cr3()) /* | CR3_NOFLUSH */);
+		  (CR3_PCID_MASK & __read_cr3()) | CR3_NOFLUSH);
+	reload_cr3_on_other_cpus(mm);
+	trace_ndckpt_switch_mm_context(target, new_pgd, false, false,
+				       fr->num_of_ranges, fr->num_of_invlpgs);
+	// Tables of the contexts are not shared, so paging-structure caches
+	// should be dropped even if no leaf is changed. Any invlpg does it.
+	if (!fr->num_of_ranges) {
+		flush_tlb_mm_range(mm, 0, PAGE_SIZE, PAGE_SHIFT, true);
+		return;
+	}
+	for (i = 0; i < fr->num_of_ranges; i++) {
+		flush_tlb_mm_range(mm, fr->ranges[i].start, fr->ranges[i].end,
+				   fr->ranges[i].stride_shift, true);
+	}
 }
 
 #define ASSERT_SYNC_PAGES
@@ -644,9 +1475,28 @@ static inline void switch_mm_context(struct task_struct *target,
 #define ASSERT(x)
 #endif
 
+static inline void sync_zero_page_pte(pte_t *e, void *page_vaddr,
+				      pte_t *ref_e)
+{
+	// Map the zero page mapped by ref_e. A private page of e is zeroed
+	// if needed and reused. e is not valid, so it can be reused at once.
+	if (IS_PAGE_STATE_ON_NVDIMM(page_state_pte(e)) &&
+	    !ndckpt_is_pte_cow(*e)) {
+		if (!ndckpt_is_page_zeroed(page_vaddr)) {
+			memset(page_vaddr, 0, PAGE_SIZE);
+			ndckpt_clwb_range(page_vaddr, PAGE_SIZE);
+		}
+		pman_free_zeroed_page(first_pmem_device->virt_addr,
+				      page_vaddr);
+	}
+	copy_pte_and_clwb(e, ref_e);
+}
+
 static inline void sync_pages_pte(struct mm_struct *mm, pte_t *t, pte_t *ref_t,
-				  uint64_t addr, uint64_t end)
+				  uint64_t addr, uint64_t end,
+				  struct TlbFlushRanges *fr)
 {
+	// Leaves of ref_t may be in TLB. No entry is left for (*, X).
 	while (addr < end) {
 		pte_t *e, *ref_e;
 		void *page_vaddr, *ref_page_vaddr;
@@ -657,8 +1507,22 @@ static inline void sync_pages_pte(struct mm_struct *mm, pte_t *t, pte_t *ref_t,
 		prev_state = page_state_pte(e);
 		next_state = page_state_pte(ref_e);
 
-		if (prev_state == next_state && next_state != PAGE_STATE_Pnd &&
-		    next_state != PAGE_STATE_Pnc) {
+		if (ndckpt_is_pte_zero_page(*ref_e)) {
+			if (!ndckpt_is_pte_zero_page(*e) ||
+			    page_fixed_attr_pte(e) !=
+				    page_fixed_attr_pte(ref_e)) {
+				trace_ndckpt_sync_page(addr, prev_state,
+						       next_state);
+				sync_zero_page_pte(e, page_vaddr, ref_e);
+				if (ref_e->pte & _PAGE_ACCESSED)
+					tlb_flush_ranges_add(fr, addr,
+							     addr + PAGE_SIZE,
+							     PAGE_SHIFT);
+			}
+		} else if (prev_state == next_state &&
+			   next_state != PAGE_STATE_Pnd &&
+			   next_state != PAGE_STATE_Pnc &&
+			   !ndckpt_is_pte_zero_page(*e)) {
 			// (X, X) -> Not mapped
 			// (Pv, Pv) -> Shared. No need to sync
 			// (Pnc, Pnc) -> Clean. No need to sync
@@ -666,49 +1530,53 @@ static inline void sync_pages_pte(struct mm_struct *mm, pte_t *t, pte_t *ref_t,
 			    (page_vaddr != ref_page_vaddr ||
 			     page_fixed_attr_pte(e) !=
 				     page_fixed_attr_pte(ref_e))) {
-#ifdef NDCKPT_PRINT_SYNC_PAGES
-				pr_ndckpt(
-					"%016llX: %d -> %d (update mapping)\n",
-					addr, prev_state, next_state);
-#endif
+				trace_ndckpt_sync_page(addr, prev_state,
+						       next_state);
 				// DRAM page update. copy ent.
 				copy_pte_and_clwb(e, ref_e);
+				tlb_flush_ranges_add(fr, addr, addr + PAGE_SIZE,
+						     PAGE_SHIFT);
+			} else if (prev_state == PAGE_STATE_Pv &&
+				   (ref_e->pte & _PAGE_DIRTY)) {
+				// Writes via a dirty TLB entry would not set
+				// the dirty bit of e.
+				tlb_flush_ranges_add(fr, addr, addr + PAGE_SIZE,
+						     PAGE_SHIFT);
 			}
 		} else if (next_state == PAGE_STATE_X) {
-#ifdef NDCKPT_PRINT_SYNC_PAGES
-			pr_ndckpt("%016llX: %d -> %d\n", addr, prev_state,
-				  next_state);
-#endif
+			trace_ndckpt_sync_page(addr, prev_state, next_state);
 			unmap_page_and_clwb(e, addr);
 		} else if (next_state == PAGE_STATE_Pv) {
-#ifdef NDCKPT_PRINT_SYNC_PAGES
-			pr_ndckpt("%016llX: %d -> %d ent@0x%016llX\n", addr,
-				  prev_state, next_state, ndckpt_v2p(e));
-#endif
+			trace_ndckpt_sync_page(addr, prev_state, next_state);
 			unmap_page_and_clwb(e, addr);
 			copy_pte_and_clwb(e, ref_e);
+			tlb_flush_ranges_add(fr, addr, addr + PAGE_SIZE,
+					     PAGE_SHIFT);
 		} else {
-#ifdef NDCKPT_PRINT_SYNC_PAGES
-			pr_ndckpt("%016llX: %d -> %d\n", addr, prev_state,
-				  next_state);
-#endif
+			trace_ndckpt_sync_page(addr, prev_state, next_state);
 			if (prev_state == PAGE_STATE_X ||
-			    prev_state == PAGE_STATE_Pv) {
+			    prev_state == PAGE_STATE_Pv ||
+			    prev_state == PAGE_STATE_Pvc || ndckpt_is_pte_cow(*e)) {
+				// Page shared by fork must not be overwritten.
 				map_zeroed_nvdimm_page_page(
-					e, page_fixed_attr_pte(ref_e));
+					e, private_page_fixed_attr_pte(ref_e));
 				traverse_pte(addr, t, &e, &page_vaddr);
 			}
 			if (page_fixed_attr_pte(e) !=
-			    page_fixed_attr_pte(ref_e)) {
-#ifdef NDCKPT_PRINT_SYNC_PAGES
-				pr_ndckpt("  attr synced\n");
-#endif
+			    private_page_fixed_attr_pte(ref_e)) {
 				sync_fixed_attr_pte(e, ref_e);
 			}
 			memcpy(page_vaddr, ref_page_vaddr, PAGE_SIZE);
+			pproc_stats_add(mm_stats(mm), PPROC_STAT_BYTES_COPIED,
+					PAGE_SIZE);
 			// Following bits are only referenced in the power cycle, so no need to flush
 			e->pte |= _PAGE_DIRTY;
 			ref_e->pte &= ~_PAGE_DIRTY;
+			// Each ctx has its own NVDIMM pages, so the entry is
+			// stale if it is in TLB. See record_hot_chunks().
+			if (ref_e->pte & _PAGE_ACCESSED)
+				tlb_flush_ranges_add(fr, addr, addr + PAGE_SIZE,
+						     PAGE_SHIFT);
 		}
 		addr = next_pte_addr(addr);
 	}
@@ -724,10 +1592,70 @@ static inline void sync_pages_pte(struct mm_struct *mm, pte_t *t, pte_t *ref_t,
 #define pr_ndckpt_sync_state_trans(addr, prev_state, next_state)
 #endif
 
-#define def_sync_pages(ename, ctname, ttype, cttype, nextfunc)                     \
-	static inline void sync_pages_##ename(struct mm_struct *mm, ttype *t,      \
-					      ttype *ref_t, uint64_t addr,         \
-					      uint64_t end)                        \
+static inline bool sync_huge_page_pde(struct mm_struct *mm, pmd_t *t,
+				      pmd_t *ref_t, uint64_t addr,
+				      struct TlbFlushRanges *fr)
+{
+	// Sync a PD entry if either of them maps a 2MiB page.
+	// Returns false if the entry should be synced as a table.
+	pmd_t *e, *ref_e;
+	pte_t *ct, *ref_ct;
+
+	traverse_pde(addr, ref_t, &ref_e, &ref_ct);
+	traverse_pde(addr, t, &e, &ct);
+	if (!ref_ct || !ndckpt_is_pmd_huge(*ref_e)) {
+		if (ct && ndckpt_is_pmd_huge(*e)) {
+			// A table is mapped again by the caller if needed.
+			unmap_pt_and_clwb(e);
+		}
+		return false;
+	}
+	if (!ndckpt_is_virt_addr_in_nvdimm(ref_ct)) {
+		// 2MiB page on DRAM is shared as is
+		if (e->pmd != ref_e->pmd)
+			copy_pde_and_clwb(e, ref_e);
+		return true;
+	}
+	// Each ctx has its own NVDIMM pages. See record_hot_chunks().
+	if (ref_e->pmd & _PAGE_ACCESSED)
+		tlb_flush_ranges_add(fr, addr, addr + PMD_SIZE, PMD_SHIFT);
+	if (!ct || !ndckpt_is_pmd_huge(*e) ||
+	    !ndckpt_is_virt_addr_in_nvdimm(ct)) {
+		map_zeroed_nvdimm_huge_page(e, huge_page_fixed_attr_pde(ref_e));
+		traverse_pde(addr, t, &e, &ct);
+	} else if ((ref_e->pmd & _PAGE_NDCKPT_UNSYNCED) == 0) {
+		// Not written since the last sync. See flush_dirty_pages().
+		if (huge_page_fixed_attr_pde(e) !=
+		    huge_page_fixed_attr_pde(ref_e)) {
+			e->pmd = ndckpt_huge_page_paddr(*e) |
+				 huge_page_fixed_attr_pde(ref_e);
+			ndckpt_clwb(e);
+		}
+		return true;
+	}
+	// Copy is flushed here, so e is not marked as dirty.
+	// Otherwise it would be copied back on the next commit.
+	memcpy_and_clwb(ct, ref_ct, PMD_SIZE);
+	pproc_stats_add(mm_stats(mm), PPROC_STAT_BYTES_COPIED, PMD_SIZE);
+	pproc_stats_add(mm_stats(mm), PPROC_STAT_BYTES_FLUSHED, PMD_SIZE);
+	e->pmd = ndckpt_huge_page_paddr(*e) | huge_page_fixed_attr_pde(ref_e);
+	ndckpt_clwb(e);
+	ref_e->pmd &= ~(uint64_t)_PAGE_NDCKPT_UNSYNCED;
+	ndckpt_clwb(ref_e);
+	return true;
+}
+
+static inline bool sync_no_huge_page(struct mm_struct *mm, void *t,
+				     void *ref_t, uint64_t addr,
+				     struct TlbFlushRanges *fr)
+{
+	return false;
+}
+
+#define def_sync_pages(ename, ctname, ttype, cttype, nextfunc, hugefunc)           \
+	static inline void sync_pages_##ename(                                     \
+		struct mm_struct *mm, ttype *t, ttype *ref_t, uint64_t addr,       \
+		uint64_t end, struct TlbFlushRanges *fr)                           \
 	{                                                                          \
 		while (addr < end) {                                               \
 			const uint64_t next_addr = next_##ename##_addr(addr);      \
@@ -735,6 +1663,10 @@ static inline void sync_pages_pte(struct mm_struct *mm, pte_t *t, pte_t *ref_t,
 			cttype *ct, *ref_ct;                                       \
 			uint8_t prev_state, next_state;                            \
                                                                                    \
+			if (hugefunc(mm, t, ref_t, addr, fr)) {                    \
+				addr = next_addr;                                  \
+				continue;                                          \
+			}                                                          \
 			traverse_##ename(addr, ref_t, &ref_e, &ref_ct);            \
 			traverse_##ename(addr, t, &e, &ct);                        \
 			prev_state = table_state_##ename(e);                       \
@@ -762,23 +1694,23 @@ static inline void sync_pages_pte(struct mm_struct *mm, pte_t *t, pte_t *ref_t,
 			}                                                          \
 			if (next_state == TABLE_STATE_Tn) {                        \
 				nextfunc(mm, ct, ref_ct, addr,                     \
-					 end < next_addr ? end : next_addr);       \
+					 end < next_addr ? end : next_addr, fr);   \
 			}                                                          \
 			addr = next_addr;                                          \
 		}                                                                  \
 	}
 
 // sync_pages_pde
-def_sync_pages(pde, pt, pmd_t, pte_t, sync_pages_pte);
+def_sync_pages(pde, pt, pmd_t, pte_t, sync_pages_pte, sync_huge_page_pde);
 // sync_pages_pdpte
-def_sync_pages(pdpte, pd, pud_t, pmd_t, sync_pages_pde);
+def_sync_pages(pdpte, pd, pud_t, pmd_t, sync_pages_pde, sync_no_huge_page);
 // sync_pages_pml4e
-def_sync_pages(pml4e, pdpt, pgd_t, pud_t, sync_pages_pdpte);
+def_sync_pages(pml4e, pdpt, pgd_t, pud_t, sync_pages_pdpte, sync_no_huge_page);
 
 static void sync_pages(struct mm_struct *mm, pgd_t *t4, pgd_t *ref_t4,
-		       uint64_t start, uint64_t end)
+		       uint64_t start, uint64_t end, struct TlbFlushRanges *fr)
 {
-	sync_pages_pml4e(mm, t4, ref_t4, start, end);
+	sync_pages_pml4e(mm, t4, ref_t4, start, end, fr);
 	ndckpt_sfence();
 }
 
@@ -892,6 +1824,20 @@ static void check_page_is_synced(struct mm_struct *mm, pgd_t *t4, pgd_t *ref_t4,
 				table_fixed_attr_pde(ref_e2));
 			check_failed(mm, t4, ref_t4, addr);
 		}
+		if (ndckpt_is_pmd_huge(*e2) || ndckpt_is_pmd_huge(*ref_e2)) {
+			if (!ndckpt_is_pmd_huge(*e2) ||
+			    !ndckpt_is_pmd_huge(*ref_e2)) {
+				pr_ndckpt("2MiB page state diff:\n");
+				check_failed(mm, t4, ref_t4, addr);
+			}
+			if (ndckpt_is_virt_addr_in_nvdimm(t1) &&
+			    memcmp(t1, ref_t1, PMD_SIZE) != 0) {
+				pr_ndckpt("2MiB page on NVDIMM data diff:\n");
+				check_failed(mm, t4, ref_t4, addr);
+			}
+			addr = next_pde_addr(addr);
+			continue;
+		}
 
 		traverse_pte(addr, ref_t1, &ref_e1, &ref_page_vaddr);
 		traverse_pte(addr, t1, &e1, &page_vaddr);
@@ -913,11 +1859,12 @@ static void check_page_is_synced(struct mm_struct *mm, pgd_t *t4, pgd_t *ref_t4,
 			pr_ndckpt("Page mapping diff:\n");
 			check_failed(mm, t4, ref_t4, addr);
 		}
-		if (page_fixed_attr_pte(e1) != page_fixed_attr_pte(ref_e1)) {
+		if (private_page_fixed_attr_pte(e1) !=
+		    private_page_fixed_attr_pte(ref_e1)) {
 			pr_ndckpt(
 				"Page attr diff: 0x%016llX but expected 0x%016llX\n",
-				page_fixed_attr_pte(e1),
-				page_fixed_attr_pte(ref_e1));
+				private_page_fixed_attr_pte(e1),
+				private_page_fixed_attr_pte(ref_e1));
 			check_failed(mm, t4, ref_t4, addr);
 		}
 		if (IS_PAGE_STATE_ON_NVDIMM(page_state_pte(e1)) &&
@@ -981,17 +1928,30 @@ void pproc_commit(struct task_struct *target,
 {
 	const int prev_running_ctx_idx = pproc_get_running_ctx(pproc);
 	const int next_running_ctx_idx = 1 - prev_running_ctx_idx;
-
+	struct TlbFlushRanges fr;
+
+	// Chunks not restored yet would be committed as unmapped.
+	pproc_lazy_restore_release(pproc, mm, true);
+	if (ndckpt_dram_cache_pages && !pproc->dram_cache)
+		pproc->dram_cache = dram_cache_alloc();
+	// Other threads of mm may fault or change the layout of mm meanwhile.
+	// Threads running in user mode are not stopped, so their stores
+	// during a commit belong to either of the contexts.
+	down_write(&mm->mmap_sem);
 	if (!spin_trylock(&pproc->ckpt_lock)) {
+		up_write(&mm->mmap_sem);
 		printk("Failed to pproc_commit\n");
 		return;
 	}
+	pproc_bump_commit_seq(pproc);
+	pproc_stats_commit_begin(pproc->stats);
+	trace_ndckpt_commit_begin(target, prev_running_ctx_idx);
 
 	mark_target_vmas(mm);
 	pproc_save_vmas(pproc, prev_running_ctx_idx, mm);
 
 	pproc_set_regs(pproc, prev_running_ctx_idx, target);
-	flush_target_vmas(mm);
+	flush_target_vmas(pproc, mm);
 	// TODO: Save vmas here
 	pr_ndckpt_ckpt("Ctx #%d has been committed\n", prev_running_ctx_idx);
 	// At this point, running ctx has become clean so both context is valid.
@@ -999,16 +1959,29 @@ void pproc_commit(struct task_struct *target,
 	// prepare next running context
 	pr_ndckpt_ckpt("Sync Ctx #%d -> Ctx #%d\n", prev_running_ctx_idx,
 		       next_running_ctx_idx);
+	tlb_flush_ranges_init(&fr, pproc->ctx[prev_running_ctx_idx].pgd);
 	sync_pages(mm, pproc->ctx[next_running_ctx_idx].pgd,
-		   pproc->ctx[prev_running_ctx_idx].pgd, 0, 1ULL << 47);
+		   pproc->ctx[prev_running_ctx_idx].pgd, 0, 1ULL << 47, &fr);
 #ifdef NDCKPT_CHECK_SYNC_ON_COMMIT
 	check_page_is_synced(mm, pproc->ctx[next_running_ctx_idx].pgd,
 			     pproc->ctx[prev_running_ctx_idx].pgd, 0,
 			     1ULL << 47);
 #endif
+	record_target_vmas_hotness(pproc, mm);
+	if (pproc->dram_cache)
+		dram_cache_install(pproc->dram_cache,
+				   pproc->ctx[next_running_ctx_idx].pgd);
 	// Finally, switch the cr3 to the new running context's pgd.
-	switch_mm_context(target, mm, pproc->ctx[next_running_ctx_idx].pgd);
+	// Pages cached on DRAM are installed in place of NVDIMM pages, whose
+	// TLB entries are invalidated via fr if any.
+	switch_mm_context(target, mm, pproc->ctx[next_running_ctx_idx].pgd,
+			  &fr);
+	if (pproc->dram_cache)
+		dram_cache_free_demoted(pproc->dram_cache);
+	pproc_stats_commit_end(pproc->stats);
+	trace_ndckpt_commit_end(target, prev_running_ctx_idx);
 	spin_unlock(&pproc->ckpt_lock);
+	up_write(&mm->mmap_sem);
 }
 
 static void copy_pml4_kernel_map(pgd_t *ctx_pgd, pgd_t *mm_pgd)
@@ -1041,7 +2014,8 @@ static bool verify_pml4_kernel_map(pgd_t *mm_pgd, pgd_t *ctx_pgd)
 	return is_invalid;
 }
 
-static void replace_pages_with_nvdimm(pgd_t *t4, uint64_t start, uint64_t end,
+static void replace_pages_with_nvdimm(struct TlbFlushBatch *tlb, pgd_t *t4,
+				      uint64_t start, uint64_t end,
 				      bool exclude_leaf_page)
 {
 	uint64_t addr;
@@ -1065,7 +2039,7 @@ static void replace_pages_with_nvdimm(pgd_t *t4, uint64_t start, uint64_t end,
 		}
 		if (!ndckpt_is_virt_addr_in_nvdimm(t3)) {
 			replace_pdpt_with_nvdimm_page(e4);
-			ndckpt_invlpg((void *)addr);
+			tlb_flush_batch_add_table(tlb, addr);
 			continue;
 		}
 		traverse_pdpte(addr, t3, &e3, &t2);
@@ -1075,7 +2049,7 @@ static void replace_pages_with_nvdimm(pgd_t *t4, uint64_t start, uint64_t end,
 		}
 		if (!ndckpt_is_virt_addr_in_nvdimm(t2)) {
 			replace_pd_with_nvdimm_page(e3);
-			ndckpt_invlpg((void *)addr);
+			tlb_flush_batch_add_table(tlb, addr);
 			continue;
 		}
 		traverse_pde(addr, t2, &e2, &t1);
@@ -1083,9 +2057,24 @@ static void replace_pages_with_nvdimm(pgd_t *t4, uint64_t start, uint64_t end,
 			addr = next_pde_addr(addr);
 			continue;
 		}
+		if (ndckpt_is_pmd_huge(*e2)) {
+			if (!exclude_leaf_page) {
+				if (!ndckpt_is_virt_addr_in_nvdimm(t1)) {
+					replace_huge_page_with_nvdimm_page(e2);
+					tlb_flush_batch_add(tlb, addr,
+							    PAGE_SIZE);
+				}
+				// Contexts may differ after a power cycle.
+				// Copy it on the next sync regardless of dirty bit.
+				e2->pmd |= _PAGE_NDCKPT_UNSYNCED;
+				ndckpt_clwb(e2);
+			}
+			addr = next_pde_addr(addr);
+			continue;
+		}
 		if (!ndckpt_is_virt_addr_in_nvdimm(t1)) {
 			replace_pt_with_nvdimm_page(e2);
-			ndckpt_invlpg((void *)addr);
+			tlb_flush_batch_add_table(tlb, addr);
 			continue;
 		}
 		traverse_pte(addr, t1, &e1, &page_vaddr);
@@ -1094,9 +2083,17 @@ static void replace_pages_with_nvdimm(pgd_t *t4, uint64_t start, uint64_t end,
 			continue;
 		}
 		if (!exclude_leaf_page &&
-		    !ndckpt_is_virt_addr_in_nvdimm(page_vaddr)) {
+		    page_state_pte(e1) == PAGE_STATE_Pvc) {
+			// DRAM cache of the previous boot is lost.
+			// The content is synced from the valid ctx on commit.
+			map_zeroed_nvdimm_page_page(
+				e1, page_fixed_attr_pte(e1) & ~_PAGE_SPECIAL &
+					    ~_PAGE_NDCKPT_CACHED);
+			tlb_flush_batch_add(tlb, addr, PAGE_SIZE);
+		} else if (!exclude_leaf_page &&
+			   !ndckpt_is_virt_addr_in_nvdimm(page_vaddr)) {
 			replace_page_with_nvdimm_page(e1);
-			ndckpt_invlpg((void *)addr);
+			tlb_flush_batch_add(tlb, addr, PAGE_SIZE);
 		}
 		addr = next_pte_addr(addr);
 	}
@@ -1117,19 +2114,141 @@ static void fix_pmem_part_of_ctx(struct mm_struct *mm,
 				 struct PersistentProcessInfo *pproc, int idx)
 {
 	struct vm_area_struct *vma;
+	struct TlbFlushBatch tlb;
+	tlb_flush_batch_init(&tlb, mm, pproc->ctx[idx].pgd);
 	// Replace page structures in lower half with nvdimm page
 	// This does not replaces leaf page
-	replace_pages_with_nvdimm(pproc->ctx[idx].pgd, 0, 1ULL << 47, true);
+	replace_pages_with_nvdimm(&tlb, pproc->ctx[idx].pgd, 0, 1ULL << 47,
+				  true);
 	// Replace leaf pages in target vma
 	for (vma = mm->mmap; vma; vma = vma->vm_next) {
 		if (!ndckpt_is_target_vma(vma)) {
 			continue;
 		}
-		replace_pages_with_nvdimm(pproc->ctx[idx].pgd, vma->vm_start,
-					  vma->vm_end, false);
+		replace_pages_with_nvdimm(&tlb, pproc->ctx[idx].pgd,
+					  vma->vm_start, vma->vm_end, false);
+	}
+	tlb_flush_batch_flush(&tlb);
+}
+
+static void fix_range_of_ctx(struct mm_struct *mm, pgd_t *pgd, uint64_t start,
+			     uint64_t end)
+{
+	// Same as fix_pmem_part_of_ctx() and fix_dram_part_of_ctx() but only
+	// for [start, end). Tables above [start, end) should be on NVDIMM.
+	struct vm_area_struct *vma;
+	struct TlbFlushBatch tlb;
+	uint64_t s, e;
+	tlb_flush_batch_init(&tlb, mm, pgd);
+	replace_pages_with_nvdimm(&tlb, pgd, start, end, true);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		s = max((uint64_t)vma->vm_start, start);
+		e = min((uint64_t)vma->vm_end, end);
+		if (!ndckpt_is_target_vma(vma) || s >= e) {
+			continue;
+		}
+		replace_pages_with_nvdimm(&tlb, pgd, s, e, false);
+	}
+	tlb_flush_batch_flush(&tlb);
+	erase_dram_mappings(pgd, start, end);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		s = max((uint64_t)vma->vm_start, start);
+		e = min((uint64_t)vma->vm_end, end);
+		if (ndckpt_is_target_vma(vma) || s >= e) {
+			continue;
+		}
+		sync_dram_pages(pgd, mm->pgd, s, e, vma);
 	}
 }
 
+struct RestoreWork {
+	struct work_struct work;
+	struct list_head list;
+	struct mm_struct *mm;
+	pgd_t *pgd;
+	uint64_t start, end;
+};
+
+static void restore_work_fn(struct work_struct *work)
+{
+	struct RestoreWork *w = container_of(work, struct RestoreWork, work);
+	fix_range_of_ctx(w->mm, w->pgd, w->start, w->end);
+}
+
+static void queue_fix_range(struct list_head *works, struct mm_struct *mm,
+			    pgd_t *pgd, uint64_t start, uint64_t end)
+{
+	struct RestoreWork *w = kmalloc(sizeof(*w), GFP_KERNEL);
+	if (!w) {
+		fix_range_of_ctx(mm, pgd, start, end);
+		return;
+	}
+	INIT_WORK(&w->work, restore_work_fn);
+	w->mm = mm;
+	w->pgd = pgd;
+	w->start = start;
+	w->end = end;
+	list_add_tail(&w->list, works);
+	queue_work(system_unbound_wq, &w->work);
+}
+
+static void queue_fix_ctx(struct list_head *works, struct mm_struct *mm,
+			  struct PersistentProcessInfo *pproc, int idx)
+{
+	// Split the lower half of ctx into 1GiB ranges and fix them in parallel.
+	// PML4 entries and PDPTs are shared by ranges, so they are prepared
+	// here before queueing works.
+	pgd_t *pgd = pproc->ctx[idx].pgd;
+	pgd_t *e4, *src_e4;
+	pud_t *t3, *src_t3;
+	uint64_t addr;
+	int i, j;
+
+	BUG_ON(ndckpt_is_virt_addr_in_nvdimm(mm->pgd));
+	copy_pml4_kernel_map(pgd, mm->pgd);
+	for (i = 0; i < PTRS_PER_PGD / 2; i++) {
+		addr = (uint64_t)i << PGDIR_SHIFT;
+		traverse_pml4e(addr, mm->pgd, &src_e4, &src_t3);
+		traverse_pml4e(addr, pgd, &e4, &t3);
+		if (!t3 && !src_t3) {
+			continue;
+		}
+		if (!t3) {
+			map_zeroed_nvdimm_page_pdpt(e4,
+						    table_fixed_attr_pml4e(src_e4));
+		} else if (!ndckpt_is_virt_addr_in_nvdimm(t3)) {
+			replace_pdpt_with_nvdimm_page(e4);
+		}
+		traverse_pml4e(addr, pgd, &e4, &t3);
+		for (j = 0; j < PTRS_PER_PUD; j++) {
+			if (!(t3[j].pud & _PAGE_PRESENT) &&
+			    !(src_t3 && (src_t3[j].pud & _PAGE_PRESENT))) {
+				continue;
+			}
+			queue_fix_range(works, mm, pgd,
+					addr + ((uint64_t)j << PUD_SHIFT),
+					addr + ((uint64_t)(j + 1) << PUD_SHIFT));
+		}
+	}
+}
+
+static void fix_ctxs_in_parallel(struct mm_struct *mm,
+				 struct PersistentProcessInfo *pproc)
+{
+	// Equivalent to fix_pmem_part_of_ctx() and fix_dram_part_of_ctx()
+	// for both ctxs.
+	LIST_HEAD(works);
+	struct RestoreWork *w, *tmp;
+	queue_fix_ctx(&works, mm, pproc, 0);
+	queue_fix_ctx(&works, mm, pproc, 1);
+	list_for_each_entry_safe(w, tmp, &works, list) {
+		flush_work(&w->work);
+		list_del(&w->list);
+		kfree(w);
+	}
+	ndckpt_sfence();
+}
+
 int64_t pproc_init(struct task_struct *target,
 		   struct PersistentMemoryManager *pman, struct mm_struct *mm,
 		   struct pt_regs *regs)
@@ -1162,6 +2281,710 @@ int64_t pproc_init(struct task_struct *target,
 	return pproc_restore(pman, target, pproc);
 }
 
+static void share_pages_cow(pgd_t *dst_t4, pgd_t *src_t4, uint64_t start,
+			    uint64_t end)
+{
+	// Map leaf pages of src into dst without copying them.
+	// Both entries become read-only and the first write on either side
+	// makes a private copy. See ndckpt_break_cow().
+	uint64_t addr;
+	//
+	pgd_t *src_e4;
+	pud_t *src_t3 = NULL;
+	pud_t *src_e3;
+	pmd_t *src_t2 = NULL;
+	pmd_t *src_e2;
+	pte_t *src_t1 = NULL;
+	pte_t *src_e1;
+	void *src_page_vaddr;
+	//
+	pgd_t *dst_e4;
+	pud_t *dst_t3 = NULL;
+	pud_t *dst_e3;
+	pmd_t *dst_t2 = NULL;
+	pmd_t *dst_e2;
+	pte_t *dst_t1 = NULL;
+	pte_t *dst_e1;
+	void *dst_page_vaddr;
+
+	BUG_ON(!ndckpt_is_virt_addr_in_nvdimm(dst_t4));
+	for (addr = start; addr < end;) {
+		traverse_pml4e(addr, src_t4, &src_e4, &src_t3);
+		traverse_pml4e(addr, dst_t4, &dst_e4, &dst_t3);
+		if (!src_t3) {
+			addr = next_pml4e_addr(addr);
+			continue;
+		}
+		if (!dst_t3) {
+			map_zeroed_nvdimm_page_pdpt(dst_e4,
+						    table_fixed_attr_pml4e(src_e4));
+			continue; // Retry
+		}
+		BUG_ON(!ndckpt_is_virt_addr_in_nvdimm(dst_t3));
+		traverse_pdpte(addr, src_t3, &src_e3, &src_t2);
+		traverse_pdpte(addr, dst_t3, &dst_e3, &dst_t2);
+		if (!src_t2) {
+			addr = next_pdpte_addr(addr);
+			continue;
+		}
+		if (!dst_t2) {
+			map_zeroed_nvdimm_page_pd(dst_e3,
+						  table_fixed_attr_pdpte(src_e3));
+			continue; // Retry
+		}
+		BUG_ON(!ndckpt_is_virt_addr_in_nvdimm(dst_t2));
+		traverse_pde(addr, src_t2, &src_e2, &src_t1);
+		traverse_pde(addr, dst_t2, &dst_e2, &dst_t1);
+		if (!src_t1) {
+			addr = next_pde_addr(addr);
+			continue;
+		}
+		if (ndckpt_is_pmd_huge(*src_e2)) {
+			// Pages are shared per 4KiB
+			ndckpt_split_huge_pmd(src_e2);
+			continue; // Retry
+		}
+		if (!dst_t1) {
+			map_zeroed_nvdimm_page_pt(dst_e2,
+						  table_fixed_attr_pde(src_e2));
+			continue; // Retry
+		}
+		BUG_ON(!ndckpt_is_virt_addr_in_nvdimm(dst_t1));
+		traverse_pte(addr, src_t1, &src_e1, &src_page_vaddr);
+		traverse_pte(addr, dst_t1, &dst_e1, &dst_page_vaddr);
+		if (!src_page_vaddr) {
+			addr = next_pte_addr(addr);
+			continue;
+		}
+		if (!ndckpt_is_virt_addr_in_nvdimm(src_page_vaddr)) {
+			// Not on NVDIMM yet. The child gets its own copy.
+			map_zeroed_nvdimm_page_page(dst_e1,
+						    page_fixed_attr_pte(src_e1));
+			traverse_pte(addr, dst_t1, &dst_e1, &dst_page_vaddr);
+			memcpy_and_clwb(dst_page_vaddr, src_page_vaddr,
+					PAGE_SIZE);
+			addr = next_pte_addr(addr);
+			continue;
+		}
+		src_e1->pte = (src_e1->pte & ~_PAGE_RW) | _PAGE_NDCKPT_COW;
+		ndckpt_clwb(src_e1);
+		dst_e1->pte = src_e1->pte & ~_PAGE_DIRTY;
+		ndckpt_clwb(dst_e1);
+		addr = next_pte_addr(addr);
+	}
+	ndckpt_sfence();
+}
+
+int pproc_dup_mmap(struct PersistentMemoryManager *pman, struct mm_struct *mm,
+		   struct mm_struct *oldmm)
+{
+	// mm is a child of oldmm which is running on a checkpointed context.
+	// dup_mmap() has copied mappings of non-target vmas into mm->pgd on DRAM
+	// and left target vmas empty. Build both contexts of the child here,
+	// sharing NVDIMM pages of the parent's running context.
+	struct PersistentProcessInfo *pproc = pproc_alloc(pman);
+	struct vm_area_struct *vma;
+	pgd_t *pgd;
+	int i;
+
+	BUG_ON(!pproc);
+	BUG_ON(!ndckpt_is_virt_addr_in_nvdimm(oldmm->pgd));
+	pr_ndckpt("pproc pobj #%lld (forked)\n", pobj_get_header(pproc)->id);
+	// DRAM pages can not be shared. Parent maps its home pages again.
+	ndckpt_dram_cache_evict(oldmm);
+	spin_lock_init(&pproc->ckpt_lock);
+	pproc->org_pgd = mm->pgd;
+	pproc->stats = pproc_stats_alloc();
+	mark_target_vmas(mm);
+
+	for (i = 0; i < 2; i++) {
+		pgd = ndckpt_alloc_zeroed_virt_page();
+		memcpy_and_clwb(pgd, mm->pgd, PAGE_SIZE);
+		pproc_set_pgd(pproc, i, pgd);
+		fix_pmem_part_of_ctx(mm, pproc, i);
+		fix_dram_part_of_ctx(mm, pproc, i);
+		for (vma = mm->mmap; vma; vma = vma->vm_next) {
+			if (!ndckpt_is_target_vma(vma)) {
+				continue;
+			}
+			share_pages_cow(pgd, oldmm->pgd, vma->vm_start,
+					vma->vm_end);
+		}
+	}
+	pproc_save_vmas(pproc, 0, mm);
+	// Parent ptes became read-only. TLB of oldmm is flushed by dup_mmap().
+	mm->ndckpt_pproc = pproc;
+	return 0;
+}
+
+void pproc_fork(struct PersistentProcessInfo *pproc, struct task_struct *child)
+{
+	// Commit the initial state of the child as ctx[0] and run on ctx[1].
+	struct mm_struct *mm = child->mm;
+	pproc_set_regs(pproc, 0, child);
+	pproc_set_valid_ctx(pproc, 0);
+	mm->pgd = pproc->ctx[1].pgd;
+	BUG_ON(verify_pml4_kernel_map(pproc->ctx[0].pgd, pproc->org_pgd));
+	BUG_ON(verify_pml4_kernel_map(pproc->ctx[1].pgd, pproc->org_pgd));
+}
+
+//
+// Lazy restore
+//
+// With lazy restore enabled, pproc_restore() does not sync the running ctx
+// with the valid ctx before returning to the user. Instead, PD entries
+// covering target vmas are detached from the running ctx and each 2MiB chunk
+// is synced when it is touched first or by a background worker.
+// Target vmas of the valid ctx are never modified until the next commit, so
+// a crash during the lazy restore just restores from the same checkpoint
+// again. Only the kernel half and mappings of non-target vmas of the valid
+// ctx are rewritten by fix_gaps_of_ctx(). They are not part of the checkpoint
+// and are rebuilt on every restore.
+//
+// The lazy restore is stopped on commit after attaching pending chunks, or
+// at mm teardown without that. See ndckpt_exit_mmap().
+//
+
+struct LazyRestoreRange {
+	// [start, end) is aligned to PMD_SIZE
+	uint64_t start, end;
+	// A bit per chunk which is not attached to the running ctx yet
+	unsigned long *pending;
+	// PD entries of the running ctx saved at detach time
+	pmd_t *detached;
+};
+
+struct LazyRestoreState {
+	// Held while attaching chunks. Taken after mm->mmap_sem.
+	struct mutex lock;
+	struct mm_struct *mm;
+	struct PersistentProcessInfo *pproc;
+	struct task_struct *worker;
+	uint64_t num_of_pending_chunks;
+	volatile bool done;
+	int num_of_ranges;
+	struct LazyRestoreRange ranges[PCTX_NUM_OF_VMAS];
+	// Chunks from here are out of ranges and kept attached.
+	uint64_t attached_from;
+	// Chunks recorded as hot are attached first.
+	int num_of_hot_chunks, next_hot_chunk;
+	uint64_t hot_chunks[PPROC_NUM_OF_HOT_CHUNKS];
+};
+
+static inline uint64_t lazy_num_of_chunks(struct LazyRestoreRange *range)
+{
+	return (range->end - range->start) >> PMD_SHIFT;
+}
+
+static void lazy_restore_free(struct LazyRestoreState *lazy)
+{
+	int i;
+	for (i = 0; i < lazy->num_of_ranges; i++) {
+		kfree(lazy->ranges[i].pending);
+		kvfree(lazy->ranges[i].detached);
+	}
+	mmdrop(lazy->mm);
+	kfree(lazy);
+}
+
+static struct LazyRestoreState *
+lazy_restore_alloc(struct mm_struct *mm, struct PersistentProcessInfo *pproc)
+{
+	struct LazyRestoreState *lazy;
+	struct LazyRestoreRange *range;
+	struct vm_area_struct *vma;
+	uint64_t start, end, n;
+	int i;
+
+	lazy = kzalloc(sizeof(*lazy), GFP_KERNEL);
+	if (!lazy)
+		return NULL;
+	mutex_init(&lazy->lock);
+	mmgrab(mm);
+	lazy->mm = mm;
+	lazy->pproc = pproc;
+	lazy->attached_from = 1ULL << 47;
+	lazy->num_of_hot_chunks = pproc_get_hot_chunks(pproc, lazy->hot_chunks);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (!ndckpt_is_target_vma(vma)) {
+			continue;
+		}
+		start = vma->vm_start & PMD_MASK;
+		end = ALIGN(vma->vm_end, PMD_SIZE);
+		if (lazy->num_of_ranges &&
+		    start <= lazy->ranges[lazy->num_of_ranges - 1].end) {
+			// Shares a chunk with the previous one
+			range = &lazy->ranges[lazy->num_of_ranges - 1];
+			range->end = max(range->end, end);
+			continue;
+		}
+		if (lazy->num_of_ranges >= PCTX_NUM_OF_VMAS) {
+			lazy->attached_from = start;
+			break;
+		}
+		range = &lazy->ranges[lazy->num_of_ranges++];
+		range->start = start;
+		range->end = end;
+	}
+	for (i = 0; i < lazy->num_of_ranges; i++) {
+		range = &lazy->ranges[i];
+		n = lazy_num_of_chunks(range);
+		range->pending = kcalloc(BITS_TO_LONGS(n), sizeof(unsigned long),
+					 GFP_KERNEL);
+		range->detached = kvcalloc(n, sizeof(pmd_t), GFP_KERNEL);
+		if (!range->pending || !range->detached) {
+			lazy_restore_free(lazy);
+			return NULL;
+		}
+	}
+	return lazy;
+}
+
+static void fix_gap_of_ctx(struct TlbFlushBatch *tlb, pgd_t *pgd,
+			   uint64_t start, uint64_t end)
+{
+	if (start >= end)
+		return;
+	replace_pages_with_nvdimm(tlb, pgd, start, end, true);
+	erase_dram_mappings(pgd, start, end);
+}
+
+static void fix_gaps_of_ctx(struct mm_struct *mm,
+			    struct PersistentProcessInfo *pproc, int idx)
+{
+	// Same as fix_pmem_part_of_ctx() + fix_dram_part_of_ctx()
+	// except that target vmas are left untouched.
+	pgd_t *pgd = pproc->ctx[idx].pgd;
+	struct vm_area_struct *vma;
+	struct TlbFlushBatch tlb;
+	uint64_t gap_start = 0;
+
+	BUG_ON(ndckpt_is_virt_addr_in_nvdimm(mm->pgd));
+	copy_pml4_kernel_map(pgd, mm->pgd);
+	tlb_flush_batch_init(&tlb, mm, pgd);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (!ndckpt_is_target_vma(vma)) {
+			continue;
+		}
+		fix_gap_of_ctx(&tlb, pgd, gap_start, vma->vm_start);
+		gap_start = vma->vm_end;
+	}
+	fix_gap_of_ctx(&tlb, pgd, gap_start, 1ULL << 47);
+	tlb_flush_batch_flush(&tlb);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (ndckpt_is_target_vma(vma)) {
+			continue;
+		}
+		sync_dram_pages(pgd, mm->pgd, vma->vm_start, vma->vm_end, vma);
+	}
+}
+
+static void lazy_detach_chunks(struct LazyRestoreState *lazy, pgd_t *t4)
+{
+	struct LazyRestoreRange *range;
+	uint64_t addr, n;
+	pgd_t *e4;
+	pud_t *t3;
+	pud_t *e3;
+	pmd_t *t2;
+	pmd_t *e2;
+	pte_t *t1;
+	int i;
+
+	for (i = 0; i < lazy->num_of_ranges; i++) {
+		range = &lazy->ranges[i];
+		for (n = 0; n < lazy_num_of_chunks(range); n++) {
+			addr = range->start + (n << PMD_SHIFT);
+			set_bit(n, range->pending);
+			lazy->num_of_pending_chunks++;
+			traverse_pml4e(addr, t4, &e4, &t3);
+			if (!t3)
+				continue;
+			traverse_pdpte(addr, t3, &e3, &t2);
+			if (!t2)
+				continue;
+			traverse_pde(addr, t2, &e2, &t1);
+			if (table_state_pde(e2) == TABLE_STATE_Tn) {
+				// Reuse the PT and its pages on attach
+				range->detached[n] = *e2;
+			}
+			unmap_pt_and_clwb(e2);
+		}
+	}
+	ndckpt_sfence();
+}
+
+static void lazy_attach_chunk(struct mm_struct *mm, pgd_t *t4, pgd_t *ref_t4,
+			      uint64_t addr, pmd_t detached)
+{
+	pgd_t *e4, *ref_e4;
+	pud_t *t3, *ref_t3;
+	pud_t *e3, *ref_e3;
+	pmd_t *t2, *ref_t2;
+	pmd_t *e2, *ref_e2;
+	pte_t *t1, *ref_t1;
+
+	traverse_pml4e(addr, ref_t4, &ref_e4, &ref_t3);
+	if (!ref_t3)
+		return;
+	traverse_pdpte(addr, ref_t3, &ref_e3, &ref_t2);
+	if (!ref_t2)
+		return;
+	traverse_pde(addr, ref_t2, &ref_e2, &ref_t1);
+	if (!ref_t1)
+		return;
+	// Page faults of the process may populate upper tables concurrently.
+	spin_lock(&mm->page_table_lock);
+	traverse_pml4e(addr, t4, &e4, &t3);
+	if (!t3) {
+		map_zeroed_nvdimm_page_pdpt(e4, table_fixed_attr_pml4e(ref_e4));
+		traverse_pml4e(addr, t4, &e4, &t3);
+	}
+	traverse_pdpte(addr, t3, &e3, &t2);
+	if (!t2) {
+		map_zeroed_nvdimm_page_pd(e3, table_fixed_attr_pdpte(ref_e3));
+		traverse_pdpte(addr, t3, &e3, &t2);
+	}
+	spin_unlock(&mm->page_table_lock);
+	traverse_pde(addr, t2, &e2, &t1);
+	if (t1) {
+		// Someone walked into this chunk without faulting. Sync in place.
+		sync_pages_pde(mm, t2, ref_t2, addr, addr + PMD_SIZE, NULL);
+		ndckpt_sfence();
+		return;
+	}
+	if (ndckpt_is_pmd_huge(*ref_e2) &&
+	    ndckpt_is_virt_addr_in_nvdimm(ref_t1)) {
+		// Copy the 2MiB page while it is invisible, then publish it.
+		t1 = ndckpt_is_pmd_huge(detached) ?
+			     ndckpt_p2v(ndckpt_huge_page_paddr(detached)) :
+			     ndckpt_alloc_zeroed_huge_page();
+		memcpy_and_clwb(t1, ref_t1, PMD_SIZE);
+		ndckpt_sfence();
+		e2->pmd = ndckpt_v2p(t1) | huge_page_fixed_attr_pde(ref_e2);
+		ndckpt_clwb(e2);
+		ndckpt_sfence();
+		return;
+	}
+	if (ndckpt_is_pmd_huge(*ref_e2)) {
+		copy_pde_and_clwb(e2, ref_e2);
+		ndckpt_sfence();
+		return;
+	}
+	// Sync the PT while it is invisible from the process, then publish it.
+	t1 = table_state(detached.pmd) == TABLE_STATE_Tn &&
+			     !ndckpt_is_pmd_huge(detached) ?
+		     ndckpt_p2v(detached.pmd & PTE_PFN_MASK) :
+		     ndckpt_alloc_zeroed_virt_page();
+	sync_pages_pte(mm, t1, ref_t1, addr, addr + PMD_SIZE, NULL);
+	ndckpt_clwb_range(t1, PAGE_SIZE);
+	ndckpt_sfence();
+	e2->pmd = ndckpt_v2p(t1) | table_fixed_attr_pde(ref_e2);
+	ndckpt_clwb(e2);
+	ndckpt_sfence();
+}
+
+static bool lazy_attach_chunk_at(struct LazyRestoreState *lazy,
+				 struct LazyRestoreRange *range, uint64_t n)
+{
+	struct PersistentProcessInfo *pproc = lazy->pproc;
+	const int valid_ctx_idx = pproc->valid_ctx_idx;
+
+	lockdep_assert_held(&lazy->lock);
+	if (!test_bit(n, range->pending))
+		return false;
+	lazy_attach_chunk(lazy->mm, pproc->ctx[1 - valid_ctx_idx].pgd,
+			  pproc->ctx[valid_ctx_idx].pgd,
+			  range->start + (n << PMD_SHIFT), range->detached[n]);
+	clear_bit(n, range->pending);
+	if (--lazy->num_of_pending_chunks == 0) {
+		pr_ndckpt_restore("lazy restore done\n");
+		lazy->done = true;
+	}
+	return true;
+}
+
+static bool lazy_attach_addr(struct LazyRestoreState *lazy, uint64_t addr)
+{
+	struct LazyRestoreRange *range;
+	int i;
+	for (i = 0; i < lazy->num_of_ranges; i++) {
+		range = &lazy->ranges[i];
+		if (addr < range->start || range->end <= addr)
+			continue;
+		return lazy_attach_chunk_at(lazy, range,
+					    (addr - range->start) >> PMD_SHIFT);
+	}
+	return false;
+}
+
+static bool lazy_attach_next(struct LazyRestoreState *lazy)
+{
+	// Attach one of pending chunks. Returns false if nothing remains.
+	struct LazyRestoreRange *range;
+	uint64_t n;
+	int i;
+	while (lazy->next_hot_chunk < lazy->num_of_hot_chunks) {
+		if (lazy_attach_addr(
+			    lazy, lazy->hot_chunks[lazy->next_hot_chunk++]))
+			return true;
+	}
+	for (i = 0; i < lazy->num_of_ranges; i++) {
+		range = &lazy->ranges[i];
+		n = find_first_bit(range->pending, lazy_num_of_chunks(range));
+		if (n >= lazy_num_of_chunks(range))
+			continue;
+		lazy_attach_chunk_at(lazy, range, n);
+		return true;
+	}
+	return false;
+}
+
+static void lazy_attach_all(struct LazyRestoreState *lazy)
+{
+	lockdep_assert_held(&lazy->lock);
+	while (lazy_attach_next(lazy))
+		;
+}
+
+static int lazy_restore_worker(void *arg)
+{
+	struct LazyRestoreState *lazy = arg;
+	bool remaining = true;
+	while (remaining && !kthread_should_stop()) {
+		if (!down_read_trylock(&lazy->mm->mmap_sem)) {
+			// Layout of the process is changing. Try again later.
+			schedule_timeout_interruptible(1);
+			continue;
+		}
+		mutex_lock(&lazy->lock);
+		remaining = lazy_attach_next(lazy);
+		mutex_unlock(&lazy->lock);
+		up_read(&lazy->mm->mmap_sem);
+		cond_resched();
+	}
+	return 0;
+}
+
+void pproc_lazy_restore_fault(struct PersistentProcessInfo *pproc,
+			      uint64_t addr)
+{
+	// Called with mm->mmap_sem held.
+	struct LazyRestoreState *lazy = READ_ONCE(pproc->lazy);
+	if (!lazy || lazy->done)
+		return;
+	mutex_lock(&lazy->lock);
+	lazy_attach_addr(lazy, addr);
+	mutex_unlock(&lazy->lock);
+}
+
+void pproc_lazy_restore_complete(struct PersistentProcessInfo *pproc)
+{
+	// Called with mm->mmap_sem held before changing the layout of mm.
+	struct LazyRestoreState *lazy = READ_ONCE(pproc->lazy);
+	if (!lazy || lazy->done)
+		return;
+	mutex_lock(&lazy->lock);
+	lazy_attach_all(lazy);
+	mutex_unlock(&lazy->lock);
+}
+
+void pproc_lazy_restore_release(struct PersistentProcessInfo *pproc,
+				struct mm_struct *mm, bool finish)
+{
+	// Stop the lazy restore and free its state.
+	// If finish is true, pending chunks are attached before that.
+	// It can be false only if the running ctx will never be used again.
+	struct LazyRestoreState *lazy;
+	if (!READ_ONCE(pproc->lazy))
+		return;
+	down_write(&mm->mmap_sem);
+	lazy = pproc->lazy;
+	if (!lazy) {
+		up_write(&mm->mmap_sem);
+		return;
+	}
+	if (lazy->worker) {
+		kthread_stop(lazy->worker);
+		put_task_struct(lazy->worker);
+	}
+	if (finish) {
+		mutex_lock(&lazy->lock);
+		lazy_attach_all(lazy);
+		mutex_unlock(&lazy->lock);
+	}
+	pproc->lazy = NULL;
+	up_write(&mm->mmap_sem);
+	lazy_restore_free(lazy);
+}
+
+void pproc_dram_cache_evict(struct PersistentProcessInfo *pproc,
+			    struct mm_struct *mm)
+{
+	if (!pproc->dram_cache)
+		return;
+	dram_cache_evict(pproc->dram_cache, mm);
+}
+
+void pproc_dram_cache_release(struct PersistentProcessInfo *pproc)
+{
+	// Only if the running ctx will never be used again.
+	struct DramCacheState *cache = pproc->dram_cache;
+	if (!cache)
+		return;
+	pproc->dram_cache = NULL;
+	dram_cache_free(cache);
+}
+
+void pproc_stats_release(struct PersistentProcessInfo *pproc)
+{
+	// Called at mm teardown. See ndckpt_proc_show().
+	struct PprocStats *stats = pproc->stats;
+	pproc->stats = NULL;
+	pproc_stats_free(stats);
+}
+
+static int64_t pproc_restore_lazy(struct PersistentMemoryManager *pman,
+				  struct task_struct *target,
+				  struct PersistentProcessInfo *pproc)
+{
+	struct pt_regs *regs = task_pt_regs(target);
+	struct mm_struct *mm = target->mm;
+	const int valid_ctx_idx = pproc->valid_ctx_idx;
+	const int running_ctx_idx = 1 - valid_ctx_idx;
+	struct LazyRestoreState *lazy;
+	struct task_struct *worker;
+
+	pproc->org_pgd = mm->pgd;
+	mm->ndckpt_pproc = pproc;
+	pproc_restore_regs(target, pproc, valid_ctx_idx);
+	pproc_restore_vmas(mm, pproc, valid_ctx_idx);
+	mark_target_vmas(mm);
+	erase_page_cache_of_ctxs(mm, pproc);
+
+	lazy = lazy_restore_alloc(mm, pproc);
+	if (!lazy) {
+		pr_ndckpt_restore("lazy restore: no memory, restoring eagerly\n");
+		fix_ctxs_in_parallel(mm, pproc);
+		pman_set_last_proc_info(pman, NULL);
+		pproc_set_valid_ctx(pproc, 1 - valid_ctx_idx);
+		mm->pgd = pproc->ctx[valid_ctx_idx].pgd;
+		pproc_commit(target, pproc, mm, regs);
+		pman_set_last_proc_info(pman, pproc);
+		return regs->ax;
+	}
+	fix_gaps_of_ctx(mm, pproc, valid_ctx_idx);
+	fix_gaps_of_ctx(mm, pproc, running_ctx_idx);
+	lazy_detach_chunks(lazy, pproc->ctx[running_ctx_idx].pgd);
+	if (lazy->attached_from < (1ULL << 47)) {
+		// Out of ranges. The rest is synced now instead of on faults.
+		sync_pages(mm, pproc->ctx[running_ctx_idx].pgd,
+			   pproc->ctx[valid_ctx_idx].pgd, lazy->attached_from,
+			   1ULL << 47, NULL);
+		ndckpt_sfence();
+	}
+	pproc->lazy = lazy;
+	switch_mm_context(target, mm, pproc->ctx[running_ctx_idx].pgd, NULL);
+	pr_ndckpt_restore("lazy restore: %lld chunks pending\n",
+			  lazy->num_of_pending_chunks);
+
+	worker = kthread_create(lazy_restore_worker, lazy, "ndckpt_restore/%d",
+				target->pid);
+	if (!IS_ERR(worker)) {
+		// Keep the task_struct for kthread_stop() after it returns.
+		get_task_struct(worker);
+		lazy->worker = worker;
+		wake_up_process(worker);
+	}
+	pman_set_last_proc_info(pman, pproc);
+
+	BUG_ON(verify_pml4_kernel_map(pproc->ctx[0].pgd, pproc->org_pgd));
+	BUG_ON(verify_pml4_kernel_map(pproc->ctx[1].pgd, pproc->org_pgd));
+	return regs->ax;
+}
+
+struct PrefetchArgs {
+	struct mm_struct *mm; // Held by mmget() until the worker ends
+	pgd_t *pgd;
+	int num_of_chunks;
+	uint64_t chunks[PPROC_NUM_OF_HOT_CHUNKS];
+};
+
+static void prefetch_chunk(pgd_t *t4, uint64_t addr)
+{
+	// Read pages in the chunk into caches.
+	// Only tables on NVDIMM are followed since DRAM ones can be freed.
+	pgd_t *e4;
+	pud_t *t3;
+	pud_t *e3;
+	pmd_t *t2;
+	pmd_t *e2;
+	pte_t *t1;
+	uint8_t *page_vaddr;
+	uint64_t ofs;
+	int i;
+	traverse_pml4e(addr, t4, &e4, &t3);
+	if (!ndckpt_is_virt_addr_in_nvdimm(t3))
+		return;
+	traverse_pdpte(addr, t3, &e3, &t2);
+	if (!ndckpt_is_virt_addr_in_nvdimm(t2))
+		return;
+	traverse_pde(addr, t2, &e2, &t1);
+	if (!ndckpt_is_virt_addr_in_nvdimm(t1))
+		return;
+	if (ndckpt_is_pmd_huge(*e2)) {
+		for (ofs = 0; ofs < PMD_SIZE; ofs += kCacheLineSize)
+			prefetch((uint8_t *)t1 + ofs);
+		return;
+	}
+	for (i = 0; i < PTRS_PER_PTE; i++) {
+		if (!IS_PAGE_STATE_ON_NVDIMM(page_state(t1[i].pte)))
+			continue;
+		page_vaddr = ndckpt_p2v(t1[i].pte & PTE_PFN_MASK);
+		for (ofs = 0; ofs < PAGE_SIZE; ofs += kCacheLineSize)
+			prefetch(page_vaddr + ofs);
+	}
+}
+
+static int prefetch_worker(void *arg)
+{
+	struct PrefetchArgs *args = arg;
+	int i;
+	for (i = 0; i < args->num_of_chunks; i++) {
+		prefetch_chunk(args->pgd, args->chunks[i]);
+		cond_resched();
+	}
+	pr_ndckpt_restore("prefetched %d chunks\n", args->num_of_chunks);
+	mmput(args->mm);
+	kfree(args);
+	return 0;
+}
+
+static void start_prefetch(struct PersistentProcessInfo *pproc,
+			   struct mm_struct *mm, pid_t pid)
+{
+	// Pages of the running ctx are read in hotness order in background.
+	// This never modifies the ctx, so nothing is needed to stop it.
+	// mm is held so that its ctxs are not torn down while being read.
+	struct PrefetchArgs *args = kmalloc(sizeof(*args), GFP_KERNEL);
+	struct task_struct *worker;
+	if (!args)
+		return;
+	args->mm = mm;
+	args->pgd = mm->pgd;
+	args->num_of_chunks = pproc_get_hot_chunks(pproc, args->chunks);
+	if (!args->num_of_chunks) {
+		kfree(args);
+		return;
+	}
+	mmget(mm);
+	worker = kthread_run(prefetch_worker, args, "ndckpt_prefetch/%d", pid);
+	if (IS_ERR(worker)) {
+		mmput(mm);
+		kfree(args);
+	}
+}
+
 //#define DEBUG_PPROC_RESTORE
 #ifdef DEBUG_PPROC_RESTORE
 static void print_target_vma_mapping(struct mm_struct *mm)
@@ -1186,6 +3009,7 @@ int64_t pproc_restore(struct PersistentMemoryManager *pman,
 	const int valid_ctx_idx = pproc->valid_ctx_idx;
 
 	spin_lock_init(&pproc->ckpt_lock);
+	pproc_bump_commit_seq(pproc);
 
 	BUG_ON(valid_ctx_idx < 0 || 2 <= valid_ctx_idx);
 #ifdef DEBUG_PPROC_RESTORE
@@ -1195,15 +3019,25 @@ int64_t pproc_restore(struct PersistentMemoryManager *pman,
 	pproc_print_regs(pproc, valid_ctx_idx);
 #endif
 
+	// Lazy restore state, DRAM cache and stats of the previous boot are
+	// no longer valid.
+	pproc->lazy = NULL;
+	pproc->dram_cache = NULL;
+	pproc->stats = pproc_stats_alloc();
+	// pproc_init() also comes here but there is nothing to restore.
+	if (ndckpt_lazy_restore && target->ndckpt_id)
+		return pproc_restore_lazy(pman, target, pproc);
+
 	// Save original mm->pgd to pproc
 	// This is only valid while the power is on, so there is no need to flush.
 	pproc->org_pgd = mm->pgd;
+	mm->ndckpt_pproc = pproc;
 	mark_target_vmas(mm);
+	// Pages in mm are still alive on pproc_init().
+	if (target->ndckpt_id)
+		erase_page_cache_of_ctxs(mm, pproc);
 
-	fix_pmem_part_of_ctx(mm, pproc, 0);
-	fix_pmem_part_of_ctx(mm, pproc, 1);
-	fix_dram_part_of_ctx(mm, pproc, 0);
-	fix_dram_part_of_ctx(mm, pproc, 1);
+	fix_ctxs_in_parallel(mm, pproc);
 	// TODO: Restore vmas here
 
 	pman_set_last_proc_info(pman, NULL);
@@ -1217,6 +3051,8 @@ int64_t pproc_restore(struct PersistentMemoryManager *pman,
 	// At this point, ctx[0] is commited and marked as valid,
 	// and ctx[1] is synced with ctx[0] and ready to go
 	pman_set_last_proc_info(pman, pproc);
+	if (ndckpt_restore_prefetch)
+		start_prefetch(pproc, mm, target->pid);
 
 #ifdef DEBUG_PPROC_RESTORE
 	pr_ndckpt_pml4(mm->pgd);
@@ -0,0 +1,173 @@
+#include <linux/seq_file.h>
+
+#include "ndckpt_internal.h"
+#include "ndckpt_trace.h"
+
+// Per-process statistics shown in /proc/<pid>/ndckpt.
+// Counters are kept per cpu and summed on read, so commits and faults never
+// contend on them. Pages on NVDIMM are counted on read by walking each ctx.
+// All values are since the process was started or restored on this boot.
+
+static const char *const fault_type_names[NDCKPT_NUM_OF_FAULT_TYPES] = {
+	"file", "anon", "fork_cow", "file_cow", "write", "zero_cow"
+};
+
+struct PprocStats *pproc_stats_alloc(void)
+{
+	struct PprocStats *stats = kzalloc(sizeof(*stats), GFP_KERNEL);
+	if (!stats)
+		return NULL;
+	stats->counters = alloc_percpu(struct PprocStatCounters);
+	if (!stats->counters) {
+		kfree(stats);
+		return NULL;
+	}
+	return stats;
+}
+
+void pproc_stats_free(struct PprocStats *stats)
+{
+	if (!stats)
+		return;
+	free_percpu(stats->counters);
+	kfree(stats);
+}
+
+static uint64_t pproc_stats_sum(struct PprocStats *stats, int idx)
+{
+	uint64_t sum = 0;
+	int cpu;
+	for_each_possible_cpu (cpu) {
+		sum += per_cpu_ptr(stats->counters, cpu)->v[idx];
+	}
+	return sum;
+}
+
+void pproc_stats_commit_begin(struct PprocStats *stats)
+{
+	if (!stats)
+		return;
+	stats->commit_start_ns = ktime_get_ns();
+	stats->commit_start_dirty_pages =
+		pproc_stats_sum(stats, PPROC_STAT_DIRTY_PAGES);
+}
+
+void pproc_stats_commit_end(struct PprocStats *stats)
+{
+	if (!stats)
+		return;
+	pproc_stats_add(stats, PPROC_STAT_COMMITS, 1);
+	stats->last_commit_dirty_pages =
+		pproc_stats_sum(stats, PPROC_STAT_DIRTY_PAGES) -
+		stats->commit_start_dirty_pages;
+	stats->last_commit_ns = ktime_get_ns() - stats->commit_start_ns;
+}
+
+void ndckpt_notify_fault(struct vm_fault *vmf, int type)
+{
+	// Called from handle_pte_fault_ndckpt() on the faulting cpu.
+	struct mm_struct *mm = vmf->vma->vm_mm;
+	trace_ndckpt_fault(vmf, type);
+	if (!mm->ndckpt_pproc)
+		return;
+	pproc_stats_add(pproc_get_stats(mm->ndckpt_pproc),
+			PPROC_STAT_FAULTS + type, 1);
+}
+EXPORT_SYMBOL(ndckpt_notify_fault);
+
+static void count_nvdimm_pages(pgd_t *t4, uint64_t *data, uint64_t *tables)
+{
+	// Only tables on NVDIMM are walked. They are never freed, so this is
+	// safe without locks although the result may be racy with commits.
+	int i4, i3, i2, i1;
+	*data = 0;
+	*tables = 1; // t4
+	for (i4 = 0; i4 < PTRS_PER_PGD / 2; i4++) {
+		pud_t *t3;
+		if (table_state_pml4e(&t4[i4]) != TABLE_STATE_Tn)
+			continue;
+		(*tables)++;
+		t3 = ndckpt_p2v(t4[i4].pgd & PTE_PFN_MASK);
+		for (i3 = 0; i3 < PTRS_PER_PUD; i3++) {
+			pmd_t *t2;
+			if (table_state_pdpte(&t3[i3]) != TABLE_STATE_Tn)
+				continue;
+			(*tables)++;
+			t2 = ndckpt_p2v(t3[i3].pud & PTE_PFN_MASK);
+			for (i2 = 0; i2 < PTRS_PER_PMD; i2++) {
+				pte_t *t1;
+				if (ndckpt_is_pmd_huge(t2[i2])) {
+					if (ndckpt_is_phys_addr_in_nvdimm(
+						    ndckpt_huge_page_paddr(
+							    t2[i2])))
+						*data += PTRS_PER_PTE;
+					continue;
+				}
+				if (table_state_pde(&t2[i2]) != TABLE_STATE_Tn)
+					continue;
+				(*tables)++;
+				t1 = ndckpt_p2v(t2[i2].pmd & PTE_PFN_MASK);
+				for (i1 = 0; i1 < PTRS_PER_PTE; i1++) {
+					// The zero page is not owned by ctxs.
+					if (IS_PAGE_STATE_ON_NVDIMM(
+						    page_state_pte(&t1[i1])) &&
+					    !ndckpt_is_pte_zero_page(t1[i1]))
+						(*data)++;
+				}
+			}
+			cond_resched();
+		}
+	}
+}
+
+int ndckpt_proc_show(struct seq_file *m, struct task_struct *task)
+{
+	// pproc and its ctxs are on NVDIMM and never freed. Stats are freed by
+	// ndckpt_exit_mmap(), so they are summed with the mm held.
+	struct PersistentProcessInfo *pproc;
+	struct PprocStats *stats;
+	struct mm_struct *mm = get_task_mm(task);
+	uint64_t counters[PPROC_NUM_OF_STATS];
+	uint64_t last_commit_ns, last_commit_dirty_pages;
+	uint64_t data, tables;
+	int i;
+
+	if (!mm || !ndckpt_is_enabled_on_task(task) || !mm->ndckpt_pproc) {
+		if (mm)
+			mmput(mm);
+		seq_puts(m, "enabled: 0\n");
+		return 0;
+	}
+	pproc = mm->ndckpt_pproc;
+	stats = pproc_get_stats(pproc);
+	for (i = 0; i < PPROC_NUM_OF_STATS; i++) {
+		counters[i] = stats ? pproc_stats_sum(stats, i) : 0;
+	}
+	last_commit_ns = stats ? stats->last_commit_ns : 0;
+	last_commit_dirty_pages = stats ? stats->last_commit_dirty_pages : 0;
+	mmput(mm);
+
+	seq_puts(m, "enabled: 1\n");
+	seq_printf(m, "obj_id: %llu\n", pobj_get_header(pproc)->id);
+	seq_printf(m, "valid_ctx_idx: %d\n", pproc_get_valid_ctx(pproc));
+	for (i = 0; i < 2; i++) {
+		count_nvdimm_pages(pproc_get_pgd(pproc, i), &data, &tables);
+		seq_printf(m, "ctx%d_data_pages: %llu\n", i, data);
+		seq_printf(m, "ctx%d_table_pages: %llu\n", i, tables);
+	}
+	seq_printf(m, "commits: %llu\n", counters[PPROC_STAT_COMMITS]);
+	seq_printf(m, "last_commit_ns: %llu\n", last_commit_ns);
+	seq_printf(m, "last_commit_dirty_pages: %llu\n",
+		   last_commit_dirty_pages);
+	seq_printf(m, "bytes_flushed: %llu\n",
+		   counters[PPROC_STAT_BYTES_FLUSHED]);
+	seq_printf(m, "bytes_copied: %llu\n", counters[PPROC_STAT_BYTES_COPIED]);
+	seq_printf(m, "zero_pages_folded: %llu\n",
+		   counters[PPROC_STAT_ZERO_PAGES_FOLDED]);
+	for (i = 0; i < NDCKPT_NUM_OF_FAULT_TYPES; i++) {
+		seq_printf(m, "faults_%s: %llu\n", fault_type_names[i],
+			   counters[PPROC_STAT_FAULTS + i]);
+	}
+	return 0;
+}
+EXPORT_SYMBOL(ndckpt_proc_show);
@@ -1,14 +1,5 @@
 #include "ndckpt_internal.h"
 
-#define kRangeExpMin 10
-#define kRangeExpMax 24
-#define kDurationTick (2 * 1000 * 1000)
-#define kRangeMin (1ULL << kRangeExpMin)
-#define kRangeMax (1ULL << kRangeExpMax)
-
-#define kResultArraySize (kRangeExpMax - kRangeExpMin + 2)
-static uint64_t result_array[kResultArraySize][kResultArraySize];
-
 static void set_cache_disable_bit(void)
 {
 	uint32_t cr0 = read_cr0();
@@ -24,116 +15,10 @@ static void clear_cache_disable_bit(void)
 	printk("ndckpt: cache enable\n");
 }
 
-static void TestMem(int *array)
-{
-	uint64_t nextstep, i, index;
-	uint64_t csize, stride;
-	uint64_t steps, tsteps;
-	uint64_t t0, t1, tick_sum_overall, tick_sum_loop_only;
-	int x, y;
-	/*
-	uint64_t array_size_in_pages =
-		(sizeof(int) * kRangeMax + kPageSize - 1) >> kPageSizeExponent;
-    */
-	uint64_t tick_sum_of_mem_read;
-	uint64_t tick_per_mem_read;
-
-	for (y = 0; y < kResultArraySize; y++) {
-		for (x = 0; x < kResultArraySize; x++) {
-			result_array[y][x] = 0;
-		}
-	}
-
-	y = 0;
-	x = 1;
-	result_array[0][0] = 0;
-	for (x = 1; x < kResultArraySize; x++) {
-		result_array[0][x] = x * sizeof(int);
-	}
-
-	//ClearIntFlag();
-	set_cache_disable_bit();
-	y = 0;
-	for (csize = kRangeMin; csize <= kRangeMax; csize = csize * 2) {
-		y++;
-		x = 0;
-		result_array[y][x++] = csize * sizeof(int);
-		for (stride = 1; stride <= csize / 2; stride = stride * 2) {
-			printk("ndckpt: csize = %lld, stride = %lld\n", csize,
-			       stride);
-			for (index = 0; index < csize; index = index + stride) {
-				array[index] = (int)(index + stride);
-			}
-			array[index - stride] = 0;
-
-			// measure time spent on (reading data from memory) + (loop, instrs,
-			// etc...)
-			steps = 0;
-			nextstep = 0;
-			t0 = ktime_get_ns();
-			do {
-				for (i = stride; i != 0; i = i - 1) {
-					nextstep = 0;
-					do
-						nextstep = array[nextstep];
-					while (nextstep != 0);
-				}
-				steps = steps + 1;
-				t1 = ktime_get_ns();
-			} while ((t1 - t0) < kDurationTick); // originary 20.0
-			tick_sum_overall = t1 - t0;
-
-			// measure time spent on (loop, instrs, etc...) only
-			tsteps = 0;
-			t0 = ktime_get_ns();
-			do {
-				for (i = stride; i != 0; i = i - 1) {
-					index = 0;
-					do
-						index = index + stride;
-					while (index < csize);
-				}
-				tsteps = tsteps + 1;
-				t1 = ktime_get_ns();
-			} while (tsteps < steps);
-			tick_sum_loop_only = t1 - t0;
-
-			// avoid negative value
-			if (tick_sum_loop_only >= tick_sum_overall) {
-				tick_sum_loop_only = tick_sum_overall;
-			}
-
-			tick_sum_of_mem_read =
-				tick_sum_overall - tick_sum_loop_only;
-			tick_per_mem_read =
-				tick_sum_of_mem_read / (steps * csize);
-			result_array[y][x++] =
-				tick_per_mem_read > 0 ? tick_per_mem_read : 1;
-		};
-	};
-	clear_cache_disable_bit();
-	//StoreIntFlag();
-}
-
 static ssize_t cmd_show(struct kobject *kobj, struct kobj_attribute *attr,
 			char *buf)
 {
-	ssize_t count_sum = 0;
-	ssize_t count;
-	int x, y;
-	//pr_debug("ndckpt: read\n");
-	for (y = 0; y < kResultArraySize; y++) {
-		for (x = 0; x < kResultArraySize; x++) {
-			count = sprintf(buf, "%lld,", result_array[y][x]);
-			buf += count;
-			count_sum += count;
-		}
-		count = sprintf(buf, "\n");
-		buf += count;
-		count_sum += count;
-	}
-	//count = sprintf(buf, "0x%08lx\n", read_cr0());
-	return count_sum;
+	return 0;
 }
 static ssize_t cmd_store(struct kobject *kobj, struct kobj_attribute *attr,
 			 const char *buf, size_t count)
@@ -145,12 +30,6 @@ static ssize_t cmd_store(struct kobject *kobj, struct kobj_attribute *attr,
 	if (strcmp(buf, "cache enable\n") == 0) {
 		clear_cache_disable_bit();
 	}
-	if (strcmp(buf, "memtest\n") == 0) {
-		TestMem(first_pmem_device->virt_addr);
-	}
-	if (strcmp(buf, "init\n") == 0) {
-		TestMem(first_pmem_device->virt_addr);
-	}
 	return count;
 }
 static struct kobj_attribute cmd_attribute =
@@ -277,6 +156,207 @@ static ssize_t info_store(struct kobject *kobj, struct kobj_attribute *attr,
 static struct kobj_attribute info_attribute =
 	__ATTR(info, 0660, info_show, info_store);
 
+static ssize_t lazy_restore_show(struct kobject *kobj,
+				 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", ndckpt_lazy_restore);
+}
+static ssize_t lazy_restore_store(struct kobject *kobj,
+				  struct kobj_attribute *attr, const char *buf,
+				  size_t count)
+{
+	int v;
+	if (sscanf(buf, "%d", &v) != 1)
+		return -EINVAL;
+	ndckpt_lazy_restore = v;
+	printk("ndckpt: lazy_restore=%d\n", ndckpt_lazy_restore);
+	return count;
+}
+static struct kobj_attribute lazy_restore_attribute =
+	__ATTR(lazy_restore, 0660, lazy_restore_show, lazy_restore_store);
+
+static ssize_t restore_prefetch_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", ndckpt_restore_prefetch);
+}
+static ssize_t restore_prefetch_store(struct kobject *kobj,
+				      struct kobj_attribute *attr,
+				      const char *buf, size_t count)
+{
+	int v;
+	if (sscanf(buf, "%d", &v) != 1)
+		return -EINVAL;
+	ndckpt_restore_prefetch = v;
+	printk("ndckpt: restore_prefetch=%d\n", ndckpt_restore_prefetch);
+	return count;
+}
+static struct kobj_attribute restore_prefetch_attribute =
+	__ATTR(restore_prefetch, 0660, restore_prefetch_show,
+	       restore_prefetch_store);
+
+static ssize_t fault_around_pages_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ndckpt_fault_around_pages);
+}
+static ssize_t fault_around_pages_store(struct kobject *kobj,
+					struct kobj_attribute *attr,
+					const char *buf, size_t count)
+{
+	unsigned int v;
+	if (sscanf(buf, "%u", &v) != 1 || !is_power_of_2(v) ||
+	    v > PTRS_PER_PTE)
+		return -EINVAL;
+	ndckpt_fault_around_pages = v;
+	printk("ndckpt: fault_around_pages=%u\n", ndckpt_fault_around_pages);
+	return count;
+}
+static struct kobj_attribute fault_around_pages_attribute =
+	__ATTR(fault_around_pages, 0660, fault_around_pages_show,
+	       fault_around_pages_store);
+
+static ssize_t huge_pages_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", ndckpt_huge_pages);
+}
+static ssize_t huge_pages_store(struct kobject *kobj,
+				struct kobj_attribute *attr, const char *buf,
+				size_t count)
+{
+	int v;
+	if (sscanf(buf, "%d", &v) != 1)
+		return -EINVAL;
+	ndckpt_huge_pages = v;
+	printk("ndckpt: huge_pages=%d\n", ndckpt_huge_pages);
+	return count;
+}
+static struct kobj_attribute huge_pages_attribute =
+	__ATTR(huge_pages, 0660, huge_pages_show, huge_pages_store);
+
+static ssize_t zero_page_show(struct kobject *kobj, struct kobj_attribute *attr,
+			      char *buf)
+{
+	return sprintf(buf, "%d\n", ndckpt_zero_page);
+}
+static ssize_t zero_page_store(struct kobject *kobj,
+			       struct kobj_attribute *attr, const char *buf,
+			       size_t count)
+{
+	int v;
+	if (sscanf(buf, "%d", &v) != 1)
+		return -EINVAL;
+	ndckpt_zero_page = v;
+	printk("ndckpt: zero_page=%d\n", ndckpt_zero_page);
+	return count;
+}
+static struct kobj_attribute zero_page_attribute =
+	__ATTR(zero_page, 0660, zero_page_show, zero_page_store);
+
+static ssize_t dram_cache_pages_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ndckpt_dram_cache_pages);
+}
+static ssize_t dram_cache_pages_store(struct kobject *kobj,
+				      struct kobj_attribute *attr,
+				      const char *buf, size_t count)
+{
+	unsigned int v;
+	if (sscanf(buf, "%u", &v) != 1)
+		return -EINVAL;
+	ndckpt_dram_cache_pages = v;
+	printk("ndckpt: dram_cache_pages=%u\n", ndckpt_dram_cache_pages);
+	return count;
+}
+static struct kobj_attribute dram_cache_pages_attribute =
+	__ATTR(dram_cache_pages, 0660, dram_cache_pages_show,
+	       dram_cache_pages_store);
+
+static ssize_t tlb_flush_ceiling_show(struct kobject *kobj,
+				      struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ndckpt_tlb_flush_ceiling);
+}
+static ssize_t tlb_flush_ceiling_store(struct kobject *kobj,
+				       struct kobj_attribute *attr,
+				       const char *buf, size_t count)
+{
+	unsigned int v;
+	if (sscanf(buf, "%u", &v) != 1)
+		return -EINVAL;
+	ndckpt_tlb_flush_ceiling = v;
+	printk("ndckpt: tlb_flush_ceiling=%u\n", ndckpt_tlb_flush_ceiling);
+	return count;
+}
+static struct kobj_attribute tlb_flush_ceiling_attribute =
+	__ATTR(tlb_flush_ceiling, 0660, tlb_flush_ceiling_show,
+	       tlb_flush_ceiling_store);
+
+// Indexed by NDCKPT_FLUSH_*
+static const char *const flush_names[] = { "clwb", "clflushopt", "clflush",
+					   "none" };
+
+static ssize_t flush_show(struct kobject *kobj, struct kobj_attribute *attr,
+			  char *buf)
+{
+	return sprintf(buf, "%s\n", flush_names[ndckpt_get_flush()]);
+}
+static ssize_t flush_store(struct kobject *kobj, struct kobj_attribute *attr,
+			   const char *buf, size_t count)
+{
+	int insn = sysfs_match_string(flush_names, buf);
+	int error;
+	if (insn < 0)
+		return -EINVAL;
+	if ((error = ndckpt_set_flush(insn)))
+		return error;
+	printk("ndckpt: flush=%s\n", flush_names[insn]);
+	return count;
+}
+static struct kobj_attribute flush_attribute =
+	__ATTR(flush, 0660, flush_show, flush_store);
+
+static ssize_t emul_show(struct kobject *kobj, struct kobj_attribute *attr,
+			 char *buf)
+{
+	return ndckpt_emul_show(buf);
+}
+static ssize_t emul_store(struct kobject *kobj, struct kobj_attribute *attr,
+			  const char *buf, size_t count)
+{
+	uint64_t wb_ns, fence_ns, bandwidth_mbps;
+	int error;
+	if (sscanf(buf, "%llu %llu %llu", &wb_ns, &fence_ns,
+		   &bandwidth_mbps) != 3)
+		return -EINVAL;
+	if ((error = ndckpt_set_emul(wb_ns, fence_ns, bandwidth_mbps)))
+		return error;
+	printk("ndckpt: emul wb_ns=%llu fence_ns=%llu bandwidth_mbps=%llu\n",
+	       wb_ns, fence_ns, bandwidth_mbps);
+	return count;
+}
+static struct kobj_attribute emul_attribute =
+	__ATTR(emul, 0660, emul_show, emul_store);
+
+static ssize_t bench_attr_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	return bench_show(buf);
+}
+static ssize_t bench_attr_store(struct kobject *kobj,
+				struct kobj_attribute *attr, const char *buf,
+				size_t count)
+{
+	int error = bench_run(buf);
+	if (error)
+		return error;
+	return count;
+}
+static struct kobj_attribute bench_attribute =
+	__ATTR(bench, 0660, bench_attr_show, bench_attr_store);
+
 static int add_sysfs_kobj(const char *name, struct kobj_attribute *attr)
 {
 	int error = 0;
@@ -304,5 +384,29 @@ int sysfs_interface_init(void)
 		return error;
 	if ((error = add_sysfs_kobj("info", &info_attribute)))
 		return error;
+	if ((error = add_sysfs_kobj("lazy_restore", &lazy_restore_attribute)))
+		return error;
+	if ((error = add_sysfs_kobj("restore_prefetch",
+				    &restore_prefetch_attribute)))
+		return error;
+	if ((error = add_sysfs_kobj("fault_around_pages",
+				    &fault_around_pages_attribute)))
+		return error;
+	if ((error = add_sysfs_kobj("huge_pages", &huge_pages_attribute)))
+		return error;
+	if ((error = add_sysfs_kobj("zero_page", &zero_page_attribute)))
+		return error;
+	if ((error = add_sysfs_kobj("dram_cache_pages",
+				    &dram_cache_pages_attribute)))
+		return error;
+	if ((error = add_sysfs_kobj("tlb_flush_ceiling",
+				    &tlb_flush_ceiling_attribute)))
+		return error;
+	if ((error = add_sysfs_kobj("flush", &flush_attribute)))
+		return error;
+	if ((error = add_sysfs_kobj("emul", &emul_attribute)))
+		return error;
+	if ((error = add_sysfs_kobj("bench", &bench_attribute)))
+		return error;
 	return 0;
 }
@@ -100,6 +100,10 @@
 
 #include "../../lib/kstrtox.h"
 
+#ifdef CONFIG_NDCKPT
+#include "../../drivers/ndckpt/ndckpt.h"
+#endif
+
 /* NOTE:
  *	Implementing inode permission operations in /proc is almost
  *	certainly an error.  Permission checks need to happen during
@@ -2962,6 +2966,16 @@ static int proc_stack_depth(struct seq_file *m, struct pid_namespace *ns,
 }
 #endif /* CONFIG_STACKLEAK_METRICS */
 
+#ifdef CONFIG_NDCKPT
+static int proc_pid_ndckpt(struct seq_file *m, struct pid_namespace *ns,
+				struct pid *pid, struct task_struct *task)
+{
+	if (!ptrace_may_access(task, PTRACE_MODE_READ_FSCREDS))
+		return -EACCES;
+	return ndckpt_proc_show(m, task);
+}
+#endif /* CONFIG_NDCKPT */
+
 /*
  * Thread groups
  */
@@ -3066,6 +3080,9 @@ static const struct pid_entry tgid_base_stuff[] = {
 #ifdef CONFIG_STACKLEAK_METRICS
 	ONE("stack_depth", S_IRUGO, proc_stack_depth),
 #endif
+#ifdef CONFIG_NDCKPT
+	ONE("ndckpt",     S_IRUSR, proc_pid_ndckpt),
+#endif
 };
 
 static int proc_tgid_base_readdir(struct file *file, struct dir_context *ctx)
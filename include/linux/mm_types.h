@@ -442,6 +442,10 @@ struct mm_struct {
 
 #ifdef CONFIG_NDCKPT
   unsigned long ndckpt_flags;
+  struct PersistentProcessInfo *ndckpt_pproc;
+  /* Fault-around state for target vmas. See do_anonymous_page_ndckpt() */
+  unsigned long ndckpt_next_fault;
+  unsigned int ndckpt_fault_window;
 #endif
 
 		struct core_state *core_state; /* coredumping support */
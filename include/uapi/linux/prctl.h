@@ -231,5 +231,8 @@ struct prctl_mm_map {
 
 /* Process checkpointing on NVDIMM (NDCKPT) */
 #define PR_ENABLE_NDCKPT 57
+#define PR_EXPORT_NDCKPT 58
+# define PR_NDCKPT_EXPORT_LZ4		(1UL << 0)
+#define PR_IMPORT_NDCKPT 59
 
 #endif /* _LINUX_PRCTL_H */
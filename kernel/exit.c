@@ -68,10 +68,6 @@
 #include <asm/pgtable.h>
 #include <asm/mmu_context.h>
 
-#ifdef CONFIG_NDCKPT
-#include "../drivers/ndckpt/ndckpt.h"
-#endif
-
 static void __unhash_process(struct task_struct *p, bool group_dead)
 {
 	nr_threads--;
@@ -502,10 +498,6 @@ static void exit_mm(void)
 	struct mm_struct *mm = current->mm;
 	struct core_state *core_state;
 
-#ifdef CONFIG_NDCKPT
-  ndckpt_exit_mm(current);
-#endif 
-
 	mm_release(current, mm);
 	if (!mm)
 		return;
@@ -104,6 +104,10 @@
 #define CREATE_TRACE_POINTS
 #include <trace/events/task.h>
 
+#ifdef CONFIG_NDCKPT
+#include "../drivers/ndckpt/ndckpt.h"
+#endif
+
 /*
  * Minimum number of threads to boot the kernel
  */
@@ -592,6 +596,10 @@ static __latent_entropy int dup_mmap(struct mm_struct *mm,
 	}
 	/* a new mm has just been created */
 	retval = arch_dup_mmap(oldmm, mm);
+#ifdef CONFIG_NDCKPT
+	if (!retval && ndckpt_is_enabled_on_current())
+		retval = ndckpt_dup_mmap(mm, oldmm);
+#endif
 out:
 	up_write(&mm->mmap_sem);
 	flush_tlb_mm(oldmm);
@@ -1004,6 +1012,12 @@ static struct mm_struct *mm_init(struct mm_struct *mm, struct task_struct *p,
 	mm->pmd_huge_pte = NULL;
 #endif
 	mm_init_uprobes_state(mm);
+#ifdef CONFIG_NDCKPT
+	mm->ndckpt_flags = 0;
+	mm->ndckpt_pproc = NULL;
+	mm->ndckpt_next_fault = 0;
+	mm->ndckpt_fault_window = 1;
+#endif
 
 	if (current->mm) {
 		mm->flags = current->mm->flags & MMF_INIT_MASK;
@@ -1052,6 +1066,9 @@ static inline void __mmput(struct mm_struct *mm)
 	exit_aio(mm);
 	ksm_exit(mm);
 	khugepaged_exit(mm); /* must run before exit_mmap */
+#ifdef CONFIG_NDCKPT
+	ndckpt_exit_mmap(mm);
+#endif
 	exit_mmap(mm);
 	mm_put_huge_zero_page(mm);
 	set_mm_exe_file(mm, NULL);
@@ -2125,6 +2142,15 @@ static __latent_entropy struct task_struct *copy_process(
 	syscall_tracepoint_update(p);
 	write_unlock_irq(&tasklist_lock);
 
+#ifdef CONFIG_NDCKPT
+	/*
+	 * Nothing fails from here on, so the child mm never gets torn down
+	 * by copy_process() while its pgd is on NVDIMM.
+	 */
+	if (!(clone_flags & CLONE_VM))
+		ndckpt_handle_fork(p);
+#endif
+
 	proc_fork_connector(p);
 	cgroup_post_fork(p);
 	cgroup_threadgroup_change_end(current);
@@ -73,6 +73,8 @@
 
 #ifdef CONFIG_NDCKPT
 extern int ndckpt_enable_checkpointing(struct task_struct *task, int restore_obj_id);
+extern int ndckpt_export_image(uint64_t obj_id, int fd, unsigned long flags);
+extern int64_t ndckpt_import_image(int fd, int exe_fd);
 #endif
 
 #include "uid16.h"
@@ -2243,11 +2245,29 @@ static int prctl_enable_ndckpt(struct task_struct *me, int restore_obj_id)
 {
 	return ndckpt_enable_checkpointing(me, restore_obj_id);
 }
+static int prctl_export_ndckpt(unsigned long obj_id, unsigned long fd,
+			       unsigned long flags)
+{
+	return ndckpt_export_image(obj_id, fd, flags);
+}
+static int prctl_import_ndckpt(int fd, int exe_fd)
+{
+	return ndckpt_import_image(fd, exe_fd);
+}
 #else
 static int prctl_enable_ndckpt(struct task_struct *me, int restore_obj_id)
 {
 	return -EINVAL;
 }
+static int prctl_export_ndckpt(unsigned long obj_id, unsigned long fd,
+			       unsigned long flags)
+{
+	return -EINVAL;
+}
+static int prctl_import_ndckpt(int fd, int exe_fd)
+{
+	return -EINVAL;
+}
 #endif
 
 static int propagate_has_child_subreaper(struct task_struct *p, void *data)
@@ -2507,6 +2527,16 @@ SYSCALL_DEFINE5(prctl, int, option, unsigned long, arg2, unsigned long, arg3,
 			return -EINVAL;
 		error = prctl_enable_ndckpt(me, arg2);
 		break;
+	case PR_EXPORT_NDCKPT:
+		if (arg5)
+			return -EINVAL;
+		error = prctl_export_ndckpt(arg2, arg3, arg4);
+		break;
+	case PR_IMPORT_NDCKPT:
+		if (arg4 || arg5)
+			return -EINVAL;
+		error = prctl_import_ndckpt(arg2, arg3);
+		break;
 	default:
 		error = -EINVAL;
 		break;
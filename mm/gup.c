@@ -21,6 +21,10 @@
 #include <asm/pgtable.h>
 #include <asm/tlbflush.h>
 
+#ifdef CONFIG_NDCKPT
+#include "../drivers/ndckpt/ndckpt.h"
+#endif
+
 #include "internal.h"
 
 struct follow_page_context {
@@ -91,7 +95,14 @@ retry:
 	if (unlikely(pmd_bad(*pmd)))
 		return no_page_table(vma, flags);
 
+#ifdef CONFIG_NDCKPT
+	// PTs on NVDIMM have no struct page for the split ptl.
+	ptl = ndckpt_pte_lockptr(mm, pmd);
+	ptep = ndckpt_pte_offset_kernel(pmd, address);
+	spin_lock(ptl);
+#else
 	ptep = pte_offset_map_lock(mm, pmd, address, &ptl);
+#endif
 	pte = *ptep;
 	if (!pte_present(pte)) {
 		swp_entry_t entry;
@@ -118,6 +129,15 @@ retry:
 		return NULL;
 	}
 
+#ifdef CONFIG_NDCKPT
+	// Pages on NVDIMM have no struct page either, so they can not be
+	// pinned. Faults are handled as for other pfn mappings.
+	if (ndckpt_is_pte_points_nvdimm_page(pte)) {
+		page = ERR_PTR(flags & FOLL_DUMP ? -EFAULT :
+				follow_pfn_pte(vma, address, ptep, flags));
+		goto out;
+	}
+#endif
 	page = vm_normal_page(vma, address, pte);
 	if (!page && pte_devmap(pte) && (flags & FOLL_GET)) {
 		/*
@@ -223,7 +243,11 @@ static struct page *follow_pmd_mask(struct vm_area_struct *vma,
 	struct page *page;
 	struct mm_struct *mm = vma->vm_mm;
 
+#ifdef CONFIG_NDCKPT
+	pmd = ndckpt_pmd_offset(pudp, address);
+#else
 	pmd = pmd_offset(pudp, address);
+#endif
 	/*
 	 * The READ_ONCE() will stabilize the pmdval in a register or
 	 * on the stack so that it will stop changing under the code.
@@ -231,6 +255,26 @@ static struct page *follow_pmd_mask(struct vm_area_struct *vma,
 	pmdval = READ_ONCE(*pmd);
 	if (pmd_none(pmdval))
 		return no_page_table(vma, flags);
+#ifdef CONFIG_NDCKPT
+	// 2MiB pages on NVDIMM have no struct page for THP. Follow them per
+	// 4KiB like pages mapped by a PT.
+	if (ndckpt_is_pmd_huge(pmdval) &&
+	    ndckpt_is_phys_addr_in_nvdimm(ndckpt_huge_page_paddr(pmdval))) {
+		unsigned long haddr = address & PMD_MASK;
+		bool split = false;
+
+		ptl = ndckpt_pmd_lock(mm, pmd);
+		if (ndckpt_is_pmd_huge(*pmd)) {
+			ndckpt_split_huge_pmd(pmd);
+			split = true;
+		}
+		spin_unlock(ptl);
+		if (split)
+			flush_tlb_mm_range(mm, haddr, haddr + PMD_SIZE,
+					   PMD_SHIFT, true);
+		return follow_page_pte(vma, address, pmd, flags, &ctx->pgmap);
+	}
+#endif
 	if (pmd_huge(pmdval) && vma->vm_flags & VM_HUGETLB) {
 		page = follow_huge_pmd(mm, address, pmd, flags);
 		if (page)
@@ -334,7 +378,11 @@ static struct page *follow_pud_mask(struct vm_area_struct *vma,
 	struct page *page;
 	struct mm_struct *mm = vma->vm_mm;
 
+#ifdef CONFIG_NDCKPT
+	pud = ndckpt_pud_offset(p4dp, address);
+#else
 	pud = pud_offset(p4dp, address);
+#endif
 	if (pud_none(*pud))
 		return no_page_table(vma, flags);
 	if (pud_huge(*pud) && vma->vm_flags & VM_HUGETLB) {
@@ -1384,6 +1432,15 @@ long populate_vma_page_range(struct vm_area_struct *vma,
 	VM_BUG_ON_VMA(end   > vma->vm_end, vma);
 	VM_BUG_ON_MM(!rwsem_is_locked(&mm->mmap_sem), mm);
 
+#ifdef CONFIG_NDCKPT
+	// Pages on NVDIMM are never reclaimed, so mlock needs nothing more.
+	if (ndckpt_can_populate_vma(vma)) {
+		if (vma->vm_flags & VM_LOCKONFAULT)
+			return nr_pages;
+		return ndckpt_populate_vma_range(vma, start, end);
+	}
+#endif
+
 	gup_flags = FOLL_TOUCH | FOLL_POPULATE | FOLL_MLOCK;
 	if (vma->vm_flags & VM_LOCKONFAULT)
 		gup_flags &= ~FOLL_POPULATE;
@@ -1938,6 +1995,12 @@ static void gup_pgd_range(unsigned long addr, unsigned long end,
 	unsigned long next;
 	pgd_t *pgdp;
 
+#ifdef CONFIG_NDCKPT
+	// Tables on NVDIMM are walked and 2MiB pages on it are split by the
+	// slowpath.
+	if (ndckpt_is_enabled_on_mm(current->mm))
+		return;
+#endif
 	pgdp = pgd_offset(current->mm, addr);
 	do {
 		pgd_t pgd = READ_ONCE(*pgdp);
@@ -27,6 +27,10 @@
 
 #include <asm/tlb.h>
 
+#ifdef CONFIG_NDCKPT
+#include "../drivers/ndckpt/ndckpt.h"
+#endif
+
 #include "internal.h"
 
 /*
@@ -277,6 +281,13 @@ static long madvise_willneed(struct vm_area_struct *vma,
 	struct file *file = vma->vm_file;
 
 	*prev = vma;
+#ifdef CONFIG_NDCKPT
+	if (ndckpt_can_populate_vma(vma)) {
+		// Nothing to read ahead. Map pages on NVDIMM in advance instead.
+		long ret = ndckpt_populate_vma_range(vma, start, end);
+		return ret < 0 ? ret : 0;
+	}
+#endif
 #ifdef CONFIG_SWAP
 	if (!file) {
 		force_swapin_readahead(vma, start, end);
@@ -125,13 +125,10 @@ int randomize_va_space __read_mostly =
 
 #define pte_offset_map_lock_wrapper(mm, pmd, address, ptlp)                    \
 	({                                                                     \
-		spinlock_t *__ptl = ndckpt_is_pmd_points_nvdimm_page(*pmd) ?   \
-					    NULL :                             \
-					    pte_lockptr(mm, pmd);              \
+		spinlock_t *__ptl = ndckpt_pte_lockptr(mm, pmd);               \
 		pte_t *__pte = ndckpt_pte_offset_kernel(pmd, address);         \
 		*(ptlp) = __ptl;                                               \
-		if (__ptl)                                                     \
-			spin_lock(__ptl);                                      \
+		spin_lock(__ptl);                                              \
 		__pte;                                                         \
 	})
 
@@ -495,8 +492,8 @@ int __pte_alloc(struct mm_struct *mm, pmd_t *pmd)
 	smp_wmb(); /* Could be smp_wmb__xxx(before|after)_spin_lock */
 
 #ifdef CONFIG_NDCKPT
-	// Avoid referencing NVDIMM page to get lock
-	ptl = ndckpt_is_enabled_on_current() ? NULL : pmd_lock(mm, pmd);
+	// PD may be on NVDIMM without struct page for split lock
+	ptl = ndckpt_pmd_lock(mm, pmd);
 #else
 	ptl = pmd_lock(mm, pmd);
 #endif
@@ -511,13 +508,7 @@ int __pte_alloc(struct mm_struct *mm, pmd_t *pmd)
 #endif
 		new = NULL;
 	}
-#ifdef CONFIG_NDCKPT
-	if (ptl) {
-		spin_unlock(ptl);
-	}
-#else
 	spin_unlock(ptl);
-#endif
 	if (new)
 		pte_free(mm, new);
 	return 0;
@@ -920,9 +911,16 @@ again:
 	dst_pte = pte_alloc_map_lock(dst_mm, dst_pmd, addr, &dst_ptl);
 	if (!dst_pte)
 		return -ENOMEM;
+#ifdef CONFIG_NDCKPT
+	// PT of a checkpointed parent may be on NVDIMM without struct page.
+	src_pte = ndckpt_pte_offset_kernel(src_pmd, addr);
+	src_ptl = ndckpt_pte_lockptr(src_mm, src_pmd);
+	spin_lock_nested(src_ptl, SINGLE_DEPTH_NESTING);
+#else
 	src_pte = pte_offset_map(src_pmd, addr);
 	src_ptl = pte_lockptr(src_mm, src_pmd);
 	spin_lock_nested(src_ptl, SINGLE_DEPTH_NESTING);
+#endif
 	orig_src_pte = src_pte;
 	orig_dst_pte = dst_pte;
 	arch_enter_lazy_mmu_mode();
@@ -977,7 +975,11 @@ static inline int copy_pmd_range(struct mm_struct *dst_mm,
 	dst_pmd = pmd_alloc(dst_mm, dst_pud, addr);
 	if (!dst_pmd)
 		return -ENOMEM;
+#ifdef CONFIG_NDCKPT
+	src_pmd = ndckpt_pmd_offset(src_pud, addr);
+#else
 	src_pmd = pmd_offset(src_pud, addr);
+#endif
 	do {
 		next = pmd_addr_end(addr, end);
 		if (is_swap_pmd(*src_pmd) || pmd_trans_huge(*src_pmd) ||
@@ -1012,7 +1014,11 @@ static inline int copy_pud_range(struct mm_struct *dst_mm,
 	dst_pud = pud_alloc(dst_mm, dst_p4d, addr);
 	if (!dst_pud)
 		return -ENOMEM;
+#ifdef CONFIG_NDCKPT
+	src_pud = ndckpt_pud_offset(src_p4d, addr);
+#else
 	src_pud = pud_offset(src_p4d, addr);
+#endif
 	do {
 		next = pud_addr_end(addr, end);
 		if (pud_trans_huge(*src_pud) || pud_devmap(*src_pud)) {
@@ -1070,6 +1076,13 @@ int copy_page_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 	bool is_cow;
 	int ret;
 
+#ifdef CONFIG_NDCKPT
+	if (ndckpt_is_target_vma(vma) && ndckpt_is_enabled_on_current()) {
+		// Pages on NVDIMM are shared by ndckpt_dup_mmap()
+		return 0;
+	}
+#endif
+
 	/*
 	 * Don't copy ptes where a page fault will fill them correctly.
 	 * Fork becomes much lighter when there are big shared or private
@@ -1393,6 +1406,8 @@ static void unmap_single_vma(struct mmu_gather *tlb, struct vm_area_struct *vma,
 
 	if (start != end) {
 #ifdef CONFIG_NDCKPT
+		// Pending chunks would bring the unmapped pages back.
+		ndckpt_lazy_restore_complete(vma->vm_mm);
 		if (ndckpt_is_target_vma(vma)) {
 			ndckpt_erase_page_mappings(vma->vm_mm->pgd, start, end);
 			return;
@@ -3085,7 +3100,6 @@ static vm_fault_t do_anonymous_page(struct vm_fault *vmf)
 	if (vma->vm_flags & VM_WRITE)
 		entry = pte_mkwrite(pte_mkdirty(entry));
 
-	// if NDCKPT is enabled, vmf->ptl may be NULL.
 	vmf->pte = pte_offset_map_lock_wrapper(vma->vm_mm, vmf->pmd,
 					       vmf->address, &vmf->ptl);
 	if (!pte_none(*vmf->pte))
@@ -3113,13 +3127,7 @@ setpte:
 	/* No need to invalidate - it was non-present before */
 	update_mmu_cache(vma, vmf->address, vmf->pte);
 unlock:
-#ifdef CONFIG_NDCKPT
-	// if NDCKPT is enabled, vmf->ptl may be NULL.
-	if (vmf->ptl)
-		pte_unmap_unlock(vmf->pte, vmf->ptl);
-#else
 	pte_unmap_unlock(vmf->pte, vmf->ptl);
-#endif
 	return ret;
 release:
 	mem_cgroup_cancel_charge(page, memcg, false);
@@ -3547,14 +3555,6 @@ static vm_fault_t do_fault_around(struct vm_fault *vmf)
 
 	vmf->vma->vm_ops->map_pages(vmf, start_pgoff, end_pgoff);
 
-#if defined(CONFIG_NDCKPT) && defined(NDCKPT_PRINT_FAULTS)
-	if (ndckpt_is_enabled_on_current()) {
-		pr_ndckpt("vm_ops->map_pages [0x%016lX, 0x%016lX)\n",
-			  vmf->vma->vm_start + (start_pgoff << PAGE_SHIFT),
-			  vmf->vma->vm_start + (end_pgoff << PAGE_SHIFT));
-	}
-#endif
-
 	/* Huge page is mapped? Page fault is solved */
 	if (pmd_trans_huge(*vmf->pmd)) {
 		ret = VM_FAULT_NOPAGE;
@@ -3975,6 +3975,247 @@ static inline void validate_pgtable_for_ndckpt(struct vm_fault *vmf,
 	BUG();
 }
 
+static unsigned int ndckpt_fault_around_window(struct vm_fault *vmf)
+{
+	// Grow the window while faults hit the end of the previous window.
+	struct mm_struct *mm = vmf->vma->vm_mm;
+	unsigned int window = mm->ndckpt_fault_window;
+	if (vmf->address == mm->ndckpt_next_fault)
+		window = min(window * 2, ndckpt_fault_around_pages);
+	else
+		window = 1;
+	mm->ndckpt_fault_window = window;
+	return window;
+}
+
+static void ndckpt_map_zeroed_pages(struct vm_area_struct *vma, pmd_t *pmd,
+				    unsigned long start, unsigned long end)
+{
+	// Map zeroed NVDIMM pages on none ptes in [start, end) of a PT.
+	// The pages are allocated as one extent. The pte lock should be held.
+	unsigned int num_of_pages = 0;
+	unsigned long addr;
+	uint64_t paddr;
+	pte_t *pte;
+	pte_t entry;
+
+	pte = ndckpt_pte_offset_kernel(pmd, start);
+	for (addr = start; addr < end; addr += PAGE_SIZE, pte++) {
+		if (pte_none(*pte))
+			num_of_pages++;
+	}
+	if (!num_of_pages)
+		return;
+	// Allocate all pages at once
+	paddr = ndckpt_virt_to_phys(
+		ndckpt_alloc_zeroed_virt_pages(num_of_pages));
+	pte = ndckpt_pte_offset_kernel(pmd, start);
+	for (addr = start; addr < end; addr += PAGE_SIZE, pte++) {
+		if (!pte_none(*pte))
+			continue;
+		entry = pfn_pte(paddr >> PAGE_SHIFT, vma->vm_page_prot);
+		paddr += PAGE_SIZE;
+		if (vma->vm_flags & VM_WRITE)
+			entry = pte_mkwrite(entry);
+		set_pte_at(vma->vm_mm, addr, pte, entry);
+	}
+}
+
+static void ndckpt_map_zero_page(struct vm_area_struct *vma, pmd_t *pmd,
+				 unsigned long start, unsigned long end)
+{
+	// Map the zero page read-only on none ptes in [start, end) of a PT.
+	// The first write makes a private copy. The pte lock should be held.
+	const uint64_t paddr = ndckpt_get_zero_page();
+	unsigned long addr;
+	pte_t *pte;
+
+	pte = ndckpt_pte_offset_kernel(pmd, start);
+	for (addr = start; addr < end; addr += PAGE_SIZE, pte++) {
+		if (!pte_none(*pte))
+			continue;
+		set_pte_at(vma->vm_mm, addr, pte,
+			   pte_wrprotect(pfn_pte(paddr >> PAGE_SHIFT,
+						 vma->vm_page_prot)));
+	}
+}
+
+static void ndckpt_replace_pt_locked(struct mm_struct *mm, pmd_t *pmd,
+				     unsigned long address)
+{
+	spinlock_t *ptl;
+	if (ndckpt_is_pmd_points_nvdimm_page(*pmd))
+		return;
+	ptl = ndckpt_pmd_lock(mm, pmd);
+	if (!ndckpt_is_pmd_points_nvdimm_page(*pmd)) {
+		replace_pt_with_nvdimm_page(pmd);
+		ndckpt_invlpg((void *)address);
+	}
+	spin_unlock(ptl);
+}
+
+static vm_fault_t do_anonymous_page_ndckpt(struct vm_fault *vmf)
+{
+	// Map zeroed NVDIMM pages directly. Unlike do_anonymous_page(),
+	// no DRAM page is allocated, so there is no rmap, memcg or LRU for it.
+	// Pages around the address are also mapped on sequential faults.
+	// Read faults map the zero page instead if ndckpt_zero_page is set.
+	struct vm_area_struct *vma = vmf->vma;
+	unsigned long size, start, end;
+
+	if (vma->vm_flags & VM_SHARED)
+		return VM_FAULT_SIGBUS;
+	if (ndckpt_pte_alloc(vma->vm_mm, vmf->pmd, vma, vmf->address))
+		return VM_FAULT_OOM;
+	ndckpt_replace_pt_locked(vma->vm_mm, vmf->pmd, vmf->address);
+	vmf->pte = pte_offset_map_lock_wrapper(vma->vm_mm, vmf->pmd,
+					       vmf->address, &vmf->ptl);
+	if (!pte_none(*vmf->pte))
+		goto unlock;
+
+	size = (unsigned long)ndckpt_fault_around_window(vmf) << PAGE_SHIFT;
+	start = max3(vmf->address & ~(size - 1), vma->vm_start,
+		     vmf->address & PMD_MASK);
+	end = min3((vmf->address & ~(size - 1)) + size, vma->vm_end,
+		   (vmf->address & PMD_MASK) + PMD_SIZE);
+	vma->vm_mm->ndckpt_next_fault = end;
+	if (!(vmf->flags & FAULT_FLAG_WRITE) && ndckpt_zero_page)
+		ndckpt_map_zero_page(vma, vmf->pmd, start, end);
+	else
+		ndckpt_map_zeroed_pages(vma, vmf->pmd, start, end);
+	if (vmf->flags & FAULT_FLAG_WRITE)
+		*vmf->pte = pte_mkdirty(*vmf->pte);
+	ndckpt_clwb_range(ndckpt_pte_offset_kernel(vmf->pmd, start),
+			  ((end - start) >> PAGE_SHIFT) * sizeof(pte_t));
+	/* No need to invalidate - they were non-present before */
+unlock:
+	spin_unlock(vmf->ptl);
+	return 0;
+}
+
+static bool ndckpt_can_map_huge_page(struct vm_area_struct *vma, pud_t *pud,
+				     unsigned long haddr)
+{
+	return ndckpt_huge_pages && vma_is_anonymous(vma) &&
+	       !(vma->vm_flags & VM_SHARED) && haddr >= vma->vm_start &&
+	       haddr + PMD_SIZE <= vma->vm_end &&
+	       ndckpt_is_pud_points_nvdimm_page(*pud);
+}
+
+static void ndckpt_map_zeroed_huge_page(struct vm_area_struct *vma,
+					pmd_t *pmd, unsigned long haddr,
+					bool dirty)
+{
+	uint64_t paddr;
+	spinlock_t *ptl;
+	pmd_t entry;
+
+	paddr = ndckpt_virt_to_phys(ndckpt_alloc_zeroed_huge_page());
+	entry = pmd_mkhuge(pfn_pmd(paddr >> PAGE_SHIFT, vma->vm_page_prot));
+	if (vma->vm_flags & VM_WRITE)
+		entry = pmd_mkwrite(entry);
+	if (dirty)
+		entry = pmd_mkdirty(entry);
+	ptl = ndckpt_pmd_lock(vma->vm_mm, pmd);
+	if (!pmd_none(*pmd)) {
+		// Populated by another thread. The page is just wasted.
+		spin_unlock(ptl);
+		return;
+	}
+	set_pmd_at(vma->vm_mm, haddr, pmd, entry);
+	ndckpt_clwb(pmd);
+	spin_unlock(ptl);
+	/* No need to invalidate - it was non-present before */
+}
+
+static vm_fault_t handle_pmd_fault_ndckpt(struct vm_fault *vmf)
+{
+	// Map a 2MiB NVDIMM page if the aligned range fits in the vma.
+	// Generic THP is not used since it needs struct page for the page.
+	// Returns VM_FAULT_FALLBACK to map 4KiB pages instead, which is also
+	// the case of read faults mapping the zero page.
+	struct vm_area_struct *vma = vmf->vma;
+	unsigned long haddr = vmf->address & PMD_MASK;
+	pmd_t orig_pmd = *vmf->pmd;
+	bool split = false;
+
+	if (ndckpt_is_pmd_huge(orig_pmd)) {
+		if ((vmf->flags & FAULT_FLAG_WRITE) && !pmd_write(orig_pmd)) {
+			// Handled per 4KiB by handle_pte_fault_ndckpt()
+			vmf->ptl = ndckpt_pmd_lock(vma->vm_mm, vmf->pmd);
+			if (pmd_same(*vmf->pmd, orig_pmd)) {
+				ndckpt_split_huge_pmd(vmf->pmd);
+				split = true;
+			}
+			spin_unlock(vmf->ptl);
+			if (split)
+				flush_tlb_mm_range(vma->vm_mm, haddr,
+						   haddr + PMD_SIZE, PMD_SHIFT,
+						   true);
+			return VM_FAULT_FALLBACK;
+		}
+		// Raced with another thread
+		return 0;
+	}
+	if (!pmd_none(orig_pmd) ||
+	    !ndckpt_can_map_huge_page(vma, vmf->pud, haddr) ||
+	    (!(vmf->flags & FAULT_FLAG_WRITE) && ndckpt_zero_page))
+		return VM_FAULT_FALLBACK;
+	ndckpt_map_zeroed_huge_page(vma, vmf->pmd, haddr,
+				    vmf->flags & FAULT_FLAG_WRITE);
+	return 0;
+}
+
+long ndckpt_populate_vma_range(struct vm_area_struct *vma,
+			       unsigned long start, unsigned long end)
+{
+	// Bulk version of populate_vma_page_range() for anonymous target vmas.
+	// Instead of faulting page by page through GUP, each 2MiB page or
+	// each PT is filled at once and the whole range is fenced once.
+	// Returns the number of pages populated.
+	struct mm_struct *mm = vma->vm_mm;
+	unsigned long addr, next;
+	spinlock_t *ptl;
+	pgd_t *pgd;
+	p4d_t *p4d;
+	pud_t *pud;
+	pmd_t *pmd;
+	pte_t *pte;
+
+	ndckpt_lazy_restore_complete(mm);
+	for (addr = start; addr < end; addr = next) {
+		next = pmd_addr_end(addr, end);
+		pgd = pgd_offset(mm, addr);
+		p4d = p4d_alloc(mm, pgd, addr);
+		if (!p4d)
+			return -ENOMEM;
+		pud = ndckpt_pud_alloc(mm, p4d, addr, vma);
+		if (!pud)
+			return -ENOMEM;
+		pmd = ndckpt_pmd_alloc(mm, pud, addr, vma);
+		if (!pmd)
+			return -ENOMEM;
+		if (pmd_none(*pmd) && next - addr == PMD_SIZE &&
+		    ndckpt_can_map_huge_page(vma, pud, addr)) {
+			ndckpt_map_zeroed_huge_page(vma, pmd, addr, false);
+			continue;
+		}
+		if (ndckpt_is_pmd_huge(*pmd))
+			continue;
+		if (ndckpt_pte_alloc(mm, pmd, vma, addr))
+			return -ENOMEM;
+		ndckpt_replace_pt_locked(mm, pmd, addr);
+		pte = pte_offset_map_lock_wrapper(mm, pmd, addr, &ptl);
+		ndckpt_map_zeroed_pages(vma, pmd, addr, next);
+		ndckpt_clwb_range(pte, ((next - addr) >> PAGE_SHIFT) *
+					       sizeof(pte_t));
+		pte_unmap_unlock(pte, ptl);
+		cond_resched();
+	}
+	ndckpt_mfence();
+	return (end - start) >> PAGE_SHIFT;
+}
+
 static vm_fault_t handle_pte_fault_ndckpt(struct vm_fault *vmf)
 {
 	vm_fault_t fault_code;
@@ -3985,64 +4226,76 @@ static vm_fault_t handle_pte_fault_ndckpt(struct vm_fault *vmf)
 	}
 	if (!vmf->pte) {
 		if (!vma_is_anonymous(vmf->vma)) {
-			pr_ndckpt_fault(
-				"fault on non-anonymous page 0x%016lX\n",
-				vmf->address);
+			ndckpt_notify_fault(vmf, NDCKPT_FAULT_FILE);
 			fault_code = handle_pte_fault_body(vmf);
 			if (!vmf->pte || !pte_present(*vmf->pte))
 				return fault_code;
+			// Page cache page is mapped read-only on read faults.
+			// It is kept until the first write makes a private copy.
+			if (!pte_write(*vmf->pte))
+				return fault_code;
 			// page is mapped on dram by handle_pte_fault_body. replace it with nvdimm.
-			ndckpt_replace_page_with_nvdimm_page(vmf->pte,
-							     vmf->address);
+			ndckpt_replace_page_with_nvdimm_page(vmf->pte);
+			flush_tlb_page(vmf->vma, vmf->address);
 			validate_pgtable_for_ndckpt(vmf, 1);
 			return fault_code;
 		}
 		BUG_ON(!vma_is_anonymous(vmf->vma));
-		if ((fault_code = do_anonymous_page(vmf)))
+		ndckpt_notify_fault(vmf, NDCKPT_FAULT_ANON);
+		if ((fault_code = do_anonymous_page_ndckpt(vmf)))
 			return fault_code;
-		// vmf->pte will be set by do_anonymous_page()
+		// vmf->pte will be set by do_anonymous_page_ndckpt()
 		BUG_ON(!vmf->pte);
-		if (!ndckpt_is_phys_addr_in_nvdimm(vmf->pmd->pmd &
-						   PTE_PFN_MASK)) {
-			replace_pt_with_nvdimm_page(vmf->pmd);
-			ndckpt_invlpg((void *)vmf->address);
-		}
-		BUG_ON(ndckpt_is_phys_addr_in_nvdimm(vmf->pte->pte &
-						     PTE_PFN_MASK));
-		ndckpt_replace_page_with_nvdimm_page(vmf->pte, vmf->address);
-		pr_ndckpt_fault(
-			"fault on anonymous page 0x%016lX. pte becomes 0x%016llX\n",
-			vmf->address, (uint64_t)vmf->pte->pte);
 		validate_pgtable_for_ndckpt(vmf, 2);
 		return 0;
 	}
 	BUG_ON(!(vmf->vma->vm_flags & VM_WRITE));
+	if (ndckpt_is_pte_cow(*vmf->pte)) {
+		// Page shared with parent or child process, or the zero page
+		ndckpt_notify_fault(vmf,
+				    ndckpt_is_pte_zero_page(*vmf->pte) ?
+					    NDCKPT_FAULT_ZERO_COW :
+					    NDCKPT_FAULT_FORK_COW);
+		vmf->ptl = ndckpt_pte_lockptr(vmf->vma->vm_mm, vmf->pmd);
+		spin_lock(vmf->ptl);
+		// Another thread may have broken it already
+		if (pte_same(*vmf->pte, vmf->orig_pte))
+			ndckpt_break_cow(vmf->vma, vmf->pte,
+					 vmf->address);
+		spin_unlock(vmf->ptl);
+		validate_pgtable_for_ndckpt(vmf, 6);
+		return 0;
+	}
 	if (!vma_is_anonymous(vmf->vma) && !pte_write(*vmf->pte)) {
 		// CoW
-		pr_ndckpt_fault("CoW on non-anonymous page 0x%016lX\n",
-				vmf->address);
+		ndckpt_notify_fault(vmf, NDCKPT_FAULT_FILE_COW);
 		if (ndckpt_is_pte_points_nvdimm_page(*vmf->pte)) {
-			pte_mkwrite(*vmf->pte);
+			// Already a private copy on NVDIMM
+			vmf->ptl = ndckpt_pte_lockptr(vmf->vma->vm_mm, vmf->pmd);
+			spin_lock(vmf->ptl);
+			*vmf->pte = pte_mkwrite(pte_mkdirty(*vmf->pte));
+			spin_unlock(vmf->ptl);
 			validate_pgtable_for_ndckpt(vmf, 3);
 			return 0;
 		}
 		fault_code = handle_pte_fault_body(vmf);
 		if (pte_write(*vmf->pte)) {
-			ndckpt_replace_page_with_nvdimm_page(vmf->pte,
-							     vmf->address);
+			ndckpt_replace_page_with_nvdimm_page(vmf->pte);
+			flush_tlb_page(vmf->vma, vmf->address);
 		}
 		validate_pgtable_for_ndckpt(vmf, 4);
 		return fault_code;
 	}
-	pr_ndckpt_fault(
-		"pte fault in target vma (existed) @ 0x%016lX flags=0x%08X\n",
-		vmf->address, vmf->flags);
+	ndckpt_notify_fault(vmf, NDCKPT_FAULT_WRITE);
 	BUG_ON(!ndckpt_is_phys_addr_in_nvdimm(vmf->pud->pud & PTE_PFN_MASK));
 	BUG_ON(!ndckpt_is_phys_addr_in_nvdimm(vmf->pmd->pmd & PTE_PFN_MASK));
 	BUG_ON(!ndckpt_is_phys_addr_in_nvdimm(vmf->pte->pte & PTE_PFN_MASK));
+	vmf->ptl = ndckpt_pte_lockptr(vmf->vma->vm_mm, vmf->pmd);
+	spin_lock(vmf->ptl);
 	pte = pte_mkwrite(pte_mkdirty(*vmf->pte));
 	/* No need to invalidate - already invalidated by fault */
 	*vmf->pte = pte;
+	spin_unlock(vmf->ptl);
 	validate_pgtable_for_ndckpt(vmf, 5);
 	return 0;
 }
@@ -4160,6 +4413,14 @@ static vm_fault_t __handle_mm_fault(struct vm_area_struct *vma,
 #endif
 	if (!vmf.pmd)
 		return VM_FAULT_OOM;
+#ifdef CONFIG_NDCKPT
+	if (ndckpt_is_enabled_on_current() && ndckpt_is_target_vma(vma)) {
+		ret = handle_pmd_fault_ndckpt(&vmf);
+		if (!(ret & VM_FAULT_FALLBACK))
+			return ret;
+		return handle_pte_fault(&vmf);
+	}
+#endif
 	if (pmd_none(*vmf.pmd) && __transparent_hugepage_enabled(vma)) {
 		ret = create_huge_pmd(&vmf);
 		if (!(ret & VM_FAULT_FALLBACK))
@@ -4224,6 +4485,9 @@ vm_fault_t handle_mm_fault(struct vm_area_struct *vma, unsigned long address,
 	if (flags & FAULT_FLAG_USER)
 		mem_cgroup_enter_user_fault();
 
+#ifdef CONFIG_NDCKPT
+	ndckpt_lazy_restore_fault(vma->vm_mm, address);
+#endif
 	if (unlikely(is_vm_hugetlb_page(vma)))
 		ret = hugetlb_fault(vma->vm_mm, vma, address, flags);
 	else
@@ -33,6 +33,10 @@
 #include <asm/mmu_context.h>
 #include <asm/tlbflush.h>
 
+#ifdef CONFIG_NDCKPT
+#include "../drivers/ndckpt/ndckpt.h"
+#endif
+
 #include "internal.h"
 
 static unsigned long change_pte_range(struct vm_area_struct *vma, pmd_t *pmd,
@@ -299,6 +303,15 @@ unsigned long change_protection(struct vm_area_struct *vma, unsigned long start,
 {
 	unsigned long pages;
 
+#ifdef CONFIG_NDCKPT
+	ndckpt_lazy_restore_complete(vma->vm_mm);
+	// pte_modify() drops software bits of DRAM cached ptes.
+	ndckpt_dram_cache_evict(vma->vm_mm);
+	// 2MiB pages on NVDIMM can not go through change_huge_pmd().
+	if (ndckpt_is_target_vma(vma) &&
+	    ndckpt_is_virt_addr_in_nvdimm(vma->vm_mm->pgd))
+		ndckpt_split_huge_pages(vma->vm_mm->pgd, start, end);
+#endif
 	if (is_vm_hugetlb_page(vma))
 		pages = hugetlb_change_protection(vma, start, end, newprot);
 	else
@@ -0,0 +1,921 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Tests and benchmarks of checkpointing processes on NVDIMM (ndckpt).
+ *
+ * Needs a kernel with CONFIG_NDCKPT and a pmem device, e.g. emulated with
+ * memmap=4G!12G on the kernel command line. Skipped otherwise.
+ *
+ * Without arguments, these are run as selftests:
+ *  - commit:  a workload commits its heap several times.
+ *  - restore: a workload is killed after changing its heap without commit,
+ *             which simulates a power loss, and restored from NVDIMM.
+ *             The restored heap should be the one at the last commit.
+ *  - threads: same as restore with a workload which dirties its heap from
+ *             4 threads faulting on the same page tables.
+ *  - fork:    same as restore with a workload whose forked child writes to
+ *             the heap shared copy-on-write, which the parent should not see.
+ *  - lazy:    same as restore with /sys/kernel/ndckpt/lazy_restore set.
+ *  - huge:    same as restore with 2MiB aligned vmas and huge_pages set.
+ *  - zero:    same as restore with a workload which fills pages with zero
+ *             before commits, which should be folded into the zero page.
+ *  - loader:  same as restore with ndckpt_test_static, which is restored by
+ *             the ndckpt binfmt instead of the ELF loader.
+ *  - ptrace:  a stopped workload is committed with PTRACE_DO_NDCKPT.
+ *  - export:  a killed workload is exported with PR_EXPORT_NDCKPT, with and
+ *             without LZ4.
+ *  - import:  the exported image is imported with PR_IMPORT_NDCKPT and
+ *             restored from the imported copy.
+ * Restored workloads report the obj id in /proc/self/ndckpt, so a restore
+ * of another checkpoint fails the tests.
+ *
+ * With --bench, the workload is run with the given parameters and commit
+ * latency, restore latency, page faults and NVDIMM bytes are reported.
+ *   ndckpt_test --bench [-s heap_mb] [-d dirty_pct] [-v vmas] [-t threads]
+ *               [-n commits]
+ *
+ * The workload is this binary executed with --workload after
+ * prctl(PR_ENABLE_NDCKPT), since ndckpt can be enabled only before exec.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "../kselftest.h"
+
+#ifndef PR_ENABLE_NDCKPT
+#define PR_ENABLE_NDCKPT 57
+#endif
+#ifndef PR_EXPORT_NDCKPT
+#define PR_EXPORT_NDCKPT 58
+#define PR_NDCKPT_EXPORT_LZ4 (1UL << 0)
+#endif
+#ifndef PR_IMPORT_NDCKPT
+#define PR_IMPORT_NDCKPT 59
+#endif
+#ifndef PTRACE_DO_NDCKPT
+#define PTRACE_DO_NDCKPT 0x6b63
+#endif
+
+#define PAGE_SIZE 4096
+#define PMD_SIZE (2UL << 20)
+#define NDCKPT_SYSFS "/sys/kernel/ndckpt"
+// Export the process started or restored last. See ndckpt_export_image().
+#define EXPORT_LAST_OBJ_ID 0
+// "CKPTIMG1" at the beginning of exported images
+#define IMAGE_MAGIC 0x31474D4954504B43ULL
+
+struct params {
+	unsigned long heap_mb;
+	unsigned long dirty_pct;
+	unsigned long nr_vmas;
+	unsigned long nr_threads;
+	unsigned long nr_commits;
+};
+
+static struct params params = {
+	.heap_mb = 64,
+	.dirty_pct = 25,
+	.nr_vmas = 4,
+	.nr_threads = 1,
+	.nr_commits = 8,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Workload. Everything below is in target vmas and restored. */
+
+struct workload {
+	pid_t pid;
+	uint64_t gen;
+	// Sum of gens of pages at the last commit
+	uint64_t gen_sum;
+	uint64_t nr_pages;
+	uint64_t pages_per_vma;
+	uint8_t *vmas[64];
+};
+
+static struct workload wl;
+
+struct dirty_arg {
+	unsigned long thread;
+	uint64_t gen;
+};
+
+static inline uint64_t *page_of(uint64_t i)
+{
+	return (uint64_t *)(wl.vmas[i / wl.pages_per_vma] +
+			    (i % wl.pages_per_vma) * PAGE_SIZE);
+}
+
+static inline uint64_t pattern(uint64_t i, uint64_t gen)
+{
+	return (i << 32) ^ gen;
+}
+
+static inline int is_dirtied(uint64_t i, uint64_t gen)
+{
+	return (i * 7919 + gen * 104729) % 100 < params.dirty_pct;
+}
+
+static void *dirty_pages(void *arg)
+{
+	// Pages are interleaved so that threads fault on the same page tables.
+	struct dirty_arg *a = arg;
+	uint64_t i, j;
+
+	for (i = a->thread; i < wl.nr_pages; i += params.nr_threads) {
+		uint64_t *p = page_of(i);
+
+		if (!is_dirtied(i, a->gen))
+			continue;
+		for (j = 0; j < PAGE_SIZE / sizeof(uint64_t); j++)
+			p[j] = pattern(i, a->gen);
+	}
+	return NULL;
+}
+
+static void dirty_heap(uint64_t gen)
+{
+	pthread_t threads[64];
+	struct dirty_arg args[64];
+	unsigned long t;
+
+	for (t = 0; t < params.nr_threads; t++) {
+		args[t].thread = t;
+		args[t].gen = gen;
+		if (t)
+			pthread_create(&threads[t], NULL, dirty_pages,
+				       &args[t]);
+	}
+	dirty_pages(&args[0]);
+	for (t = 1; t < params.nr_threads; t++)
+		pthread_join(threads[t], NULL);
+}
+
+static void zero_pages(uint64_t gen)
+{
+	// Half of pages dirtied at gen are filled with zero again.
+	uint64_t i;
+
+	for (i = 0; i < wl.nr_pages; i += 2) {
+		if (is_dirtied(i, gen))
+			memset(page_of(i), 0, PAGE_SIZE);
+	}
+}
+
+static uint64_t sum_of_gens(void)
+{
+	uint64_t i, sum = 0;
+
+	for (i = 0; i < wl.nr_pages; i++)
+		sum += page_of(i)[0] & 0xffffffff;
+	return sum;
+}
+
+static int verify_heap(void)
+{
+	uint64_t i, j;
+
+	for (i = 0; i < wl.nr_pages; i++) {
+		uint64_t *p = page_of(i);
+		uint64_t gen = p[0] & 0xffffffff;
+
+		if (gen > wl.gen)
+			return -1;
+		for (j = 0; j < PAGE_SIZE / sizeof(uint64_t); j++) {
+			if (p[j] != (gen ? pattern(i, gen) : 0))
+				return -1;
+		}
+	}
+	return sum_of_gens() == wl.gen_sum ? 0 : -1;
+}
+
+static long ndckpt_commit(void)
+{
+	// execve(NULL, NULL, NULL) commits the calling process.
+	return syscall(SYS_execve, NULL, NULL, NULL);
+}
+
+static unsigned long long ndckpt_stat(pid_t pid, const char *name)
+{
+	// Value of name in /proc/<pid>/ndckpt, or 0.
+	unsigned long long v = 0;
+	char path[64], line[256];
+	size_t len = strlen(name);
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/ndckpt", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, name, len) && line[len] == ':' &&
+		    sscanf(line + len + 1, "%llu", &v) == 1)
+			break;
+	}
+	fclose(f);
+	return v;
+}
+
+static unsigned long long ndckpt_obj_id(pid_t pid)
+{
+	// Obj id of the checkpoint pid runs on, or 0.
+	return ndckpt_stat(pid, "obj_id");
+}
+
+static void check_restored(void)
+{
+	// Pid differs only if this process has been restored by another one.
+	int ok;
+
+	if (getpid() == wl.pid)
+		return;
+	ok = verify_heap() == 0;
+	dprintf(STDOUT_FILENO, "restored %llu gen %llu obj %llu %s\n",
+		(unsigned long long)now_ns(), (unsigned long long)wl.gen,
+		ndckpt_obj_id(getpid()), ok ? "ok" : "corrupted");
+	_exit(ok ? 0 : 1);
+}
+
+static int alloc_heap(void)
+{
+	uint64_t vma_size, map_size;
+	unsigned long v;
+
+	if (params.nr_vmas < 1 || params.nr_vmas > 64 ||
+	    params.nr_threads < 1 || params.nr_threads > 64)
+		return -1;
+	wl.pages_per_vma = (params.heap_mb << 20) / PAGE_SIZE / params.nr_vmas;
+	wl.nr_pages = wl.pages_per_vma * params.nr_vmas;
+	vma_size = wl.pages_per_vma * PAGE_SIZE;
+	// Vmas start at 2MiB boundaries to be mapped with huge pages.
+	map_size = vma_size + PMD_SIZE + PAGE_SIZE;
+	for (v = 0; v < params.nr_vmas; v++) {
+		uint8_t *p = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		uint8_t *start;
+
+		if (p == MAP_FAILED)
+			return -1;
+		start = (uint8_t *)(((uintptr_t)p + PMD_SIZE - 1) &
+				    ~(PMD_SIZE - 1));
+		if (start != p)
+			munmap(p, start - p);
+		// Guard page keeps vmas from being merged
+		mprotect(start + vma_size, PAGE_SIZE, PROT_NONE);
+		munmap(start + vma_size + PAGE_SIZE,
+		       p + map_size - (start + vma_size + PAGE_SIZE));
+		wl.vmas[v] = start;
+	}
+	return 0;
+}
+
+static void report_faults(uint64_t gen, uint64_t latency_ns,
+			  long minflt)
+{
+	dprintf(STDOUT_FILENO, "commit %llu latency_ns %llu minflt %ld\n",
+		(unsigned long long)gen, (unsigned long long)latency_ns,
+		minflt);
+}
+
+static long minflt_now(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_minflt;
+}
+
+enum workload_mode {
+	WORKLOAD_COMMIT,
+	// Wait to be killed after changing the heap without commit
+	WORKLOAD_CRASH,
+	// Wait to be committed by the tracer
+	WORKLOAD_PTRACE,
+	// Same as crash after a forked child writes to the heap
+	WORKLOAD_FORK,
+	// Same as crash with pages filled with zero before commits
+	WORKLOAD_ZERO,
+};
+
+static int fork_and_write_heap(uint64_t gen)
+{
+	// The child writes to all pages shared copy-on-write with this process
+	// on the checkpoint. Changes should be visible only to the child.
+	pid_t pid = fork();
+	int status;
+
+	if (pid < 0)
+		return -1;
+	if (!pid) {
+		dirty_heap(gen);
+		_exit(ndckpt_stat(getpid(), "faults_fork_cow") ? 0 : 1);
+	}
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+	    WEXITSTATUS(status))
+		return -1;
+	return verify_heap();
+}
+
+static int run_workload(enum workload_mode mode)
+{
+	uint64_t gen, t0, t1;
+	long flt, ret;
+
+	if (alloc_heap())
+		return 2;
+	wl.pid = getpid();
+	for (gen = 1; gen <= params.nr_commits; gen++) {
+		flt = minflt_now();
+		dirty_heap(gen);
+		if (mode == WORKLOAD_ZERO)
+			zero_pages(gen);
+		wl.gen = gen;
+		wl.gen_sum = sum_of_gens();
+		if (mode == WORKLOAD_PTRACE) {
+			raise(SIGSTOP);
+			check_restored();
+			dprintf(STDOUT_FILENO, "commit %llu by tracer\n",
+				(unsigned long long)gen);
+			continue;
+		}
+		t0 = now_ns();
+		ret = ndckpt_commit();
+		t1 = now_ns();
+		// A restored process returns with the saved rax
+		check_restored();
+		if (ret)
+			return 2;
+		report_faults(gen, t1 - t0, minflt_now() - flt);
+	}
+	if (verify_heap())
+		return 1;
+	if (mode == WORKLOAD_FORK && fork_and_write_heap(gen))
+		return 1;
+	if (mode == WORKLOAD_ZERO &&
+	    !ndckpt_stat(getpid(), "zero_pages_folded"))
+		return 1;
+	if (mode == WORKLOAD_CRASH || mode == WORKLOAD_FORK ||
+	    mode == WORKLOAD_ZERO) {
+		// Changes after the last commit should be lost.
+		dirty_heap(gen);
+		dprintf(STDOUT_FILENO, "ready\n");
+		for (;;)
+			pause();
+	}
+	dprintf(STDOUT_FILENO, "done\n");
+	return 0;
+}
+
+/* Harness */
+
+struct child {
+	pid_t pid;
+	FILE *out;
+};
+
+// Executed as the workload. See test_loader().
+static const char *workload_exe = "/proc/self/exe";
+
+static void format_params(char *buf, size_t size)
+{
+	snprintf(buf, size, "-s%lu -d%lu -v%lu -t%lu -n%lu", params.heap_mb,
+		 params.dirty_pct, params.nr_vmas, params.nr_threads,
+		 params.nr_commits);
+}
+
+static int spawn_workload(struct child *c, const char *mode, long obj_id,
+			  int traced)
+{
+	char s[32], d[32], v[32], t[32], n[32];
+	int fds[2];
+
+	if (pipe(fds))
+		return -1;
+	c->pid = fork();
+	if (c->pid < 0)
+		return -1;
+	if (!c->pid) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		if (traced && ptrace(PTRACE_TRACEME, 0, NULL, NULL))
+			_exit(3);
+		if (prctl(PR_ENABLE_NDCKPT, obj_id, 0, 0, 0))
+			_exit(3);
+		snprintf(s, sizeof(s), "-s%lu", params.heap_mb);
+		snprintf(d, sizeof(d), "-d%lu", params.dirty_pct);
+		snprintf(v, sizeof(v), "-v%lu", params.nr_vmas);
+		snprintf(t, sizeof(t), "-t%lu", params.nr_threads);
+		snprintf(n, sizeof(n), "-n%lu", params.nr_commits);
+		execl(workload_exe, "ndckpt_test", "--workload", mode, s,
+		      d, v, t, n, NULL);
+		_exit(3);
+	}
+	close(fds[1]);
+	c->out = fdopen(fds[0], "r");
+	return c->out ? 0 : -1;
+}
+
+static int wait_workload(struct child *c)
+{
+	int status;
+
+	fclose(c->out);
+	if (waitpid(c->pid, &status, 0) != c->pid)
+		return -1;
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
+
+struct commit_stats {
+	uint64_t nr_commits;
+	uint64_t latency_sum;
+	uint64_t latency_min;
+	uint64_t latency_max;
+	uint64_t minflt_sum;
+};
+
+static void read_commits(struct child *c, struct commit_stats *st,
+			 const char *until)
+{
+	unsigned long long gen, latency;
+	char line[256];
+	long flt;
+
+	memset(st, 0, sizeof(*st));
+	st->latency_min = UINT64_MAX;
+	while (fgets(line, sizeof(line), c->out)) {
+		if (!strncmp(line, until, strlen(until)))
+			break;
+		if (sscanf(line, "commit %llu latency_ns %llu minflt %ld", &gen,
+			   &latency, &flt) != 3)
+			continue;
+		st->nr_commits++;
+		st->latency_sum += latency;
+		st->minflt_sum += flt;
+		if (latency < st->latency_min)
+			st->latency_min = latency;
+		if (latency > st->latency_max)
+			st->latency_max = latency;
+	}
+}
+
+static void print_ndckpt_bytes(pid_t pid)
+{
+	// Counters of the process if the kernel provides them.
+	char path[64], line[256];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/ndckpt", pid);
+	f = fopen(path, "r");
+	if (!f) {
+		ksft_print_msg("nvdimm bytes: n/a (%s)\n", path);
+		return;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "bytes_", strlen("bytes_")))
+			ksft_print_msg("%s", line);
+	}
+	fclose(f);
+}
+
+static int test_commit(int verbose)
+{
+	struct commit_stats st;
+	struct child c;
+
+	if (spawn_workload(&c, "commit", 0, 0))
+		return -1;
+	read_commits(&c, &st, "done");
+	if (wait_workload(&c) || st.nr_commits != params.nr_commits)
+		return -1;
+	if (verbose) {
+		ksft_print_msg(
+			"commit latency ns: avg %llu min %llu max %llu\n",
+			(unsigned long long)(st.latency_sum / st.nr_commits),
+			(unsigned long long)st.latency_min,
+			(unsigned long long)st.latency_max);
+		ksft_print_msg("minor faults per commit: %llu\n",
+			       (unsigned long long)(st.minflt_sum /
+						    st.nr_commits));
+	}
+	return 0;
+}
+
+static int restore_workload(long obj_id, unsigned long long *restored_ns)
+{
+	// Restores obj_id and checks its heap is the one at the last commit.
+	unsigned long long gen, restored_obj_id;
+	struct child c;
+	char line[256], result[16] = "";
+
+	if (spawn_workload(&c, "commit", obj_id, 0))
+		return -1;
+	if (!fgets(line, sizeof(line), c.out) ||
+	    sscanf(line, "restored %llu gen %llu obj %llu %15s", restored_ns,
+		   &gen, &restored_obj_id, result) != 4) {
+		wait_workload(&c);
+		return -1;
+	}
+	if (wait_workload(&c) || strcmp(result, "ok") ||
+	    gen != params.nr_commits || restored_obj_id != (unsigned long long)obj_id)
+		return -1;
+	return 0;
+}
+
+static int test_restore_mode(const char *mode, int verbose)
+{
+	// Restores a workload killed after it changed the heap without commit.
+	unsigned long long restored_ns, obj_id;
+	struct commit_stats st;
+	struct child c;
+	uint64_t t0;
+
+	if (spawn_workload(&c, mode, 0, 0))
+		return -1;
+	read_commits(&c, &st, "ready");
+	obj_id = ndckpt_obj_id(c.pid);
+	if (st.nr_commits != params.nr_commits || !obj_id) {
+		kill(c.pid, SIGKILL);
+		wait_workload(&c);
+		return -1;
+	}
+	if (verbose)
+		print_ndckpt_bytes(c.pid);
+	kill(c.pid, SIGKILL);
+	if (wait_workload(&c) != 128 + SIGKILL)
+		return -1;
+
+	t0 = now_ns();
+	if (restore_workload(obj_id, &restored_ns))
+		return -1;
+	if (verbose)
+		ksft_print_msg("restore latency ns: %llu\n",
+			       (unsigned long long)(restored_ns - t0));
+	return 0;
+}
+
+static int test_restore(int verbose)
+{
+	return test_restore_mode("crash", verbose);
+}
+
+static int write_sysfs(const char *name, const char *val, char *old,
+		       size_t size)
+{
+	// Writes val to an ndckpt knob. Its old value is saved to old if any.
+	char path[128];
+	FILE *f;
+
+	snprintf(path, sizeof(path), NDCKPT_SYSFS "/%s", name);
+	if (old) {
+		f = fopen(path, "r");
+		if (!f || !fgets(old, size, f)) {
+			if (f)
+				fclose(f);
+			return -1;
+		}
+		fclose(f);
+	}
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+	fputs(val, f);
+	return fclose(f) ? -1 : 0;
+}
+
+static int test_restore_with(const char *name, const char *mode)
+{
+	// Same as test_restore() with the knob name set.
+	char old[32];
+	int ret;
+
+	if (write_sysfs(name, "1\n", old, sizeof(old)))
+		return -1;
+	ret = test_restore_mode(mode, 0);
+	write_sysfs(name, old, NULL, 0);
+	return ret;
+}
+
+static int test_fork(void)
+{
+	return test_restore_mode("fork", 0);
+}
+
+static int test_lazy(void)
+{
+	return test_restore_with("lazy_restore", "crash");
+}
+
+static int test_huge(void)
+{
+	return test_restore_with("huge_pages", "crash");
+}
+
+static int test_zero(void)
+{
+	return test_restore_with("zero_page", "zero");
+}
+
+static int test_loader(const char *exe)
+{
+	// The dynamically linked workload maps shared libraries, so it is
+	// always restored via the ELF loader. Returns 1 if skipped.
+	char path[4096];
+	ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 32);
+	char *dir_end;
+	int ret;
+
+	if (len < 0)
+		return -1;
+	path[len] = '\0';
+	dir_end = strrchr(path, '/');
+	strcpy(dir_end ? dir_end + 1 : path, exe);
+	if (access(path, X_OK))
+		return 1;
+	workload_exe = path;
+	ret = test_restore(0);
+	workload_exe = "/proc/self/exe";
+	return ret;
+}
+
+static int test_threads(void)
+{
+	unsigned long nr_threads = params.nr_threads;
+	int ret;
+
+	params.nr_threads = 4;
+	ret = test_restore(0);
+	params.nr_threads = nr_threads;
+	return ret;
+}
+
+static int test_ptrace(void)
+{
+	struct child c;
+	char line[256];
+	int status;
+	unsigned long i;
+
+	if (spawn_workload(&c, "ptrace", 0, 1))
+		return -1;
+	// Stopped on exec
+	if (waitpid(c.pid, &status, 0) != c.pid || !WIFSTOPPED(status))
+		return -1;
+	ptrace(PTRACE_CONT, c.pid, NULL, NULL);
+	for (i = 0; i < params.nr_commits; i++) {
+		if (waitpid(c.pid, &status, 0) != c.pid ||
+		    !WIFSTOPPED(status) || WSTOPSIG(status) != SIGSTOP)
+			goto fail;
+		if (ptrace(PTRACE_DO_NDCKPT, c.pid, NULL, NULL))
+			goto fail;
+		ptrace(PTRACE_CONT, c.pid, NULL, NULL);
+		if (!fgets(line, sizeof(line), c.out) ||
+		    strncmp(line, "commit", strlen("commit")))
+			goto fail;
+	}
+	ptrace(PTRACE_DETACH, c.pid, NULL, NULL);
+	read_commits(&c, &(struct commit_stats){ 0 }, "done");
+	return wait_workload(&c) ? -1 : 0;
+fail:
+	kill(c.pid, SIGKILL);
+	wait_workload(&c);
+	return -1;
+}
+
+static long export_image(FILE *f, unsigned long flags)
+{
+	// Returns the size of the image, or -1.
+	uint64_t magic = 0;
+
+	if (!prctl(PR_EXPORT_NDCKPT, EXPORT_LAST_OBJ_ID, fileno(f), flags, 0) &&
+	    pread(fileno(f), &magic, sizeof(magic), 0) == sizeof(magic) &&
+	    magic == IMAGE_MAGIC)
+		return lseek(fileno(f), 0, SEEK_END);
+	return -1;
+}
+
+static long export_to_tmpfile(unsigned long flags)
+{
+	long size;
+	FILE *f = tmpfile();
+
+	if (!f)
+		return -1;
+	size = export_image(f, flags);
+	fclose(f);
+	return size;
+}
+
+static int test_export(int verbose)
+{
+	struct commit_stats st;
+	struct child c;
+	long raw, lz4;
+
+	if (spawn_workload(&c, "crash", 0, 0))
+		return -1;
+	read_commits(&c, &st, "ready");
+	kill(c.pid, SIGKILL);
+	if (wait_workload(&c) != 128 + SIGKILL ||
+	    st.nr_commits != params.nr_commits)
+		return -1;
+	raw = export_to_tmpfile(0);
+	lz4 = export_to_tmpfile(PR_NDCKPT_EXPORT_LZ4);
+	if (raw <= 0 || lz4 <= 0 || lz4 > raw)
+		return -1;
+	if (verbose)
+		ksft_print_msg("image bytes: %ld, %ld with lz4\n", raw, lz4);
+	return 0;
+}
+
+static int test_import(int verbose)
+{
+	// Imports the image exported by test_export() and restores the copy.
+	unsigned long long restored_ns;
+	long obj_id = -1;
+	uint64_t t0 = 0, t1 = 0;
+	FILE *f = tmpfile();
+	int exe = open("/proc/self/exe", O_RDONLY);
+
+	if (f && exe >= 0 && export_image(f, PR_NDCKPT_EXPORT_LZ4) > 0 &&
+	    !lseek(fileno(f), 0, SEEK_SET)) {
+		t0 = now_ns();
+		obj_id = prctl(PR_IMPORT_NDCKPT, fileno(f), exe, 0, 0);
+		t1 = now_ns();
+	}
+	if (f)
+		fclose(f);
+	if (exe >= 0)
+		close(exe);
+	if (obj_id <= 0 || restore_workload(obj_id, &restored_ns))
+		return -1;
+	if (verbose)
+		ksft_print_msg("import latency ns: %llu\n",
+			       (unsigned long long)(t1 - t0));
+	return 0;
+}
+
+static int is_ndckpt_available(void)
+{
+	char buf[64] = "";
+	FILE *f = fopen(NDCKPT_SYSFS "/init", "r");
+
+	if (!f)
+		return 0;
+	fgets(buf, sizeof(buf), f);
+	fclose(f);
+	if (strstr(buf, "INVALID")) {
+		// Format the pmem region for checkpoints
+		f = fopen(NDCKPT_SYSFS "/init", "w");
+		if (!f)
+			return 0;
+		fputs("1\n", f);
+		fclose(f);
+	}
+	return 1;
+}
+
+static int parse_params(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:d:v:t:n:")) != -1) {
+		switch (opt) {
+		case 's':
+			params.heap_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			params.dirty_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			params.nr_vmas = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			params.nr_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			params.nr_commits = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char buf[128];
+	int bench = 0, ret;
+
+	if (argc > 2 && !strcmp(argv[1], "--workload")) {
+		const char *mode = argv[2];
+
+		optind = 3;
+		if (parse_params(argc, argv))
+			return 2;
+		if (!strcmp(mode, "crash"))
+			return run_workload(WORKLOAD_CRASH);
+		if (!strcmp(mode, "ptrace"))
+			return run_workload(WORKLOAD_PTRACE);
+		if (!strcmp(mode, "fork"))
+			return run_workload(WORKLOAD_FORK);
+		if (!strcmp(mode, "zero"))
+			return run_workload(WORKLOAD_ZERO);
+		return run_workload(WORKLOAD_COMMIT);
+	}
+	if (argc > 1 && !strcmp(argv[1], "--bench")) {
+		bench = 1;
+		optind = 2;
+	}
+	if (parse_params(argc, argv))
+		return KSFT_FAIL;
+
+	ksft_print_header();
+	if (!is_ndckpt_available())
+		ksft_exit_skip("ndckpt is not available\n");
+	format_params(buf, sizeof(buf));
+	ksft_print_msg("params: %s\n", buf);
+
+	if (bench) {
+		if (test_commit(1) || test_restore(1) || test_export(1) ||
+		    test_import(1))
+			ksft_exit_fail_msg("benchmark failed\n");
+		ksft_exit_pass();
+	}
+	if (test_commit(0))
+		ksft_test_result_fail("commit\n");
+	else
+		ksft_test_result_pass("commit\n");
+	if (test_restore(0))
+		ksft_test_result_fail("restore after kill\n");
+	else
+		ksft_test_result_pass("restore after kill\n");
+	if (test_threads())
+		ksft_test_result_fail("restore of threaded workload\n");
+	else
+		ksft_test_result_pass("restore of threaded workload\n");
+	if (test_fork())
+		ksft_test_result_fail("restore after fork COW\n");
+	else
+		ksft_test_result_pass("restore after fork COW\n");
+	if (test_lazy())
+		ksft_test_result_fail("lazy restore\n");
+	else
+		ksft_test_result_pass("lazy restore\n");
+	if (test_huge())
+		ksft_test_result_fail("restore of 2MiB pages\n");
+	else
+		ksft_test_result_pass("restore of 2MiB pages\n");
+	if (test_zero())
+		ksft_test_result_fail("restore of zero pages\n");
+	else
+		ksft_test_result_pass("restore of zero pages\n");
+	ret = test_loader("ndckpt_test_static");
+	if (ret > 0)
+		ksft_test_result_skip("restore by loader: no static workload\n");
+	else if (ret)
+		ksft_test_result_fail("restore by loader\n");
+	else
+		ksft_test_result_pass("restore by loader\n");
+	if (test_ptrace())
+		ksft_test_result_fail("commit by ptrace\n");
+	else
+		ksft_test_result_pass("commit by ptrace\n");
+	if (test_export(0))
+		ksft_test_result_fail("export\n");
+	else
+		ksft_test_result_pass("export\n");
+	if (test_import(0))
+		ksft_test_result_fail("import\n");
+	else
+		ksft_test_result_pass("import\n");
+	if (ksft_get_fail_cnt())
+		ksft_exit_fail();
+	ksft_exit_pass();
+}